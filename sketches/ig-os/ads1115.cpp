@@ -0,0 +1,238 @@
+#include "ads1115.h"
+
+/* Config register fields, see ADS1115 datasheet */
+namespace {
+  const uint16_t ConfigMuxSingle = 0x4000;  /* AINx against GND, channel in bits 12..13 */
+  const uint16_t ConfigPga4096   = 0x0200;  /* +-4.096 V full scale */
+  const uint16_t ConfigModeCont  = 0x0000;
+  const uint16_t ConfigRate250   = 0x00a0;
+  const uint16_t ConfigCompOff   = 0x0003;
+}
+
+Ads1115 ads1115(ExternalAdcAddress);
+
+Ads1115::Ads1115(uint8_t address)
+  : I2cDevice(address)
+  , m_state(StateAbsent)
+  , m_consumers{}
+  , m_channel(NumChannels)
+  , m_sampleIndex(0)
+  , m_discard(0)
+  , m_lastSample()
+  , m_conversionStart()
+  , m_samples{}
+  , m_stats{}
+{ }
+
+bool
+Ads1115::begin()
+{
+  uint16_t config;
+  if (not readRegister(RegConfig, config)) {
+    m_state = StateAbsent;
+    Debug << "ads1115 at 0x" << String(getDeviceAddress(), HEX) << " not present\n";
+    return false;
+  }
+  m_state = StateIdle;
+  m_channel = NumChannels;
+  return true;
+}
+
+void
+Ads1115::run()
+{
+  if (m_state != StateConvert) {
+    return;
+  }
+
+  Instant now = Instant::now();
+  if (now - m_lastSample < Duration::fromUs(usConversion)) {
+    return;
+  }
+  m_lastSample = now;
+
+  uint16_t value;
+  if (not readRegister(RegConversion, value)) {
+    m_stats.m_errors++;
+    return;
+  }
+  m_stats.m_conversions++;
+
+  if (m_discard) {
+    m_discard--;
+    return;
+  }
+  /* single ended inputs can't go below ground but offset may yield small negative values */
+  int16_t v = static_cast<int16_t>(value);
+  m_samples[m_sampleIndex++] = v < 0 ? 0 : v;
+  if (m_sampleIndex < SamplesPerReading) {
+    return;
+  }
+
+  Reading reading;
+  finish(reading);
+
+  uint8_t channel = m_channel;
+  Consumer* consumer = m_consumers[channel];
+  m_consumers[channel] = NULL;
+
+  /* Switch to the next channel before notifying, this way its first
+   * conversion runs while the consumer processes the reading.
+   */
+  uint8_t next = nextRequested();
+  if (next == NumChannels) {
+    m_state = StateIdle;
+  } else if (not select(next)) {
+    m_state = StateIdle;
+  }
+
+  m_stats.m_readings++;
+  if (consumer) {
+    consumer->ads1115Done(channel, reading);
+  }
+}
+
+bool
+Ads1115::enqueue(uint8_t channel, Consumer& consumer)
+{
+  if (m_state == StateAbsent or channel >= NumChannels) {
+    return false;
+  }
+  if (m_consumers[channel] and m_consumers[channel] != &consumer) {
+    return false;
+  }
+  m_consumers[channel] = &consumer;
+
+  if (m_state == StateIdle) {
+    if (not select(channel)) {
+      m_consumers[channel] = NULL;
+      return false;
+    }
+  }
+  return true;
+}
+
+void
+Ads1115::cancel(Consumer& consumer)
+{
+  for (unsigned int i = 0; i < NumChannels; i++) {
+    if (m_consumers[i] == &consumer) {
+      m_consumers[i] = NULL;
+    }
+  }
+  if (m_state == StateConvert and not m_consumers[m_channel]) {
+    uint8_t next = nextRequested();
+    if (next == NumChannels or not select(next)) {
+      m_state = StateIdle;
+    }
+  }
+}
+
+bool
+Ads1115::select(uint8_t channel)
+{
+  m_sampleIndex = 0;
+  m_conversionStart = Instant::now();
+  m_lastSample = m_conversionStart;
+
+  if (channel == m_channel) {
+    /* multiplexer already set up, conversions are running */
+    m_discard = 0;
+    m_state = StateConvert;
+    return true;
+  }
+
+  uint16_t config = ConfigMuxSingle | (channel << 12) | ConfigPga4096 |
+                    ConfigModeCont | ConfigRate250 | ConfigCompOff;
+  if (not writeRegister(RegConfig, config)) {
+    m_stats.m_errors++;
+    m_channel = NumChannels;
+    return false;
+  }
+  m_stats.m_switches++;
+  m_channel = channel;
+  m_discard = SamplesDiscarded;
+  m_state = StateConvert;
+  return true;
+}
+
+uint8_t
+Ads1115::nextRequested() const
+{
+  for (unsigned int i = 1; i <= NumChannels; i++) {
+    unsigned int ch = (m_channel + i) % NumChannels;
+    if (m_consumers[ch]) {
+      return ch;
+    }
+  }
+  return NumChannels;
+}
+
+void
+Ads1115::finish(Reading& reading)
+{
+  uint16_t min = UINT16_MAX, max = 0;
+  uint32_t sum = 0;
+  uint64_t sumSq = 0;
+  const unsigned int n = SamplesPerReading;
+
+  for (unsigned int i = 0; i < n; i++) {
+    uint16_t v = m_samples[i];
+    min = v < min ? v : min;
+    max = v > max ? v : max;
+    sum += v;
+    sumSq += (uint32_t)v * v;
+  }
+
+  /* Single ended conversions are 15 bit, scaling them by 2 to 16 bit
+   * full scale multiplies the radicand of the standard deviation by 4.
+   */
+  uint64_t var = (uint64_t)n * sumSq - (uint64_t)sum * sum;
+  reading.m_noise.m_stdDev = isqrt(var * 4) / n;
+  reading.m_noise.m_min = min << 1;
+  reading.m_noise.m_max = max << 1;
+  reading.m_noise.m_numSamples = n;
+  reading.m_raw = (sum << 1) / n;
+  reading.m_durationUs = m_conversionStart.elapsed().toUs();
+}
+
+bool
+Ads1115::writeRegister(uint8_t reg, uint16_t value)
+{
+  Wire.beginTransmission(getDeviceAddress());
+  Wire.write(reg);
+  Wire.write(value >> 8);
+  Wire.write(value & 0xff);
+  return Wire.endTransmission() == 0;
+}
+
+bool
+Ads1115::readRegister(uint8_t reg, uint16_t& value)
+{
+  Wire.beginTransmission(getDeviceAddress());
+  Wire.write(reg);
+  if (Wire.endTransmission() != 0) {
+    return false;
+  }
+  if (Wire.requestFrom(getDeviceAddress(), (uint8_t)2) != 2) {
+    return false;
+  }
+  value = Wire.read() << 8;
+  value |= Wire.read();
+  return true;
+}
+
+Print&
+Ads1115::prt(Print& p) const
+{
+  p << "           address  0x" << String(getDeviceAddress(), HEX) << "\n"
+    << "             state  " << getStateString(m_state) << "\n";
+  if (m_state == StateConvert) {
+    p << "           channel  " << m_channel + 1 << "\n";
+  }
+  p << "       conversions  " << m_stats.m_conversions << "\n"
+    << "          readings  " << m_stats.m_readings << "\n"
+    << "   channel changes  " << m_stats.m_switches << "\n"
+    << "            errors  " << m_stats.m_errors << "\n";
+  return p;
+}
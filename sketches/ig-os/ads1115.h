@@ -0,0 +1,125 @@
+#ifndef EW_IG_ADS1115_H
+#define EW_IG_ADS1115_H
+
+#include "config.h"
+#include "circuit.h"
+#include "i2c.h"
+
+/** Driver for an external ADS1115 16 bit I2C ADC with four single ended inputs.
+ *
+ * The converter runs in continuous conversion mode. The driver scans all
+ * channels which have a pending request round robin: when the last sample
+ * of a channel has been read the multiplexer is switched to the next
+ * requested channel right away, so the next conversion is already running
+ * while the finished reading is delivered. If only one channel is
+ * requested the multiplexer is never touched and every conversion yields
+ * a sample.
+ *
+ * Up to four converters can share the bus (address 0x48 .. 0x4b).
+ */
+class Ads1115
+  : public I2cDevice
+{
+public:
+  static const unsigned int NumChannels = 4;
+  /** Samples averaged to a single reading */
+  static const unsigned int SamplesPerReading = 8;
+  /** Conversions discarded after switching the multiplexer */
+  static const unsigned int SamplesDiscarded = 1;
+  /** Conversion period at 250 SPS plus 10% for the internal oscillator tolerance */
+  static const unsigned int usConversion = 4400;
+
+  typedef enum
+  {
+    StateAbsent = 0,
+    StateIdle,
+    StateConvert,
+  } State;
+
+  struct Reading
+  {
+    /** Reading normalized to 16 bit full scale */
+    uint16_t m_raw;
+    Sensor::Noise m_noise;
+    uint32_t m_durationUs;
+  };
+
+  /** Interface of everyone requesting conversions */
+  class Consumer
+  {
+  public:
+    /** Called when the requested conversion has completed */
+    virtual void ads1115Done(uint8_t channel, const Reading& reading) = 0;
+  };
+
+  struct Stats
+  {
+    uint32_t m_conversions;
+    uint32_t m_readings;
+    uint32_t m_switches;
+    uint32_t m_errors;
+  };
+
+  Ads1115(uint8_t address);
+  /** Probes the converter, returns false if it does not respond. */
+  bool begin();
+  void run();
+
+  /** Requests a reading of a channel. Returns false if the converter is
+   *  absent or the channel is already requested by someone else.
+   */
+  bool enqueue(uint8_t channel, Consumer& consumer);
+  /** Removes all requests of a consumer. */
+  void cancel(Consumer& consumer);
+
+  State getState() const
+  {
+    return m_state;
+  }
+  static const char* getStateString(State state)
+  {
+    switch (state) {
+      case StateAbsent:  return "absent";
+      case StateIdle:    return "idle";
+      case StateConvert: return "converting";
+      default:           return "unknown";
+    }
+  }
+  const Stats& getStats() const
+  {
+    return m_stats;
+  }
+  void clearStats()
+  {
+    m_stats = Stats{};
+  }
+  Print& prt(Print& p) const;
+
+private:
+  enum
+  {
+    RegConversion = 0,
+    RegConfig     = 1,
+  };
+  bool writeRegister(uint8_t reg, uint16_t value);
+  bool readRegister(uint8_t reg, uint16_t& value);
+  /** Starts continuous conversion on a channel */
+  bool select(uint8_t channel);
+  /** Next requested channel after the current one or NumChannels if none */
+  uint8_t nextRequested() const;
+  void finish(Reading& reading);
+
+  State m_state;
+  Consumer* m_consumers[NumChannels];
+  uint8_t m_channel;
+  uint8_t m_sampleIndex;
+  uint8_t m_discard;
+  Instant m_lastSample;
+  Instant m_conversionStart;
+  uint16_t m_samples[SamplesPerReading];
+  Stats m_stats;
+};
+
+extern Ads1115 ads1115;
+
+#endif /* EW_IG_ADS1115_H */
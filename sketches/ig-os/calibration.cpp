@@ -0,0 +1,84 @@
+#include "calibration.h"
+#include "config.h"
+
+uint8_t
+Calibration::apply(uint16_t raw) const
+{
+  if (not isCalibrated()) {
+    return uncalibrated(raw);
+  }
+
+  const Point* p = m_table.m_points;
+  const uint8_t n = m_table.m_numPoints;
+
+  if (raw <= p[0].m_raw) {
+    return p[0].m_value;
+  }
+  if (raw >= p[n - 1].m_raw) {
+    return p[n - 1].m_value;
+  }
+
+  uint8_t i = 1;
+  while (raw > p[i].m_raw) {
+    i++;
+  }
+
+  const Point& a = p[i - 1];
+  const Point& b = p[i];
+
+  /* dr * dv is at most 65535 * 255 and fits into 32 bits */
+  int32_t num = (int32_t)(raw - a.m_raw) * ((int32_t)b.m_value - (int32_t)a.m_value);
+  int32_t den = (int32_t)b.m_raw - (int32_t)a.m_raw;
+
+  /* round to nearest */
+  int32_t q = (num >= 0 ? num + den / 2 : num - den / 2) / den;
+
+  return (uint8_t)((int32_t)a.m_value + q);
+}
+
+bool
+Calibration::setPoint(uint16_t raw, uint8_t value)
+{
+  Point* p = m_table.m_points;
+
+  /* Drop points which would collide with the new one */
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < m_table.m_numPoints; i++) {
+    if (p[i].m_raw != raw and p[i].m_value != value) {
+      p[n++] = p[i];
+    }
+  }
+  m_table.m_numPoints = n;
+
+  if (n == MaxPoints) {
+    return false;
+  }
+
+  /* Insert sorted by raw value */
+  uint8_t k = n;
+  for (; k > 0 and p[k - 1].m_raw > raw; k--) {
+    p[k] = p[k - 1];
+  }
+  p[k].m_raw = raw;
+  p[k].m_value = value;
+
+  m_table.m_numPoints = n + 1;
+
+  return true;
+}
+
+Print&
+Calibration::prt(Print& p) const
+{
+  if (not isCalibrated()) {
+    p << "uncalibrated";
+    if (m_table.m_numPoints) {
+      p << " (" << m_table.m_numPoints << " point)";
+    }
+    p << "\n";
+  }
+  for (uint8_t i = 0; i < m_table.m_numPoints; i++) {
+    prtFmt(p, "  raw %5u -> %3u\n", m_table.m_points[i].m_raw, m_table.m_points[i].m_value);
+  }
+  return p;
+}
@@ -0,0 +1,79 @@
+#ifndef EW_IG_CALIBRATION_H
+#define EW_IG_CALIBRATION_H
+
+#include <Arduino.h>
+
+/** Per sensor calibration curve.
+ *
+ * Sensors deliver a raw reading normalized to 16 bit full scale (a 10 bit
+ * ADC reading is shifted left by 6). The calibration maps this raw reading
+ * onto the 0 .. 255 range the thresholds are expressed in by piecewise
+ * linear interpolation between up to MaxPoints captured points. Only
+ * integer arithmetic is used.
+ *
+ * A table with less than two points is considered uncalibrated and the
+ * legacy mapping (8 most significant bits, inverted) is applied.
+ */
+class Calibration
+{
+public:
+  static const uint8_t MaxPoints = 4;
+
+  static const uint8_t ValueDry = 0;
+  static const uint8_t ValueWet = 255;
+
+  struct Point
+  {
+    uint16_t m_raw;
+    uint8_t  m_value;
+  };
+
+  /** Calibration table as stored in flash. Points are kept sorted by
+   *  ascending raw value.
+   */
+  struct Table
+  {
+    uint8_t m_numPoints;
+    Point   m_points[MaxPoints];
+  };
+
+  Calibration(Table& table)
+    : m_table(table)
+  { }
+
+  bool isCalibrated() const
+  {
+    return m_table.m_numPoints >= 2;
+  }
+
+  const Table& getTable() const
+  {
+    return m_table;
+  }
+
+  /** Maps a raw reading onto 0 .. 255. Readings outside the calibrated range are clamped to the outermost points. */
+  uint8_t apply(uint16_t raw) const;
+
+  /** Adds or replaces a point. A point with the same value or the same raw reading is replaced.
+   *  Returns false if the table is full.
+   */
+  bool setPoint(uint16_t raw, uint8_t value);
+
+  void clear()
+  {
+    m_table.m_numPoints = 0;
+  }
+
+  /** Mapping used for uncalibrated sensors: high readings are dry. */
+  static uint8_t uncalibrated(uint16_t raw)
+  {
+    return 255 - (raw >> 8);
+  }
+
+  Print& prt(Print& p) const;
+
+private:
+  Table& m_table;
+};
+
+#endif /* EW_IG_CALIBRATION_H */
@@ -7,7 +7,8 @@ WaterCircuit::WaterCircuit(const unsigned int& id,
                            Valve& valve,
                            Pump& pump,
                            Sensor& reservoir,
-                           Settings& settings)
+                           Settings& settings,
+                           PowerBudget& budget)
     : m_id(id)
     , m_settings(settings)
     
@@ -15,10 +16,14 @@ WaterCircuit::WaterCircuit(const unsigned int& id,
     , m_valve(valve)
     , m_pump(pump)
     , m_reservoir(reservoir)
+    , m_budget(budget)
+    , m_valveMa(0)
 
     , m_state(StateIdle)
     , m_iterations(0)
     , m_currentHumidity(0)
+    , m_cyclePumpSeconds(0)
+    , m_watered(false)
   { }
 
 const char*
@@ -48,11 +53,12 @@ WaterCircuit::begin()
 }
 
 void
-WaterCircuit::trigger()
+WaterCircuit::trigger(uint8_t pumpSeconds)
 {
   if (m_state != StateIdle) {
     return;
   }
+  m_cyclePumpSeconds = pumpSeconds ? pumpSeconds : m_settings.m_pumpSeconds;
   m_state = StateWaitSensor;
   m_iterations = 0;
   dbg() << "state: " << getStateString(m_state) << "\n";
@@ -74,6 +80,12 @@ WaterCircuit::run()
     case StateSense:
       m_sensor.run();
       if (m_sensor.getState() == Sensor::StateReady) {
+        if (not m_sensor.isValid()) {
+          m_sensor.disable();
+          m_state = StateIdle;
+          err() << "sensor failed, state: " << getStateString(m_state) << "\n";
+          break;
+        }
         m_currentHumidity = m_sensor.read();
         m_sensor.disable();
         
@@ -109,13 +121,19 @@ WaterCircuit::run()
     case StateSenseReservoir:
       m_reservoir.run();
       if (m_reservoir.getState() == Sensor::StateReady) {
+        if (not m_reservoir.isValid()) {
+          m_reservoir.disable();
+          m_state = StateIdle;
+          err() << "reservoir sensor failed, state: " << getStateString(m_state) << "\n";
+          break;
+        }
         
         auto fill = m_reservoir.read();
         m_reservoir.disable();
         
         if (fill < m_settings.m_threshReservoir) {
           
-          m_reservoirEmptyMillis = millis();
+          m_recheckReservoirDeadline.start(Duration::fromMinutes(RecheckReservoirMinutes));
           m_state = StateReservoirEmpty;
           
           err() << "reservoir empty, read: " << fill << ", thresh: " << m_settings.m_threshReservoir << ". state: " << getStateString(m_state) << "\n";
@@ -129,24 +147,21 @@ WaterCircuit::run()
       }
       break;
     case StateWaitPump:
-      if (not m_pump.isEnabled()) {
-        m_valve.open();
-        m_pump.enable();
+      if (startPump()) {
         m_state = StatePump;
         dbg() << "state: " << getStateString(m_state) << "\n";
       }
       break;
     case StatePump:
-      if (m_pump.secondsEnabled() >= m_settings.m_pumpSeconds) {
-        m_pump.disable();
-        m_valve.close();
-        m_soakStartMillis = millis();
+      if (m_pumpDeadline.expired()) {
+        stopPump();
+        m_soakDeadline.start(Duration::fromMinutes(m_settings.m_soakMinutes));
         m_state = StateSoak;
         dbg() << "state: " << getStateString(m_state) << "\n";
       }
       break;
     case StateSoak:
-      if ((millis() - m_soakStartMillis) / (60 * 1000) > m_settings.m_soakMinutes) {
+      if (m_soakDeadline.expired()) {
         m_iterations++;
         if (m_iterations >= m_settings.m_maxIterations) {
           m_state = StateIdle;
@@ -160,9 +175,9 @@ WaterCircuit::run()
       break;
 
     case StateReservoirEmpty:
-      if (millis() - m_reservoirEmptyMillis > RecheckReservoirMs) {
+      if (m_recheckReservoirDeadline.expired()) {
         m_state = StateWaitReservoir;
-        dbg() << "rechecking reservoir after waiting for " << RecheckReservoirMs / 60UL / 1000UL << " minutes, state: " << getStateString(m_state) << "\n";
+        dbg() << "rechecking reservoir after waiting for " << RecheckReservoirMinutes << " minutes, state: " << getStateString(m_state) << "\n";
       }
       break;
   }
@@ -179,14 +194,40 @@ WaterCircuit::reset()
       m_reservoir.disable();
     }
     if (m_state == StatePump) {
-      m_pump.disable();
-      m_valve.close();
+      stopPump();
     }
     m_state = StateIdle;
     dbg() << "state: " << getStateString(m_state) << " (by reset)\n";
   }
 }
 
+bool
+WaterCircuit::startPump()
+{
+  /* A pump already running for another circuit costs nothing extra */
+  uint16_t ma = m_budget.getValveMa();
+  if (not m_budget.acquire(ma, &m_pump)) {
+    return false;
+  }
+  m_valveMa = ma;
+  m_valve.open();
+  m_pump.enable();
+  m_pumpDeadline.start(Duration::fromSeconds(m_cyclePumpSeconds));
+  return true;
+}
+
+void
+WaterCircuit::stopPump()
+{
+  m_pump.disable();
+  m_valve.close();
+  m_watered = true;
+  m_lastWatered = Instant::now();
+  /* The circuit which stops the pump releases its current */
+  m_budget.release(m_valveMa, &m_pump);
+  m_valveMa = 0;
+}
+
 /* duplicating this here since we'd like to move this code into a library */
 inline Print&
 prtFmt(Print& prt, const char *fmt, ... )
@@ -2,58 +2,169 @@
 #ifndef EW_WATER_CIRCUIT
 #define EW_WATER_CIRCUIT
 
+#include "clock.h"
+
 #include <Arduino.h>
+#include <climits>
+
+class Calibration;
 
 /**
  * Note that pumps valves sensors that are part of multiple watering circuits get their begin() member function called once for each circuit. 
- * 
- * 
- * TODO: Should migrate everything to seconds.
  */
 class Pump
 {
 public:
   Pump()
-    : m_enabled(false)
-    , m_startMillis(0)
-    , m_totalEnabledMs(0)
+    : m_users(0)
+    , m_budgetMa(0)
+    , m_start()
+    , m_totalEnabled()
+    , m_lifetime()
+    , m_previousSeconds(0)
   { }
   virtual void begin() {};
+  /** A pump can be shared by circuits watering at the same time. It runs
+   *  as long as at least one of them has it enabled.
+   */
   virtual void enable()
   {
-    m_startMillis = millis();
-    m_enabled = true;
+    if (m_users++ == 0) {
+      m_start = Instant::now();
+    }
   }
   virtual void disable()
   {
-    if (m_enabled) {
-      m_enabled = false;
-      m_totalEnabledMs += millis() - m_startMillis;
+    if (not m_users) {
+      return;
+    }
+    if (--m_users == 0) {
+      Duration d = m_start.elapsed();
+      m_totalEnabled += d;
+      m_lifetime += d;
     }
   }
   bool isEnabled() const
   {
-    return m_enabled;
+    return m_users > 0;
+  }
+  uint8_t getUsers() const
+  {
+    return m_users;
   }
   unsigned int secondsEnabled() const
   {
-    if (not m_enabled) {
+    if (not isEnabled()) {
       return 0;
     }
-    return (millis() - m_startMillis) / 1000;
+    return m_start.elapsed().toSeconds();
   }
   unsigned int getTotalEnabledSeconds(bool clear = false)
   {
-    unsigned long long ret = m_totalEnabledMs;
+    Duration ret = m_totalEnabled;
     if (clear) {
-      m_totalEnabledMs = 0;
+      m_totalEnabled = Duration();
+    }
+    return ret.toSeconds();
+  }
+  /** Run time before this boot, restored from persistent storage */
+  void setPreviousSeconds(unsigned long seconds)
+  {
+    m_previousSeconds = seconds;
+  }
+  /** Run time including the time before this boot, not affected by clearing the total */
+  unsigned long getLifetimeSeconds() const
+  {
+    return m_previousSeconds + m_lifetime.toSeconds();
+  }
+private:
+  friend class PowerBudget;
+
+  uint8_t m_users;
+  /** Supply current the power budget holds for the pump until it stops */
+  uint16_t m_budgetMa;
+  Instant m_start;
+  Duration m_totalEnabled;
+  Duration m_lifetime;
+  unsigned long m_previousSeconds;
+};
+
+/** Supply current budget shared by all circuits.
+ *
+ * A circuit opens its valve and enables its pump only if their current
+ * fits into the budget, so the number of circuits watering in parallel is
+ * limited by what the supply can deliver. A pump already running for
+ * another circuit costs nothing extra.
+ *
+ * Valves open in parallel on one pump split its flow. A circuit then gets
+ * less water per pump second than when it waters alone, so the pump times
+ * are only a measure of the delivered volume with serial watering.
+ */
+class PowerBudget
+{
+public:
+  struct Settings
+  {
+    /** Current the supply can deliver to pumps and valves */
+    uint16_t m_supplyMa;
+    /** Current drawn by a running pump */
+    uint16_t m_pumpMa;
+    /** Current drawn by an open valve */
+    uint16_t m_valveMa;
+  };
+
+  PowerBudget(Settings& settings)
+    : m_settings(settings)
+    , m_usedMa(0)
+    , m_peakMa(0)
+  { }
+
+  /** Reserves the current if it fits, plus the current of the pump if the
+   *  budget doesn't hold it yet. If nothing is active the request is always
+   *  granted so that a too small budget can not block watering. The caller
+   *  keeps ma and releases exactly that, the pump current is held by the
+   *  pump until it stops, so changing the settings meanwhile doesn't leak
+   *  current.
+   */
+  bool acquire(uint16_t ma, Pump* pump = NULL)
+  {
+    uint16_t pumpMa = pump and not pump->m_budgetMa ? m_settings.m_pumpMa : 0;
+    uint16_t total = ma + pumpMa;
+    if (m_usedMa and m_usedMa + total > m_settings.m_supplyMa) {
+      return false;
+    }
+    if (pumpMa) {
+      pump->m_budgetMa = pumpMa;
+    }
+    m_usedMa += total;
+    m_peakMa = m_usedMa > m_peakMa ? m_usedMa : m_peakMa;
+    return true;
+  }
+  /** Releases ma, plus the current the pump holds if it stopped */
+  void release(uint16_t ma, Pump* pump = NULL)
+  {
+    uint16_t total = ma;
+    if (pump and not pump->isEnabled()) {
+      total += pump->m_budgetMa;
+      pump->m_budgetMa = 0;
     }
-    return ret / 1000;
+    m_usedMa = total > m_usedMa ? 0 : m_usedMa - total;
   }
+
+  uint16_t getUsedMa() const   { return m_usedMa; }
+  uint16_t getPeakMa() const   { return m_peakMa; }
+  uint16_t getSupplyMa() const { return m_settings.m_supplyMa; }
+  uint16_t getPumpMa() const   { return m_settings.m_pumpMa; }
+  uint16_t getValveMa() const  { return m_settings.m_valveMa; }
+
+  void setSupplyMa(uint16_t ma) { m_settings.m_supplyMa = ma; }
+  void setPumpMa(uint16_t ma)   { m_settings.m_pumpMa = ma; }
+  void setValveMa(uint16_t ma)  { m_settings.m_valveMa = ma; }
+
 private:
-  bool m_enabled;
-  unsigned long m_startMillis;
-  unsigned long long m_totalEnabledMs;
+  Settings& m_settings;
+  uint16_t m_usedMa;
+  uint16_t m_peakMa;
 };
 
 /** Humidity sensor base class, all sensor types should derive from it.
@@ -70,6 +181,15 @@ public:
     StateReady,
   } State;
 
+  /** Noise statistics of a reading, all values normalized to 16 bit full scale like readRaw() */
+  struct Noise
+  {
+    uint16_t m_min;
+    uint16_t m_max;
+    uint16_t m_stdDev;
+    uint16_t m_numSamples;
+  };
+
   Sensor()
     : m_state(StateIdle)
   {
@@ -80,10 +200,36 @@ public:
   {
     return m_state;
   }
-  virtual void enable() = 0;
+  typedef enum
+  {
+    PriorityLow = 0,
+    PriorityNormal,
+    PriorityHigh,
+  } Priority;
+
+  /** Starts a conversion, sensors sharing a converter are served according to their priority */
+  virtual void enable(Priority priority = PriorityNormal) = 0;
   virtual void disable() = 0;
+  /** Calibrated reading in the range 0 .. 255 */
   virtual uint8_t read() = 0;
+  /** Raw reading normalized to 16 bit full scale */
+  virtual uint16_t readRaw() = 0;
+  /** False if the conversion failed, read() and readRaw() are meaningless then */
+  virtual bool isValid() const
+  {
+    return true;
+  }
   virtual void run() = 0;
+  /** Noise statistics of the last reading, returns false if not supported by the sensor. */
+  virtual bool getNoise(Noise& noise) const
+  {
+    return false;
+  }
+  /** Returns the sensor's calibration or NULL if the sensor can not be calibrated. */
+  virtual Calibration* getCalibration()
+  {
+    return NULL;
+  }
   static const char* getStateString(State state)
   {
     return (state == StateIdle    ? "Idle"    :
@@ -126,7 +272,7 @@ public:
   /** When reservoir is empty, recheck its state every 30 minutes.
    *  If the reservoir is refilled in the meanwhile, watering will continue.
    */
-  static const unsigned long RecheckReservoirMs = 30UL * 60UL * 1000UL;
+  static const unsigned int RecheckReservoirMinutes = 30;
 
   /**
    * 
@@ -172,7 +318,8 @@ public:
                Valve& valve,
                Pump& pump,
                Sensor& reservoir,
-               Settings& settings);
+               Settings& settings,
+               PowerBudget& budget);
 
   State getState() const
   {
@@ -187,7 +334,8 @@ public:
   }
 
   void begin();
-  void trigger();
+  /** Starts a watering cycle, a non zero pumpSeconds overrides the pump time of this cycle */
+  void trigger(uint8_t pumpSeconds = 0);
   void run();
   void reset();
 
@@ -209,6 +357,11 @@ public:
   void setMaxIterations(uint8_t i) const { m_settings.m_maxIterations = i; }
 
   uint8_t getHumidity()    const { return m_currentHumidity; }
+  /** Seconds since the pump last stopped for this circuit or ULONG_MAX if it never ran */
+  unsigned long getSecondsSinceWatered() const
+  {
+    return m_watered ? m_lastWatered.elapsed().toSeconds() : ULONG_MAX;
+  }
   uint8_t getNumIterations() const { return m_iterations; }
 
   bool isEnabled() const
@@ -229,6 +382,10 @@ protected:
 //  virtual Time& time() const {}
 
 private:
+  /** Starts pump and valve if the power budget allows it */
+  bool startPump();
+  void stopPump();
+
   /** Watering circuit ID */
   unsigned int m_id;
   Settings& m_settings;
@@ -237,14 +394,22 @@ private:
   Valve& m_valve;
   Pump& m_pump;
   Sensor& m_reservoir;
+  PowerBudget& m_budget;
+  /** Valve current acquired from the budget while pumping */
+  uint16_t m_valveMa;
   
   /* State variables */
   State m_state;
   /** detect issues when a circuits waters forever */
   uint8_t m_iterations;
   uint8_t m_currentHumidity;
-  unsigned long m_soakStartMillis;
-  unsigned long m_reservoirEmptyMillis;
+  /** Pump time of the current cycle */
+  uint8_t m_cyclePumpSeconds;
+  Deadline m_pumpDeadline;
+  Deadline m_soakDeadline;
+  Deadline m_recheckReservoirDeadline;
+  bool m_watered;
+  Instant m_lastWatered;
 
   /* TODO: statistics */
 };
@@ -6,18 +6,23 @@
 #include "spi.h"
 #include "network.h"
 #include "settings.h"
+#include "calibration.h"
+#include "ads1115.h"
+#include "temperature.h"
+#include "scheduler.h"
+#include "rules.h"
+#include "eeprom.h"
+#include "timeseries.h"
+#include "kvstore.h"
 
 #include <StreamCmd.h>
-#include <OneWire.h>
 #include <Wire.h>
 
-OneWire oneWireBus(OneWirePin);
-
 const char* helpGeneral = 
   "help\n"
   "  print this help\n"
   "time\n"
-  "  display current time\n"
+  "  display current time, time source and RTC drift\n"
   "mode <off, auto, man>\n"
   "  switch the intelligüss mode\n"
   "hist [a] [b]\n"
@@ -31,6 +36,23 @@ const char* helpGeneral =
   "    off  disable debug logging\n"
   "version\n"
   "  print IG-OS version\n"
+  "stat\n"
+  "  print runtime statistics\n"
+  "save [info]\n"
+  "  settings changes are saved to flash a few seconds after the last one,\n"
+  "  save commits them now\n"
+  "    info\n"
+  "      print pending changes, number of commits and commit times\n"
+  "ow [scan|res <bits>|assign <dev> <id|none>|forget]\n"
+  "  print the 1-wire temperature sensors and start a new conversion\n"
+  "    scan\n"
+  "      search the bus for new temperature sensors\n"
+  "    assign <dev> <id|none>\n"
+  "      assign sensor <dev> to the circuit with ID <id>\n"
+  "    forget\n"
+  "      remove missing sensors from the stored device list\n"
+  "    res <bits>\n"
+  "      set the resolution, 9 bit (94 ms) .. 12 bit (750 ms)\n"
 ;
 const char* helpCircuit = 
   "c.trig [id]\n"
@@ -64,6 +86,31 @@ const char* helpCircuit =
   "      set maximum number of iterations, range 0 .. 255\n"
   "c.stop <id>\n"
   "  stop any watering/measuring activity on circuit <id> and return it to idle\n"
+  "c.power [param]\n"
+  "  without [param] the power budget and its usage is printed\n"
+  "  the budget limits how many circuits water in parallel, circuits sharing\n"
+  "  a pump split its flow and get less water per pump second\n"
+  "  [param] must be one of:\n"
+  "    supply <mA>\n"
+  "      current the supply can deliver to pumps and valves\n"
+  "    pump <mA>\n"
+  "      current drawn by a running pump\n"
+  "    valve <mA>\n"
+  "      current drawn by an open valve\n"
+  "c.cal <id> [point]\n"
+  "  calibrate the sensor of circuit with ID <id>\n"
+  "  without [point] the calibration table is printed\n"
+  "  [point] must be one of:\n"
+  "    dry\n"
+  "      capture the current reading as dry (0), probe in dry soil\n"
+  "    wet\n"
+  "      capture the current reading as wet (255), probe in saturated soil\n"
+  "    <value>\n"
+  "      capture the current reading as <value>, range 0 .. 255\n"
+  "    clear\n"
+  "      remove the calibration\n"
+  "c.rcal <id> [point]\n"
+  "  calibrate the reservoir sensor of circuit with ID <id>, see c.cal\n"
 ;
 
 const char* helpLogger = 
@@ -86,11 +133,90 @@ const char* helpLogger =
 
 const char* helpScheduler = 
   "s.info\n"
-  "  print scheduler configuration\n"
-  "s.set <index> <time>\n"
-  "  configure scheduler whereas\n"
-  "    <index> is the entry number between 1 and "  /*<< NumSchedulerTimes << */ "8\n"
-  "    <time> is the time formatted \"hh:mm\" or \"off\"\n"
+  "  print schedule\n"
+  "s.add <time> [params]\n"
+  "  add a schedule entry firing at <time> formatted \"hh:mm\"\n"
+  "  [params] are optional, by default the entry fires daily for all circuits:\n"
+  "    days <all|weekdays|weekend|list>\n"
+  "      days of the week, e.g. \"mo,we,fr\"\n"
+  "    every <n>\n"
+  "      fire every <n> days, starting with the next time due,\n"
+  "      requires a valid time\n"
+  "    circ <all|list>\n"
+  "      circuits to be triggered, e.g. \"1,3\"\n"
+  "    pump <seconds>\n"
+  "      pump time override, 0 uses the circuits' pump time\n"
+  "s.set <index> <time> [params]\n"
+  "  change the schedule entry <index>, see s.add\n"
+  "s.del <index>\n"
+  "  remove the schedule entry <index>\n"
+  "s.grace <minutes>\n"
+  "  entries which could not fire on time (e.g. reboot, no network time)\n"
+  "  still fire if late by no more than <minutes>, see s.catch\n"
+  "s.catch <skip|once|within>\n"
+  "  what to do with late entries:\n"
+  "    skip: don't fire, once: fire no matter how late,\n"
+  "    within: fire if within the grace window\n"
+;
+
+const char* helpRules =
+  "r.info\n"
+  "  print the rules, their bytecode, last results and statistics\n"
+  "r.add if <condition> then trigger <circuit> [pump <seconds>]\n"
+  "  add a watering rule, <condition> combines comparisons with\n"
+  "  \"and\", \"or\", \"not\" and parentheses. operands:\n"
+  "    circuit <id> humidity, circuit <id> temp, reservoir, hour, weekday\n"
+  "  compared with <, <=, >, >=, ==, != against a number or\n"
+  "    hour in 6..20, weekday in 1..5\n"
+  "    circuit <id> watered in <duration>, e.g. 90m, 4h, 2d\n"
+  "  example:\n"
+  "    r.add if circuit 3 humidity < 140 and not watered in 4h then trigger 3\n"
+  "r.del <index>\n"
+  "  remove the rule <index>\n"
+  "r.int <minutes>\n"
+  "  rule evaluation interval, 0 disables the rules\n"
+  "r.eval\n"
+  "  evaluate the rules now against the last sensor readings\n"
+;
+
+const char* helpData =
+  "d.info\n"
+  "  print the usage of the readings stored on the EEPROM, it holds almost\n"
+  "  five days of hourly readings of four circuits or three weeks of one\n"
+  "d.show [hours] [id]\n"
+  "  print the readings of the last [hours] hours (default 24),\n"
+  "  of all circuits or the circuit with ID [id] only\n"
+  "d.clear\n"
+  "  erase all stored readings\n"
+  "d.kv\n"
+  "  print the key value store holding pump run times and schedule stamps\n"
+;
+
+const char* helpAdc = 
+  "a.info\n"
+  "  print ADC configuration and settling time statistics\n"
+  "  and the state of the external ADC if used\n"
+  "a.read <channel>\n"
+  "  read a raw ADC channel, 1 .. 8 are the onboard multiplexer inputs,\n"
+  "  the inputs of an external multiplexer follow\n"
+  "a.set <param>\n"
+  "  configure the ADC\n"
+  "  <param> must be one of:\n"
+  "    settle <on|off>\n"
+  "      on: detect when the input has settled, off: use fixed delays\n"
+  "    tol <counts>\n"
+  "      maximum difference of successive samples, range 0 .. 255\n"
+  "    count <n>\n"
+  "      number of successive agreeing samples, range 1 .. 255\n"
+  "    acq <spaced|burst>\n"
+  "      spaced: few samples at a fixed interval, burst: many samples at once,\n"
+  "      only while WiFi is off, spaced acquisition is used otherwise\n"
+  "    reduce <mean|median|trim|min>\n"
+  "      how the samples are reduced to a single reading\n"
+  "    samples <n>\n"
+  "      number of samples in burst mode, range 1 .. 256\n"
+  "    clear\n"
+  "      clear the settling time statistics\n"
 ;
 
 const char* helpNetwork = 
@@ -118,11 +244,22 @@ const char* helpNetwork =
   "      disables the telnet server\n"
   "    pass <pass>\n"
   "      sets the telnet login password to <password>\n"
+  "n.ntp [params]\n"
+  "  without [params] this prints the NTP servers and statistics\n"
+  "  [params] must be one of:\n"
+  "    server <index> <host|ip|none>\n"
+  "      set NTP server <index> (1 .. 3), the fastest replying one is used\n"
+  "    utc <minutes>\n"
+  "      offset of the local time to UTC, e.g. 120 in central european summer time\n"
+  "    poll <seconds>\n"
+  "      poll interval, range 16 .. 3600\n"
+  "    sync\n"
+  "      query the servers now\n"
 ;
    
 class Cli
   : public StreamCmd< 2, /* _NumCommandSets    */
-                     48, /* _MaxCommands       */
+                     64, /* _MaxCommands       */
                      128, /* _CommandBufferSize */
                       8> /* _MaxCommandSize    */
 {
@@ -144,12 +281,15 @@ public:
     addCommand("l.",        &Cli::cmdHelp);
     addCommand("s.",        &Cli::cmdHelp);
     addCommand("n.",        &Cli::cmdHelp);
+    addCommand("a.",        &Cli::cmdHelp);
     
     addCommand("time",      &Cli::cmdTime);
     addCommand("mode",      &Cli::cmdMode);
     addCommand("hist",      &Cli::cmdHist);
     addCommand("debug",     &Cli::cmdDebug);
     addCommand("version",   &Cli::cmdVersion);
+    addCommand("stat",      &Cli::cmdStat);
+    addCommand("save",      &Cli::cmdSave);
     
     addCommand("c.trig",    &Cli::cmdCircuitTrigger);
     addCommand("c.read",    &Cli::cmdCircuitRead);
@@ -159,14 +299,36 @@ public:
     addCommand("c.info",    &Cli::cmdCircuitInfo);
     addCommand("c.set",     &Cli::cmdCircuitSet);
     addCommand("c.stop",    &Cli::cmdCircuitStop);
+    addCommand("c.power",   &Cli::cmdCircuitPower);
+    addCommand("c.cal",     &Cli::cmdCircuitCalibrate);
+    addCommand("c.rcal",    &Cli::cmdCircuitCalibrate);
 
     addCommand("l.trig",    &Cli::cmdLogTrigger);
     addCommand("l.info",    &Cli::cmdLogInfo);
     addCommand("l.set",     &Cli::cmdLogSet);
   
     addCommand("s.info",    &Cli::cmdSchedulerInfo);
+    addCommand("s.add",     &Cli::cmdSchedulerAdd);
     addCommand("s.set",     &Cli::cmdSchedulerSet);
-  
+    addCommand("s.del",     &Cli::cmdSchedulerDelete);
+    addCommand("s.grace",   &Cli::cmdSchedulerGrace);
+    addCommand("s.catch",   &Cli::cmdSchedulerCatchUp);
+
+    addCommand("r.info",    &Cli::cmdRulesInfo);
+    addCommand("r.add",     &Cli::cmdRulesAdd);
+    addCommand("r.del",     &Cli::cmdRulesDelete);
+    addCommand("r.int",     &Cli::cmdRulesInterval);
+    addCommand("r.eval",    &Cli::cmdRulesEvaluate);
+  
+    addCommand("d.info",    &Cli::cmdDataInfo);
+    addCommand("d.show",    &Cli::cmdDataShow);
+    addCommand("d.clear",   &Cli::cmdDataClear);
+    addCommand("d.kv",      &Cli::cmdDataKv);
+
+    addCommand("a.info",    &Cli::cmdAdcInfo);
+    addCommand("a.read",    &Cli::cmdAdcRead);
+    addCommand("a.set",     &Cli::cmdAdcSet);
+
     addCommand("n.rssi",    &Cli::cmdNetworkRssi);
     addCommand("n.list",    &Cli::cmdNetworkList);
     addCommand("n.ssid",    &Cli::cmdNetworkSsid);
@@ -176,117 +338,61 @@ public:
     addCommand("n.connect", &Cli::cmdNetworkConnect);
     addCommand("n.host",    &Cli::cmdNetworkHostName);
     addCommand("n.telnet",  &Cli::cmdNetworkTelnet);
+    addCommand("n.ntp",     &Cli::cmdNetworkNtp);
 
-    addCommand("ow",        &Cli::cmdOneWireScan);
+    addCommand("ow",        &Cli::cmdOneWire);
     addCommand("i2c",       &Cli::cmdI2cScan);
     addCommand("ee",       &Cli::cmdEe);
   
     setDefaultHandler(&Cli::cmdInvalid);
   }
 
-  /* 
-   *  http://playground.arduino.cc/Learning/OneWire
-   *  https://www.pjrc.com/teensy/td_libs_OneWire.html
-   */
-
-  /** 
-   *  https://datasheets.maximintegrated.com/en/ds/DS18B20.pdf
-   *  Scratch pad layout:
-   *    BYTE 0  TEMPERATURE LSB
-   *    BYTE 1  TEMPERATURE MSB
-   *    BYTE 2  TH REGISTER OR USER BYTE 1*
-   *    BYTE 3  TL REGISTER OR USER BYTE 2*
-   *    BYTE 4  CONFIGURATION REGISTER
-   *    BYTE 5  RESERVED 
-   *    BYTE 6  RESERVED
-   *    BYTE 7  RESERVED (10h)
-   *    BYTE 8  CRC*
-   */
-  void readDS18X20(uint8_t* addr)
-  {
-    union DS18X20ScratchPad {
-      uint8_t data[12];
-      struct {
-        uint16_t temp;
-        uint8_t th;
-        uint8_t tl;
-        uint8_t config;
-        uint8_t reserved[3];
-        uint8_t crc;
-      } m;
-    } data;
-    
-    oneWireBus.reset();
-    oneWireBus.select(addr);
-    oneWireBus.write(0x44,1);         // start conversion, with parasite power on at the end
-
-    delay(1000);     // maybe 750ms is enough, maybe not -- we might do a ds.depower() here, but the reset will take care of it.
-
-    /* uint8_t present = */
-    oneWireBus.reset();
-    oneWireBus.select(addr);    
-    oneWireBus.write(0xBE);         // Read Scratchpad
-
-    /* stream() << "P = " << present << "\n"; */
-    stream() << "   scratch: ";
-    
-    for (int i = 0; i < 9; i++) {           // we need 9 bytes
-      data.data[i] = oneWireBus.read();
-      char buf[4] = {0};
-      sprintf(buf, "%02x", data.data[i]);
-      stream() << buf << " ";
-    }
-    stream() << "\n";
-    uint8_t crc = OneWire::crc8(data.data, 8);
-    if (crc != data.m.crc) {
-      char buf[4] = {0};
-      sprintf(buf, "%02x", crc);
-      stream() << "crc failed: " << buf << "\n";
-    } else {
-      float t = data.m.temp;
-      t /= 16.;
-      stream() << "      temp: " << t << " °C\n";
-    }
-  }
-  void cmdOneWireScan()
+  void cmdOneWire()
   {
-    oneWireBus.reset_search();
-    while (true) {
-      uint8_t addr[8] = {0};
-      if (not oneWireBus.search(addr)) {
-        stream() << "search done\n";        
-        break;
-      }
-      stream() << "   address: ";
-      for (unsigned int i = 0; i < sizeof(addr); i++) {
-        char buf[4] = {0};
-        sprintf(buf, "%02x", addr[i]);
-        stream() << buf << " ";
+    const char* arg = next();
+    if (arg == NULL) {
+      temperatureBus.prt(stream());
+      temperatureBus.request();
+      stream() << "conversion started, run \"ow\" again for the new readings\n";
+    } else if (strcmp(arg, "scan") == 0) {
+      temperatureBus.search();
+      flashCommitter.markDirty();
+      temperatureBus.prt(stream());
+    } else if (strcmp(arg, "assign") == 0) {
+      int dev;
+      if (getInt(dev, 1, temperatureBus.getNumDevices()) != ArgOk) {
+        stream() << "invalid device\n";
+        return;
       }
-      stream() << "\n";
-
-      if (OneWire::crc8(addr, 7) != addr[7]) {
-        stream() << "CRC of device address failed!\n";
-        continue;
+      const char* c = next();
+      if (c and strcmp(c, "none") == 0) {
+        temperatureBus.assign(dev - 1, Ds18x20Bus::NoCircuit);
+        stream() << "sensor " << dev << " unassigned\n";
+      } else {
+        int id = c ? atoi(c) : 0;
+        if (id < 1 or id > (int)NumWaterCircuits) {
+          stream() << "invalid circuit ID\n";
+          return;
+        }
+        temperatureBus.assign(dev - 1, id - 1);
+        stream() << "sensor " << dev << " assigned to circuit " << id << "\n";
       }
-
-      stream() << "    family: ";
-      
-      switch (addr[0]) {
-        case 0x10:
-          stream() << "DS18S20\n";
-          readDS18X20(addr);
-          break;
-        case 0x28:
-        case 0x20:
-          stream() << "DS18B20\n";
-          readDS18X20(addr);
-          break;
-        default:
-          stream() << "unknown\n";
-          break;        
+      flashCommitter.markDirty();
+    } else if (strcmp(arg, "forget") == 0) {
+      temperatureBus.forgetMissing();
+      flashCommitter.markDirty();
+      temperatureBus.prt(stream());
+    } else if (strcmp(arg, "res") == 0) {
+      int bits;
+      if (getInt(bits, Ds18x20Bus::MinResolution, Ds18x20Bus::MaxResolution) != ArgOk) {
+        stream() << "resolution must be between " << Ds18x20Bus::MinResolution << " and " << Ds18x20Bus::MaxResolution << " bits\n";
+        return;
       }
-      stream() << "----\n";
+      temperatureBus.setResolution(bits);
+      flashCommitter.markDirty();
+      stream() << "resolution set to " << bits << " bits\n";
+    } else {
+      stream() << "invalid parameter \"" << arg << "\"\n";
     }
   }
 
@@ -326,11 +432,19 @@ public:
 
   void cmdEe()
   {
-    stream() << "sizeof(size_t): " << sizeof(size_t) << "\n";
-    
     size_t rw(0);
-    if (getOpt(rw, "r", "w") != ArgOk) {
-      stream() << "read (r) or write (r)\n";
+    switch (getOpt(rw, "r", "w", "info")) {
+      case ArgOk:
+        break;
+      case ArgNone:
+        rw = 2;
+        break;
+      default:
+        stream() << "read (r), write (w) or info\n";
+        return;
+    }
+    if (rw == 2) {
+      eeprom.prt(stream());
       return;
     }
     unsigned int address(0);
@@ -339,18 +453,17 @@ public:
       return;
     }
 
-    const uint8_t deviceAddress = 0x50;
-
     if (rw) {
       const char* arg = next();
       if (not arg or not strlen(arg)) {
         stream() << "you must provide a string to write\n";
         return;
       }
-      I2cAt24Cxx ee;
-      ee.begin(deviceAddress);
-      ee.write(address, (const uint8_t*)arg, strlen(arg));
-      stream() << "\"" << arg << "\" written to ";
+      if (not eeprom.enqueue(address, (const uint8_t*)arg, strlen(arg))) {
+        stream() << "failed to queue write\n";
+        return;
+      }
+      stream() << "\"" << arg << "\" queued for ";
       prtFmt(stream(), "0x%04x\n", address);
     } else {
       unsigned int count(0);
@@ -360,19 +473,20 @@ public:
       }
       stream() << "reading " << count << " bytes from ";
       prtFmt(stream(), "0x%04x:\n", address);
-      I2cAt24Cxx ee;
-      ee.begin(deviceAddress);
       while (count) {
         const size_t N = 32;
         char buf[N + 1] = {0};
         size_t toread = std::min(N, count);
-        ee.read(address, (uint8_t*)buf, toread);
+        if (not eeprom.read(address, (uint8_t*)buf, toread)) {
+          stream() << "read failed";
+          break;
+        }
         stream() << buf;
         address += toread;
         count -= toread;
       }
       stream() << "\n";
-    }   
+    }
   }
   
   bool isWateringTriggered()
@@ -410,8 +524,14 @@ protected:
       stream() << helpLogger;
     } else if (strncmp(arg, "s.", 2) == 0) {
       stream() << helpScheduler;
+    } else if (strncmp(arg, "r.", 2) == 0) {
+      stream() << helpRules;
+    } else if (strncmp(arg, "d.", 2) == 0) {
+      stream() << helpData;
     } else if (strncmp(arg, "n.", 2) == 0) {
       stream() << helpNetwork;
+    } else if (strncmp(arg, "a.", 2) == 0) {
+      stream() << helpAdc;
     } else {
       stream()
         << "----------------\n"
@@ -422,6 +542,12 @@ protected:
         << helpLogger
         << "SCHEDULER\n"
         << helpScheduler
+        << "RULES\n"
+        << helpRules
+        << "DATA\n"
+        << helpData
+        << "ADC\n"
+        << helpAdc
         << "NETWORK\n"
         << helpNetwork
         << "----------------\n"
@@ -431,7 +557,11 @@ protected:
   
   void cmdTime()
   {
-    stream() << "current time: " << systemTime.getTimeStr() << "\n";
+    const SystemTime::Snapshot& now = systemTime.getSnapshot();
+    stream()
+      << "current time: " << systemTime.getTimeStr()
+      << (now.m_valid ? "" : " (invalid)") << "\n";
+    systemTime.prt(stream());
   }
   
   void cmdMode()
@@ -500,7 +630,7 @@ protected:
     }
     
     Debug.enable(flashSettings.debug);
-    flashSettings.update();
+    flashCommitter.markDirty();
   }
 
   void cmdVersion()
@@ -508,11 +638,73 @@ protected:
     PrintVersion(stream());
   }
   
+  void cmdStat()
+  {
+    stream() << "shift register:\n";
+    spi.prt(stream());
+    for (unsigned int i = 0; i < NumPumps; i++) {
+      Pump& pump = getPump(i);
+      stream() << "pump " << i + 1 << " run time  " << pump.getTotalEnabledSeconds() << " s since boot, " << pump.getLifetimeSeconds() << " s in total\n";
+    }
+  }
+  
+  void cmdSave()
+  {
+    size_t idx(0);
+    switch (getOpt(idx, "info")) {
+      case ArgOk:
+        flashCommitter.prt(stream());
+        return;
+      case ArgNone:
+        break;
+      default:
+        stream() << "invalid argument \"" << current() << "\", see \"help\" for proper use\n";
+        return;
+    }
+    if (flashCommitter.commit()) {
+      stream() << "settings saved in " << flashCommitter.getStats().m_lastMs << " ms\n";
+    } else {
+      stream() << "settings unchanged, nothing to save\n";
+    }
+  }
+
   void cmdCircuitTrigger()
   {
     m_cliTrigger = true;
   }
   
+  /** Blocks until the sensor has finished its conversion. */
+  bool sense(Sensor& s)
+  {
+    if (s.getState() != Sensor::StateIdle) {
+      stream() << "sensor is currently busy, try again later\n";
+      return false;
+    }
+    
+    s.enable(Sensor::PriorityHigh);
+    while (s.getState() != Sensor::StateReady) {
+      delay(500);
+      s.run();
+      spi.run();
+      adc.run();
+      ads1115.run();
+    }
+    if (not s.isValid()) {
+      s.disable();
+      stream() << "sensor failed\n";
+      return false;
+    }
+    return true;
+  }
+
+  void prtNoise(const Sensor& s)
+  {
+    Sensor::Noise n;
+    if (s.getNoise(n)) {
+      stream() << "  noise: min " << n.m_min << ", max " << n.m_max << ", std dev " << n.m_stdDev << " (" << n.m_numSamples << " samples)\n";
+    }
+  }
+
   void cmdCircuitRead()
   {
     int id;
@@ -524,25 +716,17 @@ protected:
     
     Sensor& s = w->getSensor();
     
-    if (s.getState() != Sensor::StateIdle) {
-      stream() << "sensor is currently active, try again later\n";
+    if (not sense(s)) {
       return;
     }
-    
-    s.enable();
-    while (s.getState() != Sensor::StateReady) {
-      delay(500);
-      s.run();
-      spi.run();
-      adc.run();
-    }
     auto h = s.read();
+    auto raw = s.readRaw();
     s.disable();
   
-    stream() << "humidity of " << id << " is " << h << "/255\n";
+    stream() << "humidity of " << id << " is " << h << "/255 (raw " << raw << ")\n";
+    prtNoise(s);
   }
   
-  // TODO: mostly same code as "read" -> combine somehow
   void cmdCircuitReservoir()
   {
     int id;
@@ -554,22 +738,126 @@ protected:
     
     Sensor& r = w->getReservoir();
     
-    if (r.getState() != Sensor::StateIdle) {
-      stream() << "reservoir sensor is currently busy, try again later\n";
+    if (not sense(r)) {
       return;
     }
-    
-    r.enable();
-    while (r.getState() != Sensor::StateReady) {
-      delay(500);
-      r.run();
-      spi.run();
-      adc.run();
-    }
     auto f = r.read();
+    auto raw = r.readRaw();
     r.disable();
   
-    stream() << "reservoir fill is " << f << "/255\n";
+    stream() << "reservoir fill is " << f << "/255 (raw " << raw << ")\n";
+    prtNoise(r);
+  }
+  
+  void cmdCircuitPower()
+  {
+    size_t idx(0);
+    enum {SUPPLY = 0, PUMP, VALVE};
+    switch (getOpt(idx, "supply", "pump", "valve")) {
+      case ArgOk:
+        break;
+      case ArgNone:
+        stream()
+          << "power budget:\n"
+          << "  supply  " << powerBudget.getSupplyMa() << " mA\n"
+          << "    pump  " << powerBudget.getPumpMa() << " mA\n"
+          << "   valve  " << powerBudget.getValveMa() << " mA\n"
+          << "  in use  " << powerBudget.getUsedMa() << " mA (peak " << powerBudget.getPeakMa() << " mA)\n";
+        return;
+      default:
+        stream() << "invalid parameter, must be one of \"supply\", \"pump\" or \"valve\"\n";
+        return;
+    }
+    
+    int ma;
+    if (getInt(ma, 0, UINT16_MAX) != ArgOk) {
+      stream() << "current must be between 0 and " << UINT16_MAX << " mA\n";
+      return;
+    }
+    switch (idx) {
+      case SUPPLY:
+        powerBudget.setSupplyMa(ma);
+        stream() << "supply current set to " << ma << " mA\n";
+        break;
+      case PUMP:
+        powerBudget.setPumpMa(ma);
+        stream() << "pump current set to " << ma << " mA\n";
+        break;
+      case VALVE:
+        powerBudget.setValveMa(ma);
+        stream() << "valve current set to " << ma << " mA\n";
+        break;
+    }
+    
+    flashCommitter.markDirty();
+  }
+  
+  void cmdCircuitCalibrate()
+  {
+    const bool reservoir = strcmp(current(), "c.rcal") == 0;
+    
+    int id;
+    WaterCircuit* w;
+    if (getId(id, w) != ArgOk) {
+      stream() << "invalid index\n";
+      return;
+    }
+    
+    Sensor& s = reservoir ? w->getReservoir() : w->getSensor();
+    Calibration* c = s.getCalibration();
+    if (not c) {
+      stream() << "this sensor can not be calibrated\n";
+      return;
+    }
+    
+    const char* arg = next();
+    if (not arg) {
+      stream() << (reservoir ? "reservoir" : "sensor") << " calibration of circuit [" << id << "]: ";
+      c->prt(stream());
+      if (not c->isCalibrated()) {
+        stream()
+          << "to calibrate put the probe into dry soil and run \"" << current() << " " << id << " dry\",\n"
+          << "then into saturated soil and run \"" << current() << " " << id << " wet\"\n";
+      }
+      return;
+    }
+    
+    int value;
+    if (strcmp(arg, "clear") == 0) {
+      c->clear();
+      stream() << "calibration cleared\n";
+      flashCommitter.markDirty();
+      return;
+    } else if (strcmp(arg, "dry") == 0) {
+      value = Calibration::ValueDry;
+    } else if (strcmp(arg, "wet") == 0) {
+      value = Calibration::ValueWet;
+    } else {
+      char* end;
+      value = strtol(arg, &end, 10);
+      if (*end or value < 0 or value > 255) {
+        stream() << "calibration point must be \"dry\", \"wet\", \"clear\" or a value between 0 and 255\n";
+        return;
+      }
+    }
+    
+    stream() << "capturing calibration point, keep the probe steady...\n";
+    
+    if (not sense(s)) {
+      return;
+    }
+    auto raw = s.readRaw();
+    s.disable();
+    
+    if (not c->setPoint(raw, value)) {
+      stream() << "calibration table full (" << Calibration::MaxPoints << " points), clear it first\n";
+      return;
+    }
+    
+    stream() << "captured raw " << raw << " as " << value << "\n";
+    c->prt(stream());
+    
+    flashCommitter.markDirty();
   }
   
   void cmdCircuitPump()
@@ -592,12 +880,20 @@ protected:
       return;
     }
   
+    auto& p = w->getPump();
+    if (not powerBudget.acquire(0, &p)) {
+      stream() << "pump current exceeds the power budget\n";
+      return;
+    }
+  
     stream() << "pump enabled " << systemTime.getTimeStr() << "\n";
   
-    auto& p = w->getPump();
     p.enable();
+    spi.flush();
     delay(s * 1000);
     p.disable();
+    spi.flush();
+    powerBudget.release(0, &p);
   
     stream() << "pump disabled " << systemTime.getTimeStr() << "\n";
   }
@@ -650,6 +946,11 @@ protected:
   {
     stream() <<  "on-board circuit [" << id << "]:";
     w->prt(stream());
+    int dev = temperatureBus.findCircuit(id - 1);
+    if (dev >= 0 and temperatureBus.getDevice(dev).m_valid) {
+      int t = temperatureBus.getDevice(dev).m_temperature;
+      stream() << "          temperature  " << t / 16 << " °C\n";
+    }
   }
   
   void cmdCircuitInfo()
@@ -737,7 +1038,7 @@ protected:
       return;
     }
   
-    flashSettings.update();
+    flashCommitter.markDirty();
   }
 
   void cmdCircuitStop()
@@ -848,88 +1149,496 @@ protected:
       return;
     }
   
-    flashSettings.update();
+    flashCommitter.markDirty();
   }
   
   void cmdSchedulerInfo()
   {
-    stream() << "scheduler entries:\n";
+    stream() << "schedule entries:\n";
     
-    int i = 1;  
-    for (SchedulerTime **t = schedulerTimes; *t; t++, i++) {
-      stream() << "  Entry [" << i << "]: ";
-      if ((*t)->isValid()) {
-        prtFmt(stream(), "%02u:%02u\n", (*t)->getHour(), (*t)->getMinute());
+    for (unsigned int i = 0; i < scheduler.getNumEntries(); i++) {
+      stream() << "  Entry [" << i + 1 << "]: ";
+      Scheduler::prtEntry(stream(), scheduler.getEntry(i));
+      unsigned long next = scheduler.getNextEpoch(i);
+      if (next and systemTime.isValid()) {
+        unsigned long in = (next - systemTime.getEpoch()) / 60;
+        prtFmt(stream(), ", next in %lud%02luh%02lu", in / (24 * 60), in / 60 % 24, in % 60);
+      }
+      stream() << "\n";
+    }
+    if (not scheduler.getNumEntries()) {
+      stream() << "  none\n";
+    }
+    scheduler.prt(stream());
+  }
+
+  /** Parses "hh:mm" */
+  static bool parseTime(const char* arg, int& h, int& m)
+  {
+    if (arg == NULL           or
+        strlen(arg) != 5      or
+        not isDigit(arg[0])   or
+        not isDigit(arg[1])   or
+        arg[2] != ':'         or
+        not isDigit(arg[3])   or
+        not isDigit(arg[4])) {
+      return false;
+    }
+    h = (arg[0] - '0') * 10 + arg[1] - '0';
+    m = (arg[3] - '0') * 10 + arg[4] - '0';
+    return h <= 23 and m <= 59;
+  }
+
+  /** Parses "all", "weekdays", "weekend" or a comma separated list of "su", "mo", ... */
+  static bool parseWeekdays(const char* arg, uint8_t& mask)
+  {
+    static const char* days[] = {"su", "mo", "tu", "we", "th", "fr", "sa"};
+    if (strcmp(arg, "all") == 0) {
+      mask = Scheduler::AllDays;
+      return true;
+    } else if (strcmp(arg, "weekdays") == 0) {
+      mask = Scheduler::Weekdays;
+      return true;
+    } else if (strcmp(arg, "weekend") == 0) {
+      mask = Scheduler::Weekend;
+      return true;
+    }
+    mask = 0;
+    while (*arg) {
+      unsigned int i = 0;
+      for (; i < 7; i++) {
+        if (strncmp(arg, days[i], 2) == 0) {
+          break;
+        }
+      }
+      if (i == 7 or (arg[2] != ',' and arg[2] != '\0')) {
+        return false;
+      }
+      mask |= 1 << i;
+      arg += arg[2] ? 3 : 2;
+    }
+    return mask != 0;
+  }
+
+  /** Parses "all" or a comma separated list of circuit IDs */
+  static bool parseCircuits(const char* arg, uint8_t& mask)
+  {
+    if (strcmp(arg, "all") == 0) {
+      mask = Scheduler::AllCircuits;
+      return true;
+    }
+    mask = 0;
+    while (*arg) {
+      int id = atoi(arg);
+      if (id < 1 or id > (int)NumWaterCircuits) {
+        return false;
+      }
+      mask |= 1 << (id - 1);
+      while (isDigit(*arg)) {
+        arg++;
+      }
+      if (*arg == ',') {
+        arg++;
+      } else if (*arg) {
+        return false;
+      }
+    }
+    return mask != 0;
+  }
+
+  /** Parses the optional schedule entry parameters into entry */
+  bool parseEntry(Scheduler::Entry& entry)
+  {
+    const char* arg;
+    while ((arg = next()) != NULL) {
+      const char* val = next();
+      if (val == NULL) {
+        stream() << "missing value for \"" << arg << "\"\n";
+        return false;
+      }
+      if (strcmp(arg, "days") == 0) {
+        if (not parseWeekdays(val, entry.m_weekdays)) {
+          stream() << "days must be \"all\", \"weekdays\", \"weekend\" or a list like \"mo,we,fr\"\n";
+          return false;
+        }
+      } else if (strcmp(arg, "every") == 0) {
+        int n = atoi(val);
+        if (n < 1 or n > 255) {
+          stream() << "interval must be in the range 1 .. 255 days\n";
+          return false;
+        }
+        /* the phase is counted from today, which needs the date */
+        if (not systemTime.isValid()) {
+          stream() << "interval needs the current date, try again when the time is set\n";
+          return false;
+        }
+        entry.m_interval = n;
+        /* the interval starts on the next day the entry fires at */
+        unsigned long day = Scheduler::getDay(systemTime.getEpoch());
+        if (systemTime.getHours() * 60 + systemTime.getMinutes() >= entry.m_hour * 60 + entry.m_minute) {
+          day++;
+        }
+        entry.m_phase = day % n;
+      } else if (strcmp(arg, "circ") == 0) {
+        if (not parseCircuits(val, entry.m_circuits)) {
+          stream() << "circuits must be \"all\" or a list of IDs like \"1,3\"\n";
+          return false;
+        }
+      } else if (strcmp(arg, "pump") == 0) {
+        int p = atoi(val);
+        if (p < 0 or p > 255) {
+          stream() << "pump time must be in the range 0 .. 255 seconds\n";
+          return false;
+        }
+        entry.m_pumpSeconds = p;
       } else {
-        stream() << "off\n";
+        stream() << "invalid parameter \"" << arg << "\"\n";
+        return false;
       }
     }
+    return true;
+  }
+
+  void cmdSchedulerAdd()
+  {
+    Scheduler::Entry entry = {0, 0, Scheduler::AllDays, 1, 0, Scheduler::AllCircuits, 0};
+    int h, m;
+    if (not parseTime(next(), h, m)) {
+      stream() << "time must be of format \"hh:mm\"\n";
+      return;
+    }
+    entry.m_hour = h;
+    entry.m_minute = m;
+    if (not parseEntry(entry)) {
+      return;
+    }
+    if (not scheduler.add(entry)) {
+      stream() << "schedule full, at most " << Scheduler::MaxEntries << " entries\n";
+      return;
+    }
+    stream() << "added schedule entry [" << scheduler.getNumEntries() << "]: ";
+    Scheduler::prtEntry(stream(), entry) << "\n";
+    flashCommitter.markDirty();
   }
   
   void cmdSchedulerSet()
   {
     int index;
-    auto res = getInt(index, 1, NumSchedulerTimes);
-    if (res != ArgOk) {
-      stream() << "index must be in the range 1 .. " << NumSchedulerTimes << "\n";
+    if (getInt(index, 1, scheduler.getNumEntries()) != ArgOk) {
+      stream() << "index must be in the range 1 .. " << scheduler.getNumEntries() << "\n";
       return;
     }
     
-    const char* arg = next();
-    if (arg == NULL             or
-        (strcmp(arg, "off") != 0 and
-         not (strlen(arg) == 5   and
-              isDigit(arg[0])    and
-              isDigit(arg[1])    and
-              arg[2] == ':'      and
-              isDigit(arg[3])    and
-              isDigit(arg[4]))))
-    {
-      stream() << "time must be of format \"hh:mm\" or \"off\"\n";
+    Scheduler::Entry entry = scheduler.getEntry(index - 1);
+    int h, m;
+    if (not parseTime(next(), h, m)) {
+      stream() << "time must be of format \"hh:mm\"\n";
       return;
     }
-  
-    if (strcmp(arg, "off") == 0) {
-      stream() << "configuring scheduler entry [" << index << "] to \"off\"\n";
-      schedulerTimes[index - 1]->setHour(SchedulerTime::InvalidHour);
-      schedulerTimes[index - 1]->setMinute(0);
-  
-      flashSettings.update();
-  
+    entry.m_hour = h;
+    entry.m_minute = m;
+    if (not parseEntry(entry)) {
       return;
     }
-  
-    int h, m;
-    if (arg[0] == '0') {
-      h = atoi(arg+1);
-    } else {
-      h = atoi(arg);
+    scheduler.set(index - 1, entry);
+    stream() << "configured schedule entry [" << index << "]: ";
+    Scheduler::prtEntry(stream(), entry) << "\n";
+    flashCommitter.markDirty();
+  }
+
+  void cmdSchedulerDelete()
+  {
+    int index;
+    if (getInt(index, 1, scheduler.getNumEntries()) != ArgOk) {
+      stream() << "index must be in the range 1 .. " << scheduler.getNumEntries() << "\n";
+      return;
     }
-    if (arg[3] == '0') {
-      m = atoi(arg+4);
-    } else {
-//      m_proxyStream << flashDataSet.hostName << "> ";
+    scheduler.remove(index - 1);
+    stream() << "removed schedule entry [" << index << "]\n";
+    flashCommitter.markDirty();
+  }
 
-      m = atoi(arg+3);
+  void cmdSchedulerGrace()
+  {
+    int minutes;
+    if (getInt(minutes, 0, 24 * 60) != ArgOk) {
+      stream() << "grace window must be in the range 0 .. 1440 minutes\n";
+      return;
     }
-  
-    if (h < 0 or h > 23) {
-      stream() << "hour must be in the range 0 .. 23\n";
+    scheduler.setGraceMinutes(minutes);
+    stream() << "grace window set to " << minutes << " minutes\n";
+    flashCommitter.markDirty();
+  }
+
+  void cmdSchedulerCatchUp()
+  {
+    size_t idx(0);
+    if (getOpt(idx, "skip", "once", "within") != ArgOk) {
+      stream() << "catch up policy must be \"skip\", \"once\" or \"within\"\n";
       return;
     }
+    auto policy = static_cast<Scheduler::CatchUpPolicy>(idx);
+    scheduler.setCatchUp(policy);
+    stream() << "catch up policy set to \"" << Scheduler::getCatchUpString(policy) << "\"\n";
+    flashCommitter.markDirty();
+  }
   
-    if (m < 0 or m > 59) {
-      stream() << "minute must be in the range 0 .. 59\n";
+  void cmdRulesInfo()
+  {
+    ruleEngine.prt(stream());
+  }
+
+  void cmdRulesAdd()
+  {
+    /* the tokenizer split the rule, join it again */
+    char source[rules::MaxSourceSize];
+    size_t len = 0;
+    for (const char* arg = next(); arg; arg = next()) {
+      size_t n = strlen(arg);
+      if (len + n + 1 >= sizeof(source)) {
+        stream() << "rule too long, at most " << rules::MaxSourceSize - 1 << " characters\n";
+        return;
+      }
+      if (len) {
+        source[len++] = ' ';
+      }
+      memcpy(source + len, arg, n);
+      len += n;
+    }
+    source[len] = '\0';
+
+    rules::Rule rule;
+    const char* error = rules::compile(source, rule);
+    if (error) {
+      stream() << "invalid rule: " << error << "\n";
+      return;
+    }
+    if (not ruleEngine.add(rule)) {
+      stream() << "too many rules, at most " << rules::MaxRules << "\n";
+      return;
+    }
+    stream() << "added rule [" << ruleEngine.getSettings().m_numRules << "], " << rule.m_codeSize << " bytes: ";
+    rules::Engine::prtCode(stream(), rule) << "\n";
+    flashCommitter.markDirty();
+  }
+
+  void cmdRulesDelete()
+  {
+    int index;
+    if (getInt(index, 1, ruleEngine.getSettings().m_numRules) != ArgOk) {
+      stream() << "index must be in the range 1 .. " << ruleEngine.getSettings().m_numRules << "\n";
+      return;
+    }
+    ruleEngine.remove(index - 1);
+    stream() << "removed rule [" << index << "]\n";
+    flashCommitter.markDirty();
+  }
+
+  void cmdRulesInterval()
+  {
+    int minutes;
+    if (getInt(minutes, 0, 255) != ArgOk) {
+      stream() << "interval must be in the range 0 .. 255 minutes\n";
+      return;
+    }
+    ruleEngine.setIntervalMinutes(minutes);
+    stream() << "rule evaluation interval set to " << minutes << " minutes\n";
+    flashCommitter.markDirty();
+  }
+
+  void cmdRulesEvaluate()
+  {
+    if (systemMode.getMode() != SystemMode::Auto) {
+      stream() << "rules trigger circuits in auto mode only\n";
+      return;
+    }
+    ruleEngine.evaluate();
+    ruleEngine.prt(stream());
+  }
+
+  void cmdDataInfo()
+  {
+    timeSeries.prt(stream());
+  }
+
+  void cmdDataShow()
+  {
+    int hours;
+    switch (getInt(hours, 1, 24 * 365)) {
+      case ArgOk:
+        break;
+      case ArgNone:
+        hours = 24;
+        break;
+      default:
+        stream() << "hours must be in the range 1 .. " << 24 * 365 << "\n";
+        return;
+    }
+    int id;
+    switch (getInt(id, 1, NumWaterCircuits)) {
+      case ArgOk:
+        break;
+      case ArgNone:
+        /* query all circuits */
+        id = NumWaterCircuits + 1;
+        break;
+      default:
+        stream() << "circuit ID must be in the range 1 .. " << NumWaterCircuits << "\n";
+        return;
+    }
+    if (not systemTime.isValid()) {
+      stream() << "time unknown\n";
+      return;
+    }
+
+    class Printer
+      : public TimeSeries::Visitor
+    {
+    public:
+      Printer(Print& p)
+        : m_p(p)
+      { }
+      virtual bool visit(const TimeSeries::Record& r)
+      {
+        TimeSeries::prtTime(m_p, r.m_epoch);
+        prtFmt(m_p, "  [%u]  humidity %3u  reservoir %3u  pump %lu s\n",
+               r.m_circuit + 1, r.m_humidity, r.m_reservoir, r.m_pumpSeconds);
+        return true;
+      }
+    private:
+      Print& m_p;
+    } printer(stream());
+
+    unsigned long to = systemTime.getEpoch();
+    unsigned long from = to - hours * 3600UL;
+    unsigned int n = timeSeries.query(from, to, id - 1, printer);
+    stream() << n << " readings\n";
+  }
+
+  void cmdDataClear()
+  {
+    if (not timeSeries.clear()) {
+      stream() << "failed to erase the readings\n";
       return;
     }
+    stream() << "all readings erased\n";
+  }
+
+  void cmdDataKv()
+  {
+    kvStore.prt(stream());
+  }
+
+  void cmdAdcInfo()
+  {
+    stream() << "ADC:\n";
+    adc.prt(stream());
+    if (UseExternalAdc) {
+      stream() << "external ADC:\n";
+      ads1115.prt(stream());
+    }
+  }
   
-    stream() << "configuring scheduler entry [" << index << "] to ";
-    prtFmt(stream(), "%02u:%02u\n", h, m);
+  void cmdAdcRead()
+  {
+    int ch;
+    if (getInt(ch, 1, Adc::NumChannels) != ArgOk) {
+      stream() << "channel must be between 1 and " << Adc::NumChannels << "\n";
+      return;
+    }
+
+    struct : public Adc::Consumer
+    {
+      bool m_done;
+      Adc::Reading m_reading;
+      virtual void adcDone(Adc::Channel, const Adc::Reading& reading)
+      {
+        m_reading = reading;
+        m_done = true;
+      }
+    } consumer;
+    consumer.m_done = false;
+
+    if (not adc.enqueue(static_cast<Adc::Channel>(ch - 1), Sensor::PriorityHigh, consumer)) {
+      stream() << "ADC busy, try again later\n";
+      return;
+    }
+    while (not consumer.m_done) {
+      delay(100);
+      adc.run();
+      spi.run();
+    }
+    stream() << "channel " << ch << ": raw " << consumer.m_reading.m_raw << ", std dev " << consumer.m_reading.m_noise.m_stdDev << "\n";
+  }
+
+  void cmdAdcSet()
+  {
+    const char* arg = next();
+    if (arg == NULL) {
+      stream() << "no parameter\n";
+      return;
+    }
     
-    schedulerTimes[index - 1]->setHour(h);
-    schedulerTimes[index - 1]->setMinute(m);
-  
-    flashSettings.update();
+    if (strcmp(arg, "settle") == 0) {
+      size_t idx(0);
+      if (getOpt(idx, "off", "on") != ArgOk) {
+        stream() << "settle must be \"on\" or \"off\"\n";
+        return;
+      }
+      adc.setAdaptiveSettling(idx == 1);
+      stream() << "adaptive settling " << (idx == 1 ? "en" : "dis") << "abled\n";
+    } else if (strcmp(arg, "tol") == 0) {
+      int t;
+      if (getInt(t, 0, 255) != ArgOk) {
+        stream() << "settle tolerance must be between 0 and 255\n";
+        return;
+      }
+      adc.setSettleTolerance(t);
+      stream() << "settle tolerance set to " << t << "\n";
+    } else if (strcmp(arg, "count") == 0) {
+      int n;
+      if (getInt(n, 1, 255) != ArgOk) {
+        stream() << "settle count must be between 1 and 255\n";
+        return;
+      }
+      adc.setSettleCount(n);
+      stream() << "settle count set to " << n << "\n";
+    } else if (strcmp(arg, "acq") == 0) {
+      size_t idx(0);
+      if (getOpt(idx, "spaced", "burst") != ArgOk) {
+        stream() << "acquisition mode must be \"spaced\" or \"burst\"\n";
+        return;
+      }
+      auto mode = static_cast<Adc::AcquisitionMode>(idx);
+      adc.setAcquisitionMode(mode);
+      stream() << "acquisition mode set to " << Adc::getAcquisitionModeString(mode) << "\n";
+    } else if (strcmp(arg, "reduce") == 0) {
+      const char* rarg = next();
+      Adc::Reducer r = rarg ? Adc::str2Reducer(rarg) : Adc::NumReducers;
+      if (r == Adc::NumReducers) {
+        stream() << "reducer must be one of \"mean\", \"median\", \"trim\" or \"min\"\n";
+        return;
+      }
+      adc.setReducer(r);
+      stream() << "reducer set to " << Adc::getReducerString(r) << "\n";
+    } else if (strcmp(arg, "samples") == 0) {
+      int n;
+      if (getInt(n, 1, Adc::MaxBurstSamples) != ArgOk) {
+        stream() << "burst samples must be between 1 and " << Adc::MaxBurstSamples << "\n";
+        return;
+      }
+      adc.setBurstSamples(n);
+      stream() << "burst samples set to " << n << "\n";
+    } else if (strcmp(arg, "clear") == 0) {
+      adc.clearStats();
+      stream() << "settling time statistics cleared\n";
+      return;
+    } else {
+      stream() << "invalid parameter \"" << arg << "\"\n";
+      return;
+    }
+    
+    flashCommitter.markDirty();
   }
   
   void cmdNetworkRssi()
@@ -958,9 +1667,9 @@ protected:
       }
     }
     strncpy(flashSettings.wifiSsid, arg, MaxWifiSsidLen);
-    flashSettings.update();
+    flashCommitter.markDirty();
   
-    stream() << "SSID \"" << arg << "\" stored to flash\n";
+    stream() << "SSID \"" << arg << "\" saved\n";
   }
   
   void cmdNetworkPass()
@@ -984,9 +1693,9 @@ protected:
       }
     }
     strncpy(flashSettings.wifiPass, arg, MaxWifiPassLen);
-    flashSettings.update();
+    flashCommitter.markDirty();
   
-    stream() << "wifi pass \"" << arg << "\" stored to flash\n";
+    stream() << "wifi pass \"" << arg << "\" saved\n";
   }
   
   void cmdNetworkConnect()
@@ -1014,9 +1723,9 @@ protected:
     }
     
     strncpy(flashSettings.hostName, arg, MaxHostNameLen);
-    flashSettings.update();
+    flashCommitter.markDirty();
   
-    stream() << "new host name \"" << arg << "\" stored to flash. restarting network...\n";
+    stream() << "new host name \"" << arg << "\" saved. restarting network...\n";
 
     network.disconnect();
     network.connect();
@@ -1069,7 +1778,70 @@ protected:
         return;
     }
 
-    flashSettings.update();
+    flashCommitter.markDirty();
+  }
+  void cmdNetworkNtp()
+  {
+    NtpClient& ntp = systemTime.getNtpClient();
+    size_t idx(0);
+    enum {SERVER = 0, UTC, POLL, SYNC};
+    switch (getOpt(idx, "server", "utc", "poll", "sync")) {
+      case ArgOk:
+        switch (idx) {
+          case SERVER:
+          {
+            int i;
+            if (getInt(i, 1, NtpClient::MaxServers) != ArgOk) {
+              stream() << "server index must be in the range 1 .. " << NtpClient::MaxServers << "\n";
+              return;
+            }
+            const char* name = next();
+            if (not name) {
+              stream() << "server name missing\n";
+              return;
+            }
+            if (not ntp.setServer(i - 1, strcmp(name, "none") == 0 ? NULL : name)) {
+              stream() << "server name too long, at most " << NtpClient::MaxServerLen << " characters\n";
+              return;
+            }
+            ntp.forceUpdate();
+            break;
+          }
+          case UTC:
+          {
+            int minutes;
+            if (getInt(minutes, -12 * 60, 14 * 60) != ArgOk) {
+              stream() << "UTC offset must be in the range -720 .. 840 minutes\n";
+              return;
+            }
+            ntp.setUtcOffsetMinutes(minutes);
+            break;
+          }
+          case POLL:
+          {
+            int seconds;
+            if (getInt(seconds, 16, 3600) != ArgOk) {
+              stream() << "poll interval must be in the range 16 .. 3600 seconds\n";
+              return;
+            }
+            ntp.setPollSeconds(seconds);
+            break;
+          }
+          case SYNC:
+            ntp.forceUpdate();
+            stream() << "NTP update started\n";
+            return;
+        }
+        break;
+      case ArgNone:
+        ntp.prt(stream());
+        return;
+      default:
+        stream() << "invalid argument \"" << current() << "\", see \"help\" for proper use\n";
+        return;
+    }
+    ntp.prt(stream());
+    flashCommitter.markDirty();
   }
   void cmdInvalid(const char *command)
   {
@@ -0,0 +1,15 @@
+#include "clock.h"
+
+Clock::Source Clock::s_source = Clock::defaultSource;
+
+uint64_t
+Clock::defaultSource()
+{
+  return micros64();
+}
+
+void
+Clock::setSource(Source source)
+{
+  s_source = source ? source : defaultSource;
+}
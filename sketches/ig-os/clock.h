@@ -0,0 +1,161 @@
+#ifndef EW_IG_CLOCK_H
+#define EW_IG_CLOCK_H
+
+#include <Arduino.h>
+
+/** Monotonic time base of all state machines.
+ *
+ * The clock counts microseconds since boot in 64 bit and never wraps,
+ * unlike millis() and micros() which wrap after 49 days and 71 minutes.
+ * Instants are points on this clock, Durations the signed difference of
+ * two instants and Deadlines expire a Duration after they were started.
+ * Keeping everything in microseconds internally avoids mixing seconds,
+ * minutes and milliseconds in the state machines' arithmetic.
+ *
+ * Reading the clock is a call of the SDK's micros64(), the source can be
+ * replaced for host tests.
+ */
+class Clock
+{
+public:
+  /** Returns microseconds since boot, must be monotonic */
+  typedef uint64_t (*Source)();
+
+  static uint64_t nowUs()
+  {
+    return s_source();
+  }
+  /** Sets the clock source, NULL restores the default */
+  static void setSource(Source source);
+
+private:
+  static uint64_t defaultSource();
+  static Source s_source;
+};
+
+class Duration
+{
+public:
+  constexpr Duration()
+    : m_us(0)
+  { }
+  static constexpr Duration fromUs(int64_t us)           { return Duration(us); }
+  static constexpr Duration fromMs(int64_t ms)           { return Duration(ms * 1000LL); }
+  static constexpr Duration fromSeconds(int64_t seconds) { return Duration(seconds * 1000000LL); }
+  static constexpr Duration fromMinutes(int64_t minutes) { return Duration(minutes * 60000000LL); }
+
+  constexpr int64_t toUs() const      { return m_us; }
+  constexpr int64_t toMs() const      { return m_us / 1000LL; }
+  constexpr int64_t toSeconds() const { return m_us / 1000000LL; }
+  constexpr int64_t toMinutes() const { return m_us / 60000000LL; }
+
+  constexpr Duration operator+(Duration d) const { return Duration(m_us + d.m_us); }
+  constexpr Duration operator-(Duration d) const { return Duration(m_us - d.m_us); }
+  Duration& operator+=(Duration d) { m_us += d.m_us; return *this; }
+  Duration& operator-=(Duration d) { m_us -= d.m_us; return *this; }
+
+  constexpr bool operator==(Duration d) const { return m_us == d.m_us; }
+  constexpr bool operator!=(Duration d) const { return m_us != d.m_us; }
+  constexpr bool operator< (Duration d) const { return m_us <  d.m_us; }
+  constexpr bool operator<=(Duration d) const { return m_us <= d.m_us; }
+  constexpr bool operator> (Duration d) const { return m_us >  d.m_us; }
+  constexpr bool operator>=(Duration d) const { return m_us >= d.m_us; }
+
+private:
+  constexpr explicit Duration(int64_t us)
+    : m_us(us)
+  { }
+  int64_t m_us;
+};
+
+class Instant
+{
+public:
+  /** The boot instant */
+  constexpr Instant()
+    : m_us(0)
+  { }
+  static Instant now()
+  {
+    return Instant(Clock::nowUs());
+  }
+  /** Time passed since this instant */
+  Duration elapsed() const
+  {
+    return now() - *this;
+  }
+
+  constexpr uint64_t toUs() const
+  {
+    return m_us;
+  }
+
+  constexpr Duration operator-(Instant i) const { return Duration::fromUs(static_cast<int64_t>(m_us - i.m_us)); }
+  constexpr Instant operator+(Duration d) const { return Instant(m_us + d.toUs()); }
+  /** Saturates at the boot instant */
+  constexpr Instant operator-(Duration d) const
+  {
+    return d.toUs() > 0 and static_cast<uint64_t>(d.toUs()) > m_us ? Instant() : Instant(m_us - d.toUs());
+  }
+
+  constexpr bool operator==(Instant i) const { return m_us == i.m_us; }
+  constexpr bool operator!=(Instant i) const { return m_us != i.m_us; }
+  constexpr bool operator< (Instant i) const { return m_us <  i.m_us; }
+  constexpr bool operator<=(Instant i) const { return m_us <= i.m_us; }
+  constexpr bool operator> (Instant i) const { return m_us >  i.m_us; }
+  constexpr bool operator>=(Instant i) const { return m_us >= i.m_us; }
+
+private:
+  constexpr explicit Instant(uint64_t us)
+    : m_us(us)
+  { }
+  uint64_t m_us;
+};
+
+/** A timeout which must be started before it can expire */
+class Deadline
+{
+public:
+  Deadline()
+    : m_expiry()
+    , m_armed(false)
+  { }
+  explicit Deadline(Duration timeout)
+  {
+    start(timeout);
+  }
+
+  void start(Duration timeout)
+  {
+    m_expiry = Instant::now() + timeout;
+    m_armed = true;
+  }
+  void stop()
+  {
+    m_armed = false;
+  }
+  bool isArmed() const
+  {
+    return m_armed;
+  }
+  /** True once the timeout of a started deadline has passed */
+  bool expired() const
+  {
+    return m_armed and Instant::now() >= m_expiry;
+  }
+  /** Time left until expiry, zero if expired or not started */
+  Duration remaining() const
+  {
+    if (not m_armed) {
+      return Duration();
+    }
+    Instant now = Instant::now();
+    return now >= m_expiry ? Duration() : m_expiry - now;
+  }
+
+private:
+  Instant m_expiry;
+  bool m_armed;
+};
+
+#endif /* EW_IG_CLOCK_H */
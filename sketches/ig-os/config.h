@@ -22,7 +22,39 @@ const unsigned int MaxTelnetClients = 1;
 const unsigned int SizeErrLogBuffer = 2048;
 
 const unsigned int NumWaterCircuits = 4;
-const unsigned int NumSchedulerTimes = 8;
+const unsigned int NumPumps = 1;
+/** Pump feeding a circuit, the circuits are distributed over the pumps in turn */
+constexpr unsigned int circuitPump(unsigned int circuit)
+{
+  return circuit % NumPumps;
+}
+/** Number of daisy chained shift registers driving pumps, valves and the ADC multiplexers */
+const unsigned int NumShiftRegisters = 1;
+/** Number of inputs of the external analog multiplexer, 0 if none is fitted.
+ *  A 16 channel multiplexer needs four more shift register bits.
+ */
+const unsigned int NumExtMuxChannels = 0;
+/** Capacity of the schedule table. The table is part of the fixed size
+ *  flash settings, every entry takes 7 bytes whether it is used or not.
+ */
+const unsigned int MaxScheduleEntries = 8;
+
+/** Read the circuit sensors through an external ADS1115 instead of the onboard ADC.
+ *  The reservoir sensor stays on the onboard ADC.
+ */
+const bool UseExternalAdc = false;
+const uint8_t ExternalAdcAddress = 0x48;
+
+/** I2C address of the DS1307/DS3231 real time clock, the clock is optional */
+const uint8_t RtcAddress = 0x68;
+/** I2C address of the AT24C32 EEPROM, the EEPROM is optional */
+const uint8_t EepromAddress = 0x50;
+/** EEPROM region of the logged readings */
+const uint16_t TimeSeriesBegin = 0x0000;
+const uint16_t TimeSeriesEnd   = 0x0c00;
+/** EEPROM region of the key value store */
+const uint16_t KvStoreBegin    = 0x0c00;
+const uint16_t KvStoreEnd      = 0x1000;
 
 #define DefaultHostName "ew-intelliguss"
 
@@ -70,6 +102,40 @@ inline unsigned int countBits(T value)
   return count;
 }
 
+/** Integer square root, rounded down */
+inline uint32_t isqrt(uint64_t value)
+{
+  uint64_t root = 0;
+  uint64_t bit = 1ULL << 62;
+  while (bit > value) {
+    bit >>= 2;
+  }
+  while (bit) {
+    if (value >= root + bit) {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+/** CRC-32 (IEEE 802.3), bitwise to save flash */
+inline uint32_t crc32(const void* data, size_t len, uint32_t crc = 0)
+{
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+  while (len--) {
+    crc ^= *p++;
+    for (unsigned int i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xedb88320UL & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
 template<unsigned char shift, unsigned char mask, typename T>
 inline void setBitfields(T& target, T value)
 {
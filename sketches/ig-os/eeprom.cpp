@@ -0,0 +1,377 @@
+#include "eeprom.h"
+
+I2cAt24Cxx eeprom(EepromAddress);
+
+I2cAt24Cxx::I2cAt24Cxx(uint8_t address, size_t size)
+  : I2cDevice(address)
+  , m_size(size)
+  , m_state(StateAbsent)
+  , m_writes{}
+  , m_first(0)
+  , m_numWrites(0)
+  , m_bufferEnd(0)
+  , m_buffer{}
+  , m_chunkSize(0)
+  , m_chunkStart()
+  , m_readAddress(0)
+  , m_readAddressValid(false)
+  , m_cache{}
+  , m_useCounter(0)
+  , m_stats{}
+{ }
+
+bool
+I2cAt24Cxx::begin()
+{
+  Wire.beginTransmission(getDeviceAddress());
+  if (Wire.endTransmission() != 0) {
+    m_state = StateAbsent;
+    Debug << "eeprom at 0x" << String(getDeviceAddress(), HEX) << " not present\n";
+    return false;
+  }
+  m_state = StateIdle;
+  return true;
+}
+
+void
+I2cAt24Cxx::run()
+{
+  switch (m_state) {
+    case StateAbsent:
+      break;
+    case StateIdle:
+      if (m_numWrites) {
+        writeChunk();
+      }
+      break;
+    case StateWriteCycle:
+      pollReady();
+      break;
+  }
+}
+
+bool
+I2cAt24Cxx::read(Address address, uint8_t* data, size_t count)
+{
+  if (m_state == StateAbsent or address + count > m_size) {
+    return false;
+  }
+  m_stats.m_reads++;
+
+  if (count > PageSize) {
+    if (not waitReady() or not readSequential(address, data, count)) {
+      return false;
+    }
+    overlay(address, data, count);
+    return true;
+  }
+
+  while (count) {
+    const CachedPage* page = getPage(address);
+    if (not page) {
+      return false;
+    }
+    size_t offset = address - page->m_address;
+    size_t n = PageSize - offset;
+    if (n > count) {
+      n = count;
+    }
+    memcpy(data, page->m_data + offset, n);
+    address += n;
+    data    += n;
+    count   -= n;
+  }
+  return true;
+}
+
+bool
+I2cAt24Cxx::enqueue(Address address, const uint8_t* data, size_t count, Consumer* consumer)
+{
+  if (m_state == StateAbsent or not count or address + count > m_size) {
+    return false;
+  }
+  if (m_numWrites == MaxWrites or m_bufferEnd + count > WriteBufferSize) {
+    m_stats.m_rejected++;
+    return false;
+  }
+
+  Write& w = m_writes[(m_first + m_numWrites) % MaxWrites];
+  w.m_address = address;
+  w.m_count = count;
+  w.m_offset = m_bufferEnd;
+  w.m_done = 0;
+  w.m_consumer = consumer;
+  memcpy(m_buffer + m_bufferEnd, data, count);
+  updateCache(address, data, count);
+  m_bufferEnd += count;
+  m_numWrites++;
+  return true;
+}
+
+bool
+I2cAt24Cxx::write(Address address, const uint8_t* data, size_t count)
+{
+  if (m_state == StateAbsent or address + count > m_size) {
+    return false;
+  }
+  /* An empty queue takes up to the full write buffer */
+  while (count) {
+    if (not flush()) {
+      return false;
+    }
+    size_t n = count < WriteBufferSize ? count : WriteBufferSize;
+    enqueue(address, data, n);
+    address += n;
+    data    += n;
+    count   -= n;
+  }
+  return flush();
+}
+
+bool
+I2cAt24Cxx::flush()
+{
+  uint32_t failed = m_stats.m_failed;
+  while (isBusy() and m_state != StateAbsent) {
+    run();
+    yield();
+  }
+  return m_stats.m_failed == failed;
+}
+
+void
+I2cAt24Cxx::cancel(Consumer& consumer)
+{
+  for (auto& w : m_writes) {
+    if (w.m_consumer == &consumer) {
+      w.m_consumer = NULL;
+    }
+  }
+}
+
+void
+I2cAt24Cxx::writeChunk()
+{
+  Write& w = m_writes[m_first];
+  Address address = w.m_address + w.m_done;
+
+  /* A chunk must not cross a page, the address would wrap within the page */
+  size_t count = w.m_count - w.m_done;
+  size_t pageRemaining = PageSize - address % PageSize;
+  if (count > pageRemaining) {
+    count = pageRemaining;
+  }
+  if (count > WireWriteBufferSize) {
+    count = WireWriteBufferSize;
+  }
+
+  m_chunkStart = Instant::now();
+  /* the write moves the address counter */
+  m_readAddressValid = false;
+
+  Wire.beginTransmission(getDeviceAddress());
+  Wire.write(address >> 8);
+  Wire.write(address & 0xFF);
+  Wire.write(m_buffer + w.m_offset + w.m_done, count);
+  if (Wire.endTransmission() != 0) {
+    Error << "eeprom: write to 0x" << String(address, HEX) << " failed\n";
+    finish(false);
+    return;
+  }
+  m_chunkSize = count;
+  m_state = StateWriteCycle;
+  m_stats.m_chunks++;
+}
+
+bool
+I2cAt24Cxx::pollReady()
+{
+  Duration cycle = m_chunkStart.elapsed();
+
+  m_stats.m_polls++;
+  Wire.beginTransmission(getDeviceAddress());
+  if (Wire.endTransmission() != 0) {
+    if (cycle >= Duration::fromMs(WriteCycleTimeoutMs)) {
+      Error << "eeprom: write cycle timeout\n";
+      m_state = StateIdle;
+      finish(false);
+    }
+    return false;
+  }
+
+  m_state = StateIdle;
+  m_stats.m_busy += cycle;
+  m_stats.m_bytes += m_chunkSize;
+  if (cycle.toUs() > m_stats.m_maxCycleUs) {
+    m_stats.m_maxCycleUs = cycle.toUs();
+  }
+
+  Write& w = m_writes[m_first];
+  w.m_done += m_chunkSize;
+  if (w.m_done == w.m_count) {
+    finish(true);
+  }
+  return true;
+}
+
+bool
+I2cAt24Cxx::waitReady()
+{
+  while (m_state == StateWriteCycle) {
+    pollReady();
+  }
+  return m_state != StateAbsent;
+}
+
+void
+I2cAt24Cxx::finish(bool ok)
+{
+  Write w = m_writes[m_first];
+  m_first = (m_first + 1) % MaxWrites;
+  m_numWrites--;
+  if (not m_numWrites) {
+    m_bufferEnd = 0;
+  }
+
+  if (ok) {
+    m_stats.m_writes++;
+  } else {
+    m_stats.m_failed++;
+    /* the cache holds data which didn't make it to the chip */
+    updateCache(w.m_address, NULL, w.m_count);
+  }
+  /* notify last, the consumer might queue the next write right away */
+  if (w.m_consumer) {
+    w.m_consumer->eepromDone(w.m_address, w.m_count, ok);
+  }
+}
+
+bool
+I2cAt24Cxx::readSequential(Address address, uint8_t* data, size_t count)
+{
+  if (not m_readAddressValid or m_readAddress != address) {
+    Wire.beginTransmission(getDeviceAddress());
+    Wire.write(address >> 8);
+    Wire.write(address & 0xFF);
+    if (Wire.endTransmission() != 0) {
+      m_readAddressValid = false;
+      return false;
+    }
+    m_stats.m_addressed++;
+  }
+
+  /* the counter is unknown if a transfer fails half way */
+  m_readAddressValid = false;
+  m_stats.m_bytesRead += count;
+  while (count) {
+    size_t n = count < WireReadBufferSize ? count : WireReadBufferSize;
+    if (Wire.requestFrom(getDeviceAddress(), n) != n) {
+      return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+      *data++ = Wire.read();
+    }
+    address += n;
+    count   -= n;
+  }
+  /* the counter rolls over from the last byte of the chip to the first */
+  m_readAddress = address % m_size;
+  m_readAddressValid = true;
+  return true;
+}
+
+void
+I2cAt24Cxx::overlay(Address address, uint8_t* data, size_t count) const
+{
+  /* in queue order, later writes win */
+  for (unsigned int i = 0; i < m_numWrites; i++) {
+    const Write& w = m_writes[(m_first + i) % MaxWrites];
+    size_t from = w.m_address > address ? w.m_address : address;
+    size_t to = w.m_address + w.m_count < address + count ? w.m_address + w.m_count : address + count;
+    if (from < to) {
+      memcpy(data + (from - address), m_buffer + w.m_offset + (from - w.m_address), to - from);
+    }
+  }
+}
+
+const I2cAt24Cxx::CachedPage*
+I2cAt24Cxx::getPage(Address address)
+{
+  address -= address % PageSize;
+
+  CachedPage* victim = m_cache;
+  for (auto& p : m_cache) {
+    if (p.m_valid and p.m_address == address) {
+      p.m_lastUse = ++m_useCounter;
+      m_stats.m_cacheHits++;
+      return &p;
+    }
+    if (victim->m_valid and (not p.m_valid or p.m_lastUse < victim->m_lastUse)) {
+      victim = &p;
+    }
+  }
+
+  m_stats.m_cacheMisses++;
+  victim->m_valid = false;
+  if (not waitReady() or not readSequential(address, victim->m_data, PageSize)) {
+    return NULL;
+  }
+  overlay(address, victim->m_data, PageSize);
+  victim->m_address = address;
+  victim->m_valid = true;
+  victim->m_lastUse = ++m_useCounter;
+  return victim;
+}
+
+void
+I2cAt24Cxx::updateCache(Address address, const uint8_t* data, size_t count)
+{
+  for (auto& p : m_cache) {
+    if (not p.m_valid) {
+      continue;
+    }
+    size_t from = p.m_address > address ? p.m_address : address;
+    size_t end = p.m_address + PageSize;
+    size_t to = end < address + count ? end : address + count;
+    if (from >= to) {
+      continue;
+    }
+    if (data) {
+      memcpy(p.m_data + (from - p.m_address), data + (from - address), to - from);
+    } else {
+      p.m_valid = false;
+    }
+  }
+}
+
+void
+I2cAt24Cxx::invalidateCache()
+{
+  for (auto& p : m_cache) {
+    p.m_valid = false;
+  }
+}
+
+uint32_t
+I2cAt24Cxx::getBytesPerSecond() const
+{
+  int64_t us = m_stats.m_busy.toUs();
+  return us ? static_cast<uint64_t>(m_stats.m_bytes) * 1000000ULL / us : 0;
+}
+
+Print&
+I2cAt24Cxx::prt(Print& p) const
+{
+  p << "             state  " << getStateString(m_state) << "\n"
+    << "              size  " << m_size << " bytes\n"
+    << "            queued  " << m_numWrites << " writes, " << m_bufferEnd << " bytes\n"
+    << "            writes  " << m_stats.m_writes << " (" << m_stats.m_failed << " failed, " << m_stats.m_rejected << " rejected)\n"
+    << "           written  " << m_stats.m_bytes << " bytes in " << m_stats.m_chunks << " chunks\n"
+    << "             polls  " << m_stats.m_polls << "\n"
+    << "    max write time  " << m_stats.m_maxCycleUs << " us\n"
+    << "        throughput  " << getBytesPerSecond() << " bytes/s\n"
+    << "             reads  " << m_stats.m_reads << ", " << m_stats.m_bytesRead << " bytes from the chip\n"
+    << "         addressed  " << m_stats.m_addressed << " transactions\n"
+    << "             cache  " << m_stats.m_cacheHits << " hits, " << m_stats.m_cacheMisses << " misses\n";
+  return p;
+}
@@ -0,0 +1,219 @@
+#ifndef EW_IG_EEPROM_H
+#define EW_IG_EEPROM_H
+
+#include "config.h"
+#include "i2c.h"
+#include "clock.h"
+
+/** Driver for AT24C32/64 and compatible I2C EEPROMs.
+ *
+ * Writes are queued and advanced from run(): every pass transmits at most
+ * one chunk, which never crosses a page and fits the Wire write buffer.
+ * The end of the internal write cycle is detected by ACK polling, the
+ * chip doesn't acknowledge its address until the cycle has completed.
+ * This way the firmware keeps running while the chip is busy instead of
+ * waiting the worst case write cycle time after every chunk.
+ *
+ * Reads are synchronous and stream from the chip: its address counter
+ * continues across pages, so only the first chunk of a read and reads not
+ * continuing the previous one have to send the address. Small reads are
+ * served from a write-through LRU page cache, which keeps repeatedly read
+ * metadata such as headers and indices in RAM. Reads return the queued
+ * data where it overlaps, so readers always see their writes.
+ *
+ * Code mostly stolen and then modified from:
+ * https://github.com/jlesech/Eeprom24C32_64/blob/master/Eeprom24C32_64.cpp
+ */
+class I2cAt24Cxx
+  : public I2cDevice
+{
+public:
+  typedef uint16_t Address;
+  /** EEPROM page size (see datasheet)
+   */
+  static const uint16_t PageSize = 32;
+
+  /** Read buffer size in Wire library.
+   */
+  static const uint16_t WireReadBufferSize = BUFFER_LENGTH;
+
+  /** Wire write buffer length, Two bytes are reserved for address.
+   */
+  static const uint16_t WireWriteBufferSize = BUFFER_LENGTH - 2;
+
+  /** Capacity of the write queue */
+  static const unsigned int MaxWrites = 8;
+  /** Bytes buffered for all queued writes */
+  static const unsigned int WriteBufferSize = 256;
+  /** The write cycle time (tWR) is 5 ms for current parts and 10 ms for
+   *  older ones. A chip busy for longer is considered broken.
+   */
+  static const unsigned int WriteCycleTimeoutMs = 20;
+  /** Pages held by the read cache. Reads of up to a page go through the
+   *  cache, larger ones bypass it to not evict the small ones.
+   */
+  static const unsigned int CachePages = 4;
+
+  typedef enum
+  {
+    StateAbsent = 0,
+    StateIdle,
+    /** A chunk has been transmitted and the chip is busy writing it */
+    StateWriteCycle,
+  } State;
+
+  /** Interface of everyone who wants to know when a write has completed */
+  class Consumer
+  {
+  public:
+    /** Called when all bytes of a write have been programmed or the
+     *  write failed.
+     */
+    virtual void eepromDone(Address address, size_t count, bool ok) = 0;
+  };
+
+  struct Stats
+  {
+    uint32_t m_writes;
+    uint32_t m_failed;
+    /** Writes rejected because the queue was full */
+    uint32_t m_rejected;
+    uint32_t m_chunks;
+    uint32_t m_bytes;
+    uint32_t m_polls;
+    /** Time spent transmitting chunks and waiting for write cycles */
+    Duration m_busy;
+    uint32_t m_maxCycleUs;
+    uint32_t m_reads;
+    uint32_t m_bytesRead;
+    /** Read transactions which had to set the address */
+    uint32_t m_addressed;
+    uint32_t m_cacheHits;
+    uint32_t m_cacheMisses;
+  };
+
+  I2cAt24Cxx(uint8_t address, size_t size = 4096);
+  /** Probes the EEPROM, returns false if it does not respond. */
+  bool begin();
+  void run();
+
+  /** Reads from the EEPROM. Unless served by the cache it blocks until a
+   *  running write cycle has completed.
+   */
+  bool read(Address address, uint8_t* data, size_t count);
+  uint8_t readByte(Address address)
+  {
+    uint8_t data = 0;
+    read(address, &data, 1);
+    return data;
+  }
+
+  /** Queues a write and returns immediately. The data is copied. Returns
+   *  false if the EEPROM is absent, the range is invalid or the queue is
+   *  full. The optional consumer is notified when the write has completed.
+   */
+  bool enqueue(Address address, const uint8_t* data, size_t count, Consumer* consumer = NULL);
+  /** Writes and blocks until the data has been programmed */
+  bool write(Address address, const uint8_t* data, size_t count);
+  bool write(Address address, uint8_t data)
+  {
+    return write(address, &data, 1);
+  }
+  /** Blocks until all queued writes have completed */
+  bool flush();
+  /** Removes the consumer from all queued writes, the writes still complete */
+  void cancel(Consumer& consumer);
+
+  bool isBusy() const
+  {
+    return m_numWrites or m_state == StateWriteCycle;
+  }
+  size_t getSize() const
+  {
+    return m_size;
+  }
+  State getState() const
+  {
+    return m_state;
+  }
+  static const char* getStateString(State state)
+  {
+    switch (state) {
+      case StateAbsent:     return "absent";
+      case StateIdle:       return "idle";
+      case StateWriteCycle: return "write cycle";
+      default:              return "unknown";
+    }
+  }
+  const Stats& getStats() const
+  {
+    return m_stats;
+  }
+  void clearStats()
+  {
+    m_stats = Stats{};
+  }
+  /** Write throughput while busy */
+  uint32_t getBytesPerSecond() const;
+  void invalidateCache();
+  Print& prt(Print& p) const;
+
+private:
+  struct Write
+  {
+    Address m_address;
+    uint16_t m_count;
+    /** Start of the data in the write buffer */
+    uint16_t m_offset;
+    /** Bytes transmitted so far */
+    uint16_t m_done;
+    Consumer* m_consumer;
+  };
+
+  struct CachedPage
+  {
+    Address m_address;
+    bool m_valid;
+    /** Value of the use counter at the last access, the smallest is evicted */
+    uint32_t m_lastUse;
+    uint8_t m_data[PageSize];
+  };
+
+  /** Transmits the next chunk of the oldest write */
+  void writeChunk();
+  /** Polls the chip, returns true if the write cycle has completed */
+  bool pollReady();
+  /** Busy waits until the write cycle has completed */
+  bool waitReady();
+  void finish(bool ok);
+  /** Reads from the chip, continuing the address counter if possible */
+  bool readSequential(Address address, uint8_t* data, size_t count);
+  /** Copies the queued data overlapping a read to the read data */
+  void overlay(Address address, uint8_t* data, size_t count) const;
+  /** Returns the cached page containing the address, reads it on a miss */
+  const CachedPage* getPage(Address address);
+  /** Copies written data to the cached pages, invalidates them if data is NULL */
+  void updateCache(Address address, const uint8_t* data, size_t count);
+
+  size_t m_size;
+  State m_state;
+  Write m_writes[MaxWrites];
+  unsigned int m_first;
+  unsigned int m_numWrites;
+  /** End of the used part of the write buffer, rewinds when the queue drains */
+  unsigned int m_bufferEnd;
+  uint8_t m_buffer[WriteBufferSize];
+  /** Size of the chunk in the running write cycle */
+  uint8_t m_chunkSize;
+  Instant m_chunkStart;
+  /** Address the chip's counter points to after the last read */
+  Address m_readAddress;
+  bool m_readAddressValid;
+  CachedPage m_cache[CachePages];
+  uint32_t m_useCounter;
+  Stats m_stats;
+};
+
+extern I2cAt24Cxx eeprom;
+
+#endif /* EW_IG_EEPROM_H */
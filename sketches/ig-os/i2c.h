@@ -0,0 +1,31 @@
+#ifndef EW_IG_I2C_H
+#define EW_IG_I2C_H
+
+#include <Wire.h>
+
+class I2cDevice
+{
+public:
+  struct Config
+  {
+    uint8_t m_type;
+    uint8_t m_address;
+  };
+  I2cDevice(uint8_t address = 0)
+    : m_address(address)
+  { }
+  void begin(uint8_t address)
+  {
+    m_address = address;
+    Wire.begin();
+  }
+
+  uint8_t getDeviceAddress() const
+  {
+    return m_address;
+  }
+private:
+  uint8_t m_address;
+};
+
+#endif /* EW_IG_I2C_H */
@@ -9,7 +9,6 @@
  *
  * Library manager:
  *   OneWire
- *   NTP Client
  *   ThingSpeak
  *
  *   DS1307RTC (optional for I2C real time clock)
@@ -39,6 +38,13 @@
 
 #include "cli.h"
 #include "spi.h"
+#include "ads1115.h"
+#include "temperature.h"
+#include "scheduler.h"
+#include "rules.h"
+#include "eeprom.h"
+#include "timeseries.h"
+#include "kvstore.h"
 #include "network.h"
 #include "webserver.h"
 
@@ -57,13 +63,16 @@ void setup()
   PrintVersion(Serial);
 
   flashSettings.begin();
+  flashCommitter.begin();
   
   Debug.enable(flashSettings.debug);
 
   Debug << "number of registered commands: " << uartCli.getNumCommandsRegistered(0) << "\n";
 
   Wire.begin();
-
+  eeprom.begin();
+  timeSeries.begin();
+  kvStore.begin();
   
   network.begin();
   systemTime.begin();
@@ -71,6 +80,10 @@ void setup()
 
   spi.begin();
   adc.begin();
+  if (UseExternalAdc) {
+    ads1115.begin();
+  }
+  temperatureBus.begin();
 
   for (WaterCircuit** w = circuits; *w; w++) {
     (*w)->begin();
@@ -93,8 +106,12 @@ void loop()
 
   systemTime.run();
 //  webserver.run();
-  spi.run();
   adc.run();
+  ads1115.run();
+  temperatureBus.run();
+  eeprom.run();
+  timeSeries.run();
+  flashCommitter.run();
 
   switch (systemMode.getMode()) {
     
@@ -105,12 +122,12 @@ void loop()
     
     case SystemMode::Auto:
     {
-      bool trigger = false;
-      if (wateringDue()) {
-        trigger = true;
+      Scheduler::Fire fire = {0};
+      if (scheduler.isDue(fire)) {
         Log << "watering triggered by scheduler at " << systemTime.getTimeStr() << "\n";
       }
       
+      bool trigger = false;
       if (uartCli.isWateringTriggered()) {
         trigger = true;
         Log << "watering triggered by CLI at " << systemTime.getTimeStr() << "\n";
@@ -126,21 +143,29 @@ void loop()
         Log << "watering triggered by telnet CLI at " << systemTime.getTimeStr() << "\n";
       }
       
-      for (WaterCircuit** c = circuits; *c; c++) {
+      unsigned int i = 0;
+      for (WaterCircuit** c = circuits; *c; c++, i++) {
         if ((*c)->isEnabled()) {
-          if (trigger) {
+          if (fire.m_circuits & (1 << i)) {
+            (*c)->trigger(fire.m_pumpSeconds[i]);
+          } else if (trigger) {
             (*c)->trigger();
           }
           (*c)->run();
         }
       }
 
+      ruleEngine.run();
+
       loggerRun();
 
       break;
     }
   }
 
+  /* Transmit all shift register changes of this pass at once */
+  spi.run();
+
   /* poor man's second blink */
 //  digitalWrite(LED_BUILTIN, millis() & 0x0000200UL ? HIGH : LOW);
 }
@@ -0,0 +1,306 @@
+#include "kvstore.h"
+
+namespace {
+
+const uint8_t Magic = 0x4b;
+/** key, length and CRC */
+const unsigned int RecordOverhead = 4;
+const unsigned int MaxRecordSize = RecordOverhead + KvStore::MaxValueSize;
+
+} /* namespace */
+
+KvStore kvStore(eeprom);
+
+KvStore::KvStore(I2cAt24Cxx& eeprom)
+  : m_eeprom(eeprom)
+  , m_ready(false)
+  , m_half(0)
+  , m_generation(0)
+  , m_end(HeaderSize)
+  , m_entries{}
+  , m_numEntries(0)
+  , m_stats{}
+{ }
+
+bool
+KvStore::begin()
+{
+  m_ready = false;
+  if (m_eeprom.getState() == I2cAt24Cxx::StateAbsent) {
+    return false;
+  }
+
+  uint16_t generations[2];
+  bool valid[2];
+  for (unsigned int half = 0; half < 2; half++) {
+    valid[half] = readHeader(half, generations[half]);
+  }
+
+  if (valid[0] and valid[1]) {
+    /* the generation wraps */
+    m_half = static_cast<int16_t>(generations[1] - generations[0]) > 0 ? 1 : 0;
+  } else if (valid[0] or valid[1]) {
+    m_half = valid[0] ? 0 : 1;
+  } else {
+    Debug << "kv store: formatting\n";
+    m_half = 0;
+    generations[0] = 1;
+    /* the chip might not be erased */
+    uint8_t end = KeyNone;
+    if (not m_eeprom.write(getBase(0) + HeaderSize, &end, 1) or not writeHeader(0, generations[0])) {
+      return false;
+    }
+  }
+  m_generation = generations[m_half];
+
+  scan();
+  m_ready = true;
+  Debug << "kv store: " << m_numEntries << " keys, " << m_end << " of " << HalfSize << " bytes used\n";
+  return true;
+}
+
+bool
+KvStore::get(uint8_t key, void* value, size_t size)
+{
+  const Entry* e = find(key);
+  if (not m_ready or not e or e->m_size != size) {
+    return false;
+  }
+  return m_eeprom.read(getBase(m_half) + e->m_offset + 2, static_cast<uint8_t*>(value), size);
+}
+
+bool
+KvStore::set(uint8_t key, const void* value, size_t size)
+{
+  if (not m_ready or key == KeyNone or size > MaxValueSize) {
+    return false;
+  }
+
+  Entry* e = find(key);
+  if (e and e->m_size == size) {
+    uint8_t current[MaxValueSize];
+    if (get(key, current, size) and memcmp(current, value, size) == 0) {
+      m_stats.m_unchanged++;
+      return true;
+    }
+  }
+  if (not e and m_numEntries == MaxKeys) {
+    return false;
+  }
+
+  /* the record and the terminator */
+  if (m_end + RecordOverhead + size + 1 > HalfSize) {
+    if (not compact()) {
+      return false;
+    }
+    e = find(key);
+    if (m_end + RecordOverhead + size + 1 > HalfSize) {
+      return false;
+    }
+  }
+
+  uint8_t record[MaxRecordSize + 1];
+  unsigned int n = makeRecord(record, m_generation, key, value, size);
+  record[n] = KeyNone;
+  I2cAt24Cxx::Address address = getBase(m_half) + m_end;
+  if (not m_eeprom.enqueue(address, record, n + 1, this)) {
+    /* queue full, wait for it */
+    m_eeprom.flush();
+    if (not m_eeprom.enqueue(address, record, n + 1, this)) {
+      m_stats.m_errors++;
+      return false;
+    }
+  }
+
+  if (not e) {
+    e = &m_entries[m_numEntries++];
+    e->m_key = key;
+  }
+  e->m_size = size;
+  e->m_offset = m_end;
+  m_end += n;
+  m_stats.m_updates++;
+  return true;
+}
+
+const KvStore::Entry*
+KvStore::find(uint8_t key) const
+{
+  for (unsigned int i = 0; i < m_numEntries; i++) {
+    if (m_entries[i].m_key == key) {
+      return &m_entries[i];
+    }
+  }
+  return NULL;
+}
+
+bool
+KvStore::readHeader(unsigned int half, uint16_t& generation)
+{
+  uint8_t header[HeaderSize];
+  if (not m_eeprom.read(getBase(half), header, HeaderSize)) {
+    return false;
+  }
+  generation = header[1] | (header[2] << 8);
+  return header[0] == Magic and (crc32(header, HeaderSize - 1) & 0xff) == header[HeaderSize - 1];
+}
+
+bool
+KvStore::writeHeader(unsigned int half, uint16_t generation)
+{
+  uint8_t header[HeaderSize] = {Magic, static_cast<uint8_t>(generation & 0xff), static_cast<uint8_t>(generation >> 8), 0};
+  header[HeaderSize - 1] = crc32(header, HeaderSize - 1) & 0xff;
+  return m_eeprom.write(getBase(half), header, HeaderSize);
+}
+
+unsigned int
+KvStore::makeRecord(uint8_t* record, uint16_t generation, uint8_t key, const void* value, size_t size)
+{
+  record[0] = key;
+  record[1] = size;
+  memcpy(record + 2, value, size);
+
+  /* the generation is part of the CRC only */
+  uint8_t g[2] = {static_cast<uint8_t>(generation & 0xff), static_cast<uint8_t>(generation >> 8)};
+  uint32_t crc = crc32(record, 2 + size, crc32(g, sizeof(g)));
+  record[2 + size] = crc & 0xff;
+  record[3 + size] = (crc >> 8) & 0xff;
+  return RecordOverhead + size;
+}
+
+void
+KvStore::scan()
+{
+  I2cAt24Cxx::Address base = getBase(m_half);
+  m_numEntries = 0;
+  m_end = HeaderSize;
+
+  while (m_end + RecordOverhead <= HalfSize) {
+    uint8_t record[MaxRecordSize];
+    if (not m_eeprom.read(base + m_end, record, 2)) {
+      break;
+    }
+    uint8_t key = record[0];
+    uint8_t size = record[1];
+    if (key == KeyNone or size > MaxValueSize or m_end + RecordOverhead + size > HalfSize) {
+      break;
+    }
+    if (not m_eeprom.read(base + m_end + 2, record + 2, RecordOverhead - 2 + size)) {
+      break;
+    }
+    uint8_t check[MaxRecordSize];
+    makeRecord(check, m_generation, key, record + 2, size);
+    if (memcmp(check + 2 + size, record + 2 + size, RecordOverhead - 2) != 0) {
+      /* torn write, or a stale record after a lost terminator */
+      break;
+    }
+
+    Entry* e = find(key);
+    if (not e) {
+      if (m_numEntries == MaxKeys) {
+        break;
+      }
+      e = &m_entries[m_numEntries++];
+      e->m_key = key;
+    }
+    e->m_size = size;
+    e->m_offset = m_end;
+    m_end += RecordOverhead + size;
+  }
+}
+
+bool
+KvStore::compact()
+{
+  unsigned int target = m_half ^ 1;
+  uint16_t generation = m_generation + 1;
+  I2cAt24Cxx::Address base = getBase(target);
+
+  /* Collect the records in page sized batches, each batch is one write */
+  uint8_t batch[I2cAt24Cxx::PageSize + MaxRecordSize + 1];
+  unsigned int batchSize = 0;
+  unsigned int end = HeaderSize;
+  uint16_t offsets[MaxKeys];
+
+  for (unsigned int i = 0; i < m_numEntries; i++) {
+    const Entry& e = m_entries[i];
+    uint8_t value[MaxValueSize];
+    if (not get(e.m_key, value, e.m_size)) {
+      m_stats.m_errors++;
+      return false;
+    }
+    offsets[i] = end + batchSize;
+    batchSize += makeRecord(batch + batchSize, generation, e.m_key, value, e.m_size);
+    if (end + batchSize + 1 > HalfSize) {
+      m_stats.m_errors++;
+      return false;
+    }
+    if (batchSize >= I2cAt24Cxx::PageSize) {
+      if (not m_eeprom.write(base + end, batch, batchSize)) {
+        m_stats.m_errors++;
+        return false;
+      }
+      end += batchSize;
+      batchSize = 0;
+    }
+  }
+  /* the terminator hides the records the half holds from its last use */
+  batch[batchSize] = KeyNone;
+  if (not m_eeprom.write(base + end, batch, batchSize + 1)) {
+    m_stats.m_errors++;
+    return false;
+  }
+  end += batchSize;
+
+  /* the header activates the new half */
+  if (not writeHeader(target, generation)) {
+    m_stats.m_errors++;
+    return false;
+  }
+
+  for (unsigned int i = 0; i < m_numEntries; i++) {
+    m_entries[i].m_offset = offsets[i];
+  }
+  m_half = target;
+  m_generation = generation;
+  m_end = end;
+  m_stats.m_compactions++;
+  Debug << "kv store: compacted to half " << m_half << ", " << m_end << " bytes used\n";
+  return true;
+}
+
+void
+KvStore::eepromDone(I2cAt24Cxx::Address address, size_t count, bool ok)
+{
+  if (not ok) {
+    m_stats.m_errors++;
+  }
+}
+
+Print&
+KvStore::prt(Print& p)
+{
+  if (not m_ready) {
+    p << "not available\n";
+    return p;
+  }
+  p << "            region  ";
+  prtFmt(p, "0x%04x .. 0x%04x\n", KvStoreBegin, KvStoreEnd - 1);
+  p << "       active half  " << m_half << ", generation " << m_generation << "\n"
+    << "              used  " << m_end << " of " << HalfSize << " bytes, " << m_numEntries << " keys\n"
+    << "           updates  " << m_stats.m_updates << " (" << m_stats.m_unchanged << " unchanged skipped)\n"
+    << "       compactions  " << m_stats.m_compactions << "\n"
+    << "            errors  " << m_stats.m_errors << "\n";
+  for (unsigned int i = 0; i < m_numEntries; i++) {
+    const Entry& e = m_entries[i];
+    uint8_t value[MaxValueSize];
+    prtFmt(p, "  0x%02x  ", e.m_key);
+    if (get(e.m_key, value, e.m_size)) {
+      for (unsigned int k = 0; k < e.m_size; k++) {
+        prtFmt(p, "%02x", value[k]);
+      }
+    }
+    p << "\n";
+  }
+  return p;
+}
@@ -0,0 +1,135 @@
+#ifndef EW_IG_KVSTORE_H
+#define EW_IG_KVSTORE_H
+
+#include "config.h"
+#include "eeprom.h"
+
+/** Log structured key value store on the EEPROM for small values which
+ *  change often, e.g. counters and time stamps.
+ *
+ * The region is split into two halves, one of which is active. It starts
+ * with a header
+ *
+ *   magic        1 byte
+ *   generation   2 bytes, the half with the newer generation is active
+ *   crc          1 byte, lowest byte of the CRC-32 over magic and generation
+ *
+ * followed by the records, each update appends one
+ *
+ *   key          1 byte
+ *   length       1 byte
+ *   value        length bytes
+ *   crc          2 bytes, lower half of the CRC-32 over generation, key,
+ *                length and value
+ *
+ * The last record is followed by a KeyNone byte, which is written together
+ * with the record and overwritten by the next one. It keeps the records
+ * left over from an earlier generation of the half out of the log. A
+ * record torn by a reset fails its CRC and ends the log as well, so an
+ * update either takes effect completely or not at all. When the active
+ * half is full the latest record of every key is copied to the other half
+ * and its header is written last, which switches the halves atomically.
+ * Alternating the halves and appending spreads the writes over the region.
+ *
+ * A RAM index of the latest record of each key is built at boot with one
+ * sequential scan of the active half.
+ */
+class KvStore
+  : public I2cAt24Cxx::Consumer
+{
+public:
+  static const unsigned int HalfSize = (KvStoreEnd - KvStoreBegin) / 2;
+  static const unsigned int HeaderSize = 4;
+  static const unsigned int MaxKeys = 32;
+  static const unsigned int MaxValueSize = 16;
+
+  typedef enum
+  {
+    /** Lifetime run time of the pumps in seconds, uint32, one key per pump */
+    KeyPumpSeconds    = 0x01,
+    /** Last fire epoch of the schedule entries, uint32, one key per entry */
+    KeyScheduleStamps = 0x20,
+    /** Marks the end of the log */
+    KeyNone           = 0xff,
+  } Key;
+
+  struct Stats
+  {
+    uint32_t m_updates;
+    /** Updates skipped because the value didn't change */
+    uint32_t m_unchanged;
+    uint32_t m_compactions;
+    uint32_t m_errors;
+  };
+
+  KvStore(I2cAt24Cxx& eeprom);
+  /** Selects the active half and builds the index, formats the store if
+   *  neither half is valid.
+   */
+  bool begin();
+
+  /** Reads a value, returns false if the key doesn't exist or has a different size */
+  bool get(uint8_t key, void* value, size_t size);
+  /** Appends a record for the value unless it is unchanged. The record is
+   *  written in the background. Compaction blocks for some page writes.
+   */
+  bool set(uint8_t key, const void* value, size_t size);
+  bool exists(uint8_t key) const
+  {
+    return find(key) != NULL;
+  }
+
+  bool isReady() const
+  {
+    return m_ready;
+  }
+  const Stats& getStats() const
+  {
+    return m_stats;
+  }
+  Print& prt(Print& p);
+
+  virtual void eepromDone(I2cAt24Cxx::Address address, size_t count, bool ok);
+
+private:
+  struct Entry
+  {
+    uint8_t m_key;
+    uint8_t m_size;
+    /** Offset of the record in the active half */
+    uint16_t m_offset;
+  };
+
+  static I2cAt24Cxx::Address getBase(unsigned int half)
+  {
+    return KvStoreBegin + half * HalfSize;
+  }
+  const Entry* find(uint8_t key) const;
+  Entry* find(uint8_t key)
+  {
+    return const_cast<Entry*>(static_cast<const KvStore*>(this)->find(key));
+  }
+  /** Reads and checks the header of a half */
+  bool readHeader(unsigned int half, uint16_t& generation);
+  bool writeHeader(unsigned int half, uint16_t generation);
+  /** Builds a record, returns its size */
+  static unsigned int makeRecord(uint8_t* record, uint16_t generation, uint8_t key, const void* value, size_t size);
+  /** Builds the index from the records of the active half */
+  void scan();
+  /** Copies the latest records to the other half and activates it */
+  bool compact();
+
+  I2cAt24Cxx& m_eeprom;
+  bool m_ready;
+  unsigned int m_half;
+  uint16_t m_generation;
+  /** Offset of the end of the log in the active half */
+  unsigned int m_end;
+  Entry m_entries[MaxKeys];
+  unsigned int m_numEntries;
+  Stats m_stats;
+};
+
+extern KvStore kvStore;
+
+#endif /* EW_IG_KVSTORE_H */
@@ -1,12 +1,14 @@
 
 #include "log.h"
 #include "system.h"
+#include "timeseries.h"
 
 Logger::Logger(WaterCircuit& circuit, Settings& settings)
   : m_settings(settings)
   , m_circuit(circuit)
   , m_state(StateIdle)
-  , m_previousLogTime(0)
+  , m_previousLog()
+  , m_triggered(false)
 { }
 
 void
@@ -23,7 +25,7 @@ Logger::run()
     {
       Sensor& sensor = m_circuit.getSensor();
       if (sensor.getState() == Sensor::StateIdle) {
-        sensor.enable();
+        sensor.enable(Sensor::PriorityLow);
         m_state = StateSetupSensor;
       }
       break;
@@ -33,9 +35,15 @@ Logger::run()
       Sensor& sensor = m_circuit.getSensor();
       sensor.run();
       if (sensor.getState() == Sensor::StateReady) {
+        bool valid = sensor.isValid();
         m_humidity = sensor.read();
         sensor.disable();
-        m_state = StateWaitReservoir;
+        /* nothing to log, try again next interval */
+        m_state = valid ? StateWaitReservoir : StateIdle;
+        if (not valid) {
+          m_previousLog = Instant::now();
+          m_triggered = false;
+        }
       }
       break;
     }
@@ -43,7 +51,7 @@ Logger::run()
     {
       Sensor& reservoir = m_circuit.getReservoir();
       if (reservoir.getState() == Sensor::StateIdle) {
-        reservoir.enable();
+        reservoir.enable(Sensor::PriorityLow);
         m_state = StateSetupReservoir;
       }
       break;
@@ -53,14 +61,30 @@ Logger::run()
       Sensor& reservoir = m_circuit.getReservoir();
       reservoir.run();
       if (reservoir.getState() == Sensor::StateReady) {
+        bool valid = reservoir.isValid();
         m_reservoir = reservoir.read();
         reservoir.disable();
+        if (not valid) {
+          m_previousLog = Instant::now();
+          m_triggered = false;
+          m_state = StateIdle;
+          break;
+        }
 
-        if (log(m_humidity, m_reservoir, m_circuit.getPump().getTotalEnabledSeconds())) {
+        unsigned long pumpSeconds = m_circuit.getPump().getTotalEnabledSeconds();
+        if (log(m_humidity, m_reservoir, pumpSeconds)) {
           Log << "logged data for circuit " << m_circuit.getId() << " at " << systemTime.getTimeStr() << "\n";
         }
+        TimeSeries::Record record;
+        record.m_epoch = systemTime.isValid() ? systemTime.getEpoch() : 0;
+        record.m_circuit = m_circuit.getId();
+        record.m_humidity = m_humidity;
+        record.m_reservoir = m_reservoir;
+        record.m_pumpSeconds = pumpSeconds;
+        timeSeries.append(record);
 
-        m_previousLogTime = millis();
+        m_previousLog = Instant::now();
+        m_triggered = false;
 
         m_state = StateIdle;
       }
@@ -74,8 +98,7 @@ Logger::run()
 void
 Logger::trigger()
 {
-  /* Shifting previous log time into past such that it triggers the logger */
-  m_previousLogTime = millis() - (unsigned long)m_settings.m_intervalMinutes * 60UL * 1000UL;
+  m_triggered = true;
 }
 
 bool
@@ -84,7 +107,7 @@ Logger::isDue() const
   if (m_settings.m_intervalMinutes == 0 or not m_circuit.isEnabled()) {
     return false;
   }
-  return millis() - m_previousLogTime > (unsigned long)m_settings.m_intervalMinutes * 60UL * 1000UL;
+  return m_triggered or m_previousLog.elapsed() > Duration::fromMinutes(m_settings.m_intervalMinutes);
 }
 
 #include "ThingSpeak.h"
@@ -43,7 +43,9 @@ protected:
 private:
   WaterCircuit& m_circuit;
   State m_state;
-  unsigned long m_previousLogTime;
+  Instant m_previousLog;
+  /** Log with the next run() regardless of the interval */
+  bool m_triggered;
 
   uint8_t m_humidity;
   uint8_t m_reservoir;
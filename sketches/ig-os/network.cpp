@@ -9,7 +9,7 @@ Network network;
 
 Network::Network()
   : m_state(StateDisconnected)
-  , m_connectStartMs(0)
+  , m_connectStart()
   , m_connectTimeoutMs(10000)
 { }
 
@@ -50,7 +50,7 @@ Network::run()
   switch (m_state) {
     
     case StateDisconnected:
-      if (millis() - m_connectStartMs > ConnectRetryMs) {
+      if (m_connectStart.elapsed() > Duration::fromMs(ConnectRetryMs)) {
         connect();
       }
       break;
@@ -65,7 +65,7 @@ Network::run()
 
         startMdns();
         
-      } else if (millis() - m_connectStartMs > m_connectTimeoutMs) {
+      } else if (m_connectStart.elapsed() > Duration::fromMs(m_connectTimeoutMs)) {
         // Stop any pending request
         WiFi.disconnect();
         m_state = StateDisconnected;
@@ -98,7 +98,7 @@ Network::connect()
     return;
   }
 
-  m_connectStartMs = millis();
+  m_connectStart = Instant::now();
 
   // Set WiFi mode to station (as opposed to AP or AP_STA)
   WiFi.mode(WIFI_STA);
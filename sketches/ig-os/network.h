@@ -1,6 +1,8 @@
 #ifndef EW_IG_NETWORK_H
 #define EW_IG_NETWORK_H
 
+#include "clock.h"
+
 #include <Arduino.h>
 
 /* TODO: make use of wifi callbacks!
@@ -42,7 +44,7 @@ private:
   void startMdns();
 
   State m_state;
-  unsigned long m_connectStartMs;
+  Instant m_connectStart;
   unsigned long m_connectTimeoutMs;
 };
 
@@ -0,0 +1,318 @@
+#include "ntp.h"
+#include "network.h"
+#include "log.h"
+
+namespace {
+
+/** Seconds between 1.1.1900 (NTP era 0) and 1.1.1970 */
+const uint64_t NtpUnixDelta = 2208988800ULL;
+
+uint64_t
+readStamp(const uint8_t* p)
+{
+  uint64_t v = 0;
+  for (unsigned int i = 0; i < 8; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+void
+writeStamp(uint8_t* p, uint64_t v)
+{
+  for (int i = 7; i >= 0; i--) {
+    p[i] = v & 0xff;
+    v >>= 8;
+  }
+}
+
+} /* namespace */
+
+NtpClient::NtpClient(Settings& settings)
+  : m_settings(settings)
+  , m_state(StateIdle)
+  , m_servers{}
+  , m_next(0)
+  , m_roundStart()
+  , m_lookedUp(false)
+  , m_forceUpdate(true)
+  , m_offsetMs(0)
+  , m_stats{}
+{
+  m_stats.m_selected = -1;
+}
+
+void
+NtpClient::begin()
+{
+  m_udp.begin(LocalPort);
+}
+
+uint64_t
+NtpClient::getUnixMs() const
+{
+  return Instant::now().toUs() / 1000 + m_offsetMs;
+}
+
+uint64_t
+NtpClient::toNtp(uint64_t unixMs)
+{
+  uint64_t seconds = unixMs / 1000 + NtpUnixDelta;
+  uint64_t fraction = ((unixMs % 1000) << 32) / 1000;
+  return (seconds << 32) | fraction;
+}
+
+uint64_t
+NtpClient::toUnixMs(uint64_t ntp)
+{
+  uint64_t seconds = ntp >> 32;
+  if (seconds < NtpUnixDelta) {
+    return 0;
+  }
+  return (seconds - NtpUnixDelta) * 1000 + (((ntp & 0xffffffffULL) * 1000 + (1ULL << 31)) >> 32);
+}
+
+void
+NtpClient::run()
+{
+  switch (m_state) {
+    case StateIdle:
+    {
+      Duration interval = isSynced() ? Duration::fromSeconds(m_settings.m_pollSeconds) : Duration::fromMs(RetryMs);
+      if (not network.isConnected()) {
+        break;
+      }
+      if (m_forceUpdate or m_roundStart.elapsed() >= interval) {
+        startRound();
+      }
+      break;
+    }
+    case StateQuery:
+    {
+      receive();
+      if (m_next < MaxServers) {
+        /* one request per pass keeps the loop latency low */
+        send(m_next++);
+        break;
+      }
+      bool pending = false;
+      for (auto& s : m_servers) {
+        pending = pending or s.m_pending;
+      }
+      if (not pending or m_roundStart.elapsed() >= Duration::fromMs(ReplyTimeoutMs)) {
+        finishRound();
+      }
+      break;
+    }
+  }
+}
+
+void
+NtpClient::startRound()
+{
+  m_forceUpdate = false;
+  m_state = StateQuery;
+  m_next = 0;
+  m_roundStart = Instant::now();
+  m_lookedUp = false;
+  m_stats.m_rounds++;
+
+  for (auto& s : m_servers) {
+    s.m_pending = false;
+    s.m_replied = false;
+  }
+  /* drop replies of the previous round */
+  while (m_udp.parsePacket() > 0) {
+    m_udp.flush();
+  }
+}
+
+bool
+NtpClient::resolve(unsigned int index)
+{
+  Server& s = m_servers[index];
+  const char* name = m_settings.m_servers[index];
+
+  if (s.m_resolved and s.m_resolveTime.elapsed() < Duration::fromMs(ResolveIntervalMs)) {
+    return true;
+  }
+  IPAddress ip;
+  if (not ip.fromString(name)) {
+    /* The lookup blocks for up to DnsTimeoutMs, the previous address is
+     * good enough until the next lookup is allowed.
+     */
+    if (m_lookedUp or (s.m_resolveRetry.isArmed() and not s.m_resolveRetry.expired())) {
+      return s.m_resolved;
+    }
+    m_lookedUp = true;
+    if (WiFi.hostByName(name, ip, DnsTimeoutMs) != 1) {
+      s.m_resolveFailures++;
+      s.m_resolveBackoffMs = s.m_resolveBackoffMs ? s.m_resolveBackoffMs * 2 : ResolveRetryMinMs;
+      if (s.m_resolveBackoffMs > ResolveRetryMaxMs) {
+        s.m_resolveBackoffMs = ResolveRetryMaxMs;
+      }
+      s.m_resolveRetry.start(Duration::fromMs(s.m_resolveBackoffMs));
+      Debug << "NTP: failed to resolve " << name << ", retry in " << s.m_resolveBackoffMs / 1000 << " s\n";
+      return s.m_resolved;
+    }
+  }
+  s.m_ip = ip;
+  s.m_resolved = true;
+  s.m_resolveTime = Instant::now();
+  s.m_resolveRetry.stop();
+  s.m_resolveBackoffMs = 0;
+  return true;
+}
+
+void
+NtpClient::send(unsigned int index)
+{
+  if (not *m_settings.m_servers[index] or not resolve(index)) {
+    return;
+  }
+  Server& s = m_servers[index];
+
+  uint8_t packet[PacketSize] = {0};
+  /* LI unsynchronized (3), version 4, mode client (3) */
+  packet[0] = 0xe3;
+  /* The transmit timestamp is returned as originate timestamp and
+   * identifies the reply. It is our time of transmission (T1).
+   */
+  s.m_sentStamp = toNtp(getUnixMs());
+  writeStamp(packet + 40, s.m_sentStamp);
+
+  if (not m_udp.beginPacket(s.m_ip, NtpPort)) {
+    return;
+  }
+  m_udp.write(packet, sizeof(packet));
+  s.m_pending = m_udp.endPacket() != 0;
+}
+
+void
+NtpClient::receive()
+{
+  while (m_udp.parsePacket() > 0) {
+    /* time of arrival (T4), as early as possible */
+    uint64_t t4 = getUnixMs();
+
+    uint8_t packet[PacketSize];
+    int len = m_udp.read(packet, sizeof(packet));
+    IPAddress from = m_udp.remoteIP();
+    m_udp.flush();
+
+    Server* s = NULL;
+    for (auto& c : m_servers) {
+      if (c.m_pending and c.m_ip == from and readStamp(packet + 24) == c.m_sentStamp) {
+        s = &c;
+        break;
+      }
+    }
+    if (not s) {
+      continue;
+    }
+    s->m_pending = false;
+
+    uint8_t leap = packet[0] >> 6;
+    uint8_t mode = packet[0] & 0x07;
+    uint8_t stratum = packet[1];
+    uint64_t t2 = toUnixMs(readStamp(packet + 32));
+    uint64_t t3 = toUnixMs(readStamp(packet + 40));
+    /* unsynchronized server or kiss-o'-death */
+    if (len != static_cast<int>(PacketSize) or leap == 3 or mode != 4 or
+        stratum < 1 or stratum > 15 or not t2 or not t3) {
+      s->m_rejected++;
+      continue;
+    }
+
+    uint64_t t1 = toUnixMs(s->m_sentStamp);
+    int64_t offset = (static_cast<int64_t>(t2 - t1) + static_cast<int64_t>(t3 - t4)) / 2;
+    int64_t delay = static_cast<int64_t>(t4 - t1) - static_cast<int64_t>(t3 - t2);
+
+    s->m_replied = true;
+    s->m_offsetMs = offset;
+    s->m_delayMs = delay < 0 ? 0 : delay;
+    s->m_stratum = stratum;
+    s->m_replies++;
+  }
+}
+
+void
+NtpClient::finishRound()
+{
+  m_state = StateIdle;
+
+  int best = -1;
+  for (unsigned int i = 0; i < MaxServers; i++) {
+    Server& s = m_servers[i];
+    if (s.m_pending) {
+      s.m_pending = false;
+      s.m_timeouts++;
+    }
+    if (s.m_replied and (best < 0 or s.m_delayMs < m_servers[best].m_delayMs)) {
+      best = i;
+    }
+  }
+  if (best < 0) {
+    m_stats.m_failedRounds++;
+    return;
+  }
+
+  const Server& s = m_servers[best];
+  if (not isSynced() or s.m_offsetMs >= StepThresholdMs or s.m_offsetMs <= -StepThresholdMs) {
+    m_offsetMs += s.m_offsetMs;
+    m_stats.m_steps++;
+  } else {
+    m_offsetMs += s.m_offsetMs / (1 << SmoothingShift);
+  }
+  m_stats.m_offsetMs = s.m_offsetMs > INT32_MAX ? INT32_MAX : (s.m_offsetMs < INT32_MIN ? INT32_MIN : s.m_offsetMs);
+  m_stats.m_delayMs = s.m_delayMs;
+  m_stats.m_selected = best;
+  m_stats.m_lastSync = Instant::now();
+  m_stats.m_syncs++;
+}
+
+bool
+NtpClient::setServer(unsigned int index, const char* name)
+{
+  if (index >= MaxServers) {
+    return false;
+  }
+  if (name == NULL) {
+    name = "";
+  }
+  if (strlen(name) > MaxServerLen) {
+    return false;
+  }
+  strcpy(m_settings.m_servers[index], name);
+  m_servers[index] = Server{};
+  return true;
+}
+
+Print&
+NtpClient::prt(Print& p) const
+{
+  p << "        UTC offset  " << m_settings.m_utcOffsetMinutes << " min\n"
+    << "     poll interval  " << m_settings.m_pollSeconds << " s\n"
+    << "            rounds  " << m_stats.m_rounds << " (" << m_stats.m_failedRounds << " failed)\n"
+    << "             syncs  " << m_stats.m_syncs << " (" << m_stats.m_steps << " steps)\n";
+  if (isSynced()) {
+    p << "       last offset  " << m_stats.m_offsetMs << " ms, round trip " << m_stats.m_delayMs << " ms\n";
+  }
+  for (unsigned int i = 0; i < MaxServers; i++) {
+    const Server& s = m_servers[i];
+    p << "[" << i + 1 << "] " << (*m_settings.m_servers[i] ? m_settings.m_servers[i] : "<none>");
+    if (s.m_resolved) {
+      p << " (" << s.m_ip << ")";
+    }
+    if (static_cast<int>(i) == m_stats.m_selected) {
+      p << " *";
+    }
+    p << "\n";
+    if (s.m_replies) {
+      p << "    stratum " << s.m_stratum << ", offset " << static_cast<long>(s.m_offsetMs) << " ms, round trip " << s.m_delayMs << " ms\n";
+    }
+    p << "    " << s.m_replies << " replies, " << s.m_timeouts << " timeouts, " << s.m_rejected << " rejected, "
+      << s.m_resolveFailures << " failed lookups\n";
+  }
+  return p;
+}
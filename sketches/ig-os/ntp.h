@@ -0,0 +1,169 @@
+#ifndef EW_IG_NTP_H
+#define EW_IG_NTP_H
+
+#include "config.h"
+#include "clock.h"
+
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+
+/** Non-blocking SNTP client querying several servers.
+ *
+ * Every poll interval a round of requests is sent, one server per call of
+ * run(). Replies are picked up by later calls of run() as they arrive, so
+ * the main loop never waits for the network. When all servers replied or
+ * the reply timeout expired, the reply with the shortest round trip time
+ * is selected, since the offset error is bounded by half the round trip.
+ * An offset above StepThresholdMs (or the first one) steps the clock,
+ * smaller offsets are applied by 1/2^SmoothingShift per round, which
+ * filters the jitter of single replies.
+ *
+ * Server names are resolved once a day with a short timeout, IP addresses
+ * (e.g. of a local test server) are used as they are. The lookup blocks,
+ * so at most one name is looked up per round and a name which failed is
+ * retried with a backoff doubling from ResolveRetryMinMs up to
+ * ResolveRetryMaxMs. Meanwhile the last address of the name is used.
+ */
+class NtpClient
+{
+public:
+  static const unsigned int MaxServers = 3;
+  static const unsigned int MaxServerLen = 39;
+  static const uint16_t NtpPort = 123;
+  static const uint16_t LocalPort = 2390;
+  static const unsigned int PacketSize = 48;
+  /** Replies arriving later are discarded */
+  static const unsigned long ReplyTimeoutMs = 1500;
+  /** Poll interval until the first successful round */
+  static const unsigned long RetryMs = 15UL * 1000;
+  static const unsigned long ResolveIntervalMs = 24UL * 60 * 60 * 1000;
+  static const uint32_t DnsTimeoutMs = 500;
+  static const unsigned long ResolveRetryMinMs = 60UL * 1000;
+  static const unsigned long ResolveRetryMaxMs = 60UL * 60 * 1000;
+  static const long StepThresholdMs = 1000;
+  static const unsigned int SmoothingShift = 2;
+
+  typedef enum
+  {
+    StateIdle = 0,
+    StateQuery,
+  } State;
+
+  struct Settings
+  {
+    /** Host names or IP addresses, empty if unused */
+    char m_servers[MaxServers][MaxServerLen + 1];
+    /** Offset of the local time to UTC */
+    int16_t m_utcOffsetMinutes;
+    uint16_t m_pollSeconds;
+  };
+
+  struct Server
+  {
+    IPAddress m_ip;
+    bool m_resolved;
+    Instant m_resolveTime;
+    /** No lookup before this expired after a failed one */
+    Deadline m_resolveRetry;
+    uint32_t m_resolveBackoffMs;
+    uint16_t m_resolveFailures;
+    /** A request of the current round awaits its reply */
+    bool m_pending;
+    /** Transmit timestamp of the request, echoed by the server */
+    uint64_t m_sentStamp;
+    /** Reply of the current round */
+    bool m_replied;
+    /** Before the first sync this is the full unix time */
+    int64_t m_offsetMs;
+    uint32_t m_delayMs;
+    uint8_t m_stratum;
+    uint16_t m_replies;
+    uint16_t m_timeouts;
+    uint16_t m_rejected;
+  };
+
+  struct Stats
+  {
+    uint32_t m_rounds;
+    uint32_t m_syncs;
+    uint32_t m_steps;
+    uint32_t m_failedRounds;
+    /** Offset and round trip of the last selected reply, the offset saturates */
+    int32_t m_offsetMs;
+    uint32_t m_delayMs;
+    int8_t m_selected;
+    Instant m_lastSync;
+  };
+
+  NtpClient(Settings& settings);
+  void begin();
+  void run();
+
+  bool isSynced() const
+  {
+    return m_stats.m_syncs > 0;
+  }
+  /** Number of successful rounds, changes on every update of the clock */
+  uint32_t getSyncs() const
+  {
+    return m_stats.m_syncs;
+  }
+  /** Milliseconds since 1.1.1970 UTC */
+  uint64_t getUnixMs() const;
+  /** Local time in seconds since 1.1.1970 */
+  unsigned long getEpochTime() const
+  {
+    return getUnixMs() / 1000 + m_settings.m_utcOffsetMinutes * 60L;
+  }
+
+  /** Starts a new round with the next run() */
+  void forceUpdate()
+  {
+    m_forceUpdate = true;
+  }
+  /** Sets the server with index 0 .. MaxServers - 1, NULL or "" removes it */
+  bool setServer(unsigned int index, const char* name);
+  void setUtcOffsetMinutes(int16_t minutes)
+  {
+    m_settings.m_utcOffsetMinutes = minutes;
+  }
+  void setPollSeconds(uint16_t seconds)
+  {
+    m_settings.m_pollSeconds = seconds;
+  }
+  const Settings& getSettings() const
+  {
+    return m_settings;
+  }
+  const Stats& getStats() const
+  {
+    return m_stats;
+  }
+
+  Print& prt(Print& p) const;
+
+private:
+  void startRound();
+  bool resolve(unsigned int index);
+  void send(unsigned int index);
+  void receive();
+  void finishRound();
+  static uint64_t toNtp(uint64_t unixMs);
+  static uint64_t toUnixMs(uint64_t ntp);
+
+  Settings& m_settings;
+  WiFiUDP m_udp;
+  State m_state;
+  Server m_servers[MaxServers];
+  /** Next server to send a request to in this round */
+  unsigned int m_next;
+  Instant m_roundStart;
+  /** A name was looked up in this round */
+  bool m_lookedUp;
+  bool m_forceUpdate;
+  /** Unix time minus the monotonic clock */
+  int64_t m_offsetMs;
+  Stats m_stats;
+};
+
+#endif /* EW_IG_NTP_H */
@@ -0,0 +1,116 @@
+#include "rtc.h"
+
+namespace {
+
+const uint8_t RegSeconds = 0x00;
+const unsigned int NumTimeRegisters = 7;
+/** DS1307 clock halt bit in the seconds register, always zero on the DS3231 */
+const uint8_t ClockHalt = 0x80;
+/** 12 hour mode bit in the hours register */
+const uint8_t Mode12h = 0x40;
+
+} /* namespace */
+
+bool
+Ds1307::begin()
+{
+  Wire.beginTransmission(getDeviceAddress());
+  m_present = Wire.endTransmission() == 0;
+  return m_present;
+}
+
+bool
+Ds1307::read(unsigned long& epoch)
+{
+  if (not m_present) {
+    return false;
+  }
+
+  Wire.beginTransmission(getDeviceAddress());
+  Wire.write(RegSeconds);
+  if (Wire.endTransmission() != 0 or
+      Wire.requestFrom(getDeviceAddress(), (uint8_t)NumTimeRegisters) != NumTimeRegisters) {
+    m_errors++;
+    return false;
+  }
+  uint8_t r[NumTimeRegisters];
+  for (auto& b : r) {
+    b = Wire.read();
+  }
+
+  if ((r[0] & ClockHalt) or (r[2] & Mode12h)) {
+    return false;
+  }
+  unsigned int seconds = fromBcd(r[0] & 0x7f);
+  unsigned int minutes = fromBcd(r[1] & 0x7f);
+  unsigned int hours   = fromBcd(r[2] & 0x3f);
+  unsigned int day     = fromBcd(r[4] & 0x3f);
+  /* bit 7 is the DS3231 century flag */
+  unsigned int month   = fromBcd(r[5] & 0x1f);
+  unsigned int year    = fromBcd(r[6]) + 2000;
+
+  if (seconds > 59 or minutes > 59 or hours > 23 or
+      day < 1 or day > 31 or month < 1 or month > 12) {
+    return false;
+  }
+
+  epoch = daysFromCivil(year, month, day) * 86400UL + hours * 3600UL + minutes * 60UL + seconds;
+  return true;
+}
+
+bool
+Ds1307::write(unsigned long epoch)
+{
+  if (not m_present) {
+    return false;
+  }
+
+  unsigned long days = epoch / 86400UL;
+  unsigned long t = epoch % 86400UL;
+  unsigned int year, month, day;
+  civilFromDays(days, year, month, day);
+
+  Wire.beginTransmission(getDeviceAddress());
+  Wire.write(RegSeconds);
+  /* clears the clock halt bit and selects 24 hour mode */
+  Wire.write(toBcd(t % 60));
+  Wire.write(toBcd(t / 60 % 60));
+  Wire.write(toBcd(t / 3600));
+  /* day of week 1 .. 7, 1.1.1970 was a Thursday */
+  Wire.write((days + 4) % 7 + 1);
+  Wire.write(toBcd(day));
+  Wire.write(toBcd(month));
+  Wire.write(toBcd(year % 100));
+  if (Wire.endTransmission() != 0) {
+    m_errors++;
+    return false;
+  }
+  return true;
+}
+
+/* See http://howardhinnant.github.io/date_algorithms.html */
+
+unsigned long
+Ds1307::daysFromCivil(unsigned int year, unsigned int month, unsigned int day)
+{
+  year -= month <= 2;
+  unsigned long era = year / 400;
+  unsigned long yoe = year - era * 400;
+  unsigned long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  unsigned long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+void
+Ds1307::civilFromDays(unsigned long days, unsigned int& year, unsigned int& month, unsigned int& day)
+{
+  days += 719468;
+  unsigned long era = days / 146097;
+  unsigned long doe = days - era * 146097;
+  unsigned long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  unsigned long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  unsigned long mp = (5 * doy + 2) / 153;
+  day = doy - (153 * mp + 2) / 5 + 1;
+  month = mp < 10 ? mp + 3 : mp - 9;
+  year = yoe + era * 400 + (month <= 2);
+}
@@ -0,0 +1,59 @@
+#ifndef EW_IG_RTC_H
+#define EW_IG_RTC_H
+
+#include "config.h"
+#include "i2c.h"
+
+/** Driver for a DS1307 or the register compatible DS3231 real time clock.
+ *
+ * Only the time keeping registers 0 .. 6 are used, which are the same on
+ * both chips. The clock runs in 24 hour mode and holds the same local
+ * time as the system time. Years 2000 .. 2099 are supported.
+ */
+class Ds1307
+  : public I2cDevice
+{
+public:
+  Ds1307(uint8_t address)
+    : I2cDevice(address)
+    , m_present(false)
+    , m_errors(0)
+  { }
+
+  /** Checks if the clock answers on the bus */
+  bool begin();
+  bool isPresent() const
+  {
+    return m_present;
+  }
+  /** Reads the time, returns false if the clock is absent, halted or
+   *  holds an invalid date (e.g. after the backup battery died).
+   */
+  bool read(unsigned long& epoch);
+  /** Sets the time and starts the oscillator */
+  bool write(unsigned long epoch);
+
+  uint32_t getErrors() const
+  {
+    return m_errors;
+  }
+
+  /** Days since 1.1.1970 of a date */
+  static unsigned long daysFromCivil(unsigned int year, unsigned int month, unsigned int day);
+  static void civilFromDays(unsigned long days, unsigned int& year, unsigned int& month, unsigned int& day);
+
+private:
+  static uint8_t fromBcd(uint8_t bcd)
+  {
+    return (bcd >> 4) * 10 + (bcd & 0x0f);
+  }
+  static uint8_t toBcd(uint8_t bin)
+  {
+    return ((bin / 10) << 4) | (bin % 10);
+  }
+
+  bool m_present;
+  uint32_t m_errors;
+};
+
+#endif /* EW_IG_RTC_H */
@@ -0,0 +1,719 @@
+#include "rules.h"
+#include "settings.h"
+
+rules::Engine ruleEngine(flashSettings.rules);
+
+namespace rules {
+
+namespace {
+
+/** Recursive descent compiler
+ *
+ *   rule       := "if" expr "then" "trigger" <id> ["pump" <seconds>]
+ *   expr       := term {"or" term}
+ *   term       := factor {"and" factor}
+ *   factor     := "not" factor | "(" expr ")" | condition
+ */
+class Compiler
+{
+public:
+  Compiler(const char* source, Rule& rule)
+    : m_pos(source)
+    , m_rule(rule)
+    , m_error(NULL)
+    , m_depth(0)
+    , m_circuit(-1)
+  {
+    m_rule.m_codeSize = 0;
+    next();
+  }
+
+  const char* compile()
+  {
+    expect("if");
+    expr();
+    expect("then");
+    expect("trigger");
+    int circuit = circuitId();
+    long pump = 0;
+    if (accept("pump")) {
+      pump = number(1, 255);
+    }
+    if (not m_error and *m_token) {
+      fail("unexpected trailing input");
+    }
+    emit(OpTrigger, -1);
+    emit(circuit);
+    emit(pump);
+    emit(OpEnd, 0);
+    return m_error;
+  }
+
+private:
+  static bool isOperator(char c)
+  {
+    return c == '<' or c == '>' or c == '=' or c == '!';
+  }
+  static bool isDelimiter(char c)
+  {
+    return c == '\0' or c == ' ' or c == '\t' or c == '(' or c == ')' or isOperator(c);
+  }
+
+  /** Reads the next token into m_token, empty at the end of the source */
+  void next()
+  {
+    while (*m_pos == ' ' or *m_pos == '\t') {
+      m_pos++;
+    }
+    unsigned int n = 0;
+    if (*m_pos == '(' or *m_pos == ')') {
+      m_token[n++] = *m_pos++;
+    } else if (isOperator(*m_pos)) {
+      while (isOperator(*m_pos) and n < sizeof(m_token) - 1) {
+        m_token[n++] = *m_pos++;
+      }
+    } else {
+      while (not isDelimiter(*m_pos) and n < sizeof(m_token) - 1) {
+        m_token[n++] = *m_pos++;
+      }
+    }
+    m_token[n] = '\0';
+  }
+  bool accept(const char* word)
+  {
+    if (m_error or strcmp(m_token, word) != 0) {
+      return false;
+    }
+    next();
+    return true;
+  }
+  void expect(const char* word)
+  {
+    if (not accept(word)) {
+      fail("syntax error");
+    }
+  }
+  void fail(const char* error)
+  {
+    if (not m_error) {
+      m_error = error;
+    }
+  }
+
+  long number(long min, long max)
+  {
+    char* end;
+    long v = strtol(m_token, &end, 10);
+    if (not *m_token or *end) {
+      fail("number expected");
+      return 0;
+    }
+    if (v < min or v > max) {
+      fail("number out of range");
+      return 0;
+    }
+    next();
+    return v;
+  }
+  /** Parses a circuit ID 1 .. NumWaterCircuits, returns the circuit index */
+  int circuitId()
+  {
+    return number(1, NumWaterCircuits) - 1;
+  }
+  /** Parses a duration like 90m, 4h or 2d and returns it in minutes */
+  long minutes()
+  {
+    char* end;
+    long v = strtol(m_token, &end, 10);
+    long scale = (strcmp(end, "m") == 0 ? 1 :
+                 (strcmp(end, "h") == 0 ? 60 :
+                 (strcmp(end, "d") == 0 ? 24 * 60 : 0)));
+    if (end == m_token or not scale or v <= 0 or v * scale > INT16_MAX) {
+      fail("invalid duration");
+      return 0;
+    }
+    next();
+    return v * scale;
+  }
+
+  /** Emits an opcode, the stack effect is tracked to reject rules which would overflow the VM stack */
+  void emit(Op op, int stackEffect)
+  {
+    m_depth += stackEffect;
+    if (m_depth > static_cast<int>(MaxStack)) {
+      fail("rule too complex");
+    }
+    emit(static_cast<uint8_t>(op));
+  }
+  void emit(uint8_t byte)
+  {
+    if (m_rule.m_codeSize >= MaxCodeSize) {
+      fail("rule too long");
+      return;
+    }
+    m_rule.m_code[m_rule.m_codeSize++] = byte;
+  }
+  void push(long value)
+  {
+    if (value >= 0 and value <= 255) {
+      emit(OpPush8, 1);
+      emit(value);
+    } else {
+      emit(OpPush16, 1);
+      emit(value & 0xff);
+      emit((value >> 8) & 0xff);
+    }
+  }
+
+  void expr()
+  {
+    term();
+    while (accept("or")) {
+      term();
+      emit(OpOr, -1);
+    }
+  }
+  void term()
+  {
+    factor();
+    while (accept("and")) {
+      factor();
+      emit(OpAnd, -1);
+    }
+  }
+  void factor()
+  {
+    if (accept("not")) {
+      factor();
+      emit(OpNot, 0);
+    } else if (accept("(")) {
+      expr();
+      expect(")");
+    } else {
+      condition();
+    }
+  }
+  void condition()
+  {
+    if (accept("circuit")) {
+      m_circuit = circuitId();
+      if (accept("humidity")) {
+        emit(OpHumidity, 1);
+        emit(m_circuit);
+        comparison(0, 255);
+      } else if (accept("temp")) {
+        emit(OpTemperature, 1);
+        emit(m_circuit);
+        comparison(-55, 125);
+      } else if (accept("watered")) {
+        watered();
+      } else {
+        fail("humidity, temp or watered expected");
+      }
+    } else if (accept("watered")) {
+      if (m_circuit < 0) {
+        fail("watered needs a circuit");
+      }
+      watered();
+    } else if (accept("reservoir")) {
+      emit(OpReservoir, 1);
+      comparison(0, 255);
+    } else if (accept("hour")) {
+      emit(OpHour, 1);
+      comparisonOrRange(0, 23);
+    } else if (accept("weekday")) {
+      emit(OpWeekday, 1);
+      comparisonOrRange(0, 6);
+    } else {
+      fail("unknown operand");
+    }
+  }
+  void comparison(long min, long max)
+  {
+    static const struct {const char* m_token; Op m_op;} ops[] =
+    {
+      {"<", OpLt}, {"<=", OpLe}, {">", OpGt}, {">=", OpGe}, {"==", OpEq}, {"!=", OpNe},
+    };
+    for (auto& o : ops) {
+      if (accept(o.m_token)) {
+        push(number(min, max));
+        emit(o.m_op, -1);
+        return;
+      }
+    }
+    fail("comparison expected");
+  }
+  /** Comparison or "in <low>..<high>" */
+  void comparisonOrRange(long min, long max)
+  {
+    if (not accept("in")) {
+      comparison(min, max);
+      return;
+    }
+    char* end;
+    long low = strtol(m_token, &end, 10);
+    if (end == m_token or strncmp(end, "..", 2) != 0) {
+      fail("range expected");
+      return;
+    }
+    const char* high = end + 2;
+    long hi = strtol(high, &end, 10);
+    if (end == high or *end or low < min or hi > max or low > hi) {
+      fail("invalid range");
+      return;
+    }
+    next();
+    push(low);
+    push(hi);
+    emit(OpIn, -2);
+  }
+  /** "watered in <duration>" compiles to "minutes since watered < duration" */
+  void watered()
+  {
+    expect("in");
+    long m = minutes();
+    emit(OpSinceWatered, 1);
+    emit(m_circuit < 0 ? 0 : m_circuit);
+    push(m);
+    emit(OpLt, -1);
+  }
+
+  const char* m_pos;
+  char m_token[16];
+  Rule& m_rule;
+  const char* m_error;
+  int m_depth;
+  /** Circuit named last, used by "watered" without circuit */
+  int m_circuit;
+};
+
+} /* namespace */
+
+const char*
+compile(const char* source, Rule& rule)
+{
+  if (strlen(source) >= MaxSourceSize) {
+    return "rule too long";
+  }
+  const char* error = Compiler(source, rule).compile();
+  if (error) {
+    rule.m_codeSize = 0;
+    return error;
+  }
+  strcpy(rule.m_source, source);
+  return NULL;
+}
+
+Result
+evaluate(const uint8_t* code, unsigned int size, const Inputs& inputs, Action& action)
+{
+  int16_t stack[MaxStack];
+  unsigned int sp = 0;
+  bool unknown = false;
+
+  /* Unknown inputs are pushed as zero and taint the result */
+  auto push = [&](int16_t v) -> bool
+  {
+    if (sp >= MaxStack) {
+      return false;
+    }
+    if (v == Unknown) {
+      unknown = true;
+      v = 0;
+    }
+    stack[sp++] = v;
+    return true;
+  };
+  auto circuit = [&](unsigned int pc) -> int
+  {
+    return pc < size and code[pc] < NumWaterCircuits ? code[pc] : -1;
+  };
+
+  unsigned int pc = 0;
+  while (pc < size) {
+    Op op = static_cast<Op>(code[pc++]);
+    switch (op) {
+      case OpEnd:
+        return ResultInvalid;
+      case OpPush8:
+        if (pc >= size or not push(code[pc])) {
+          return ResultInvalid;
+        }
+        pc++;
+        break;
+      case OpPush16:
+        if (pc + 1 >= size or not push(static_cast<int16_t>(code[pc] | (code[pc + 1] << 8)))) {
+          return ResultInvalid;
+        }
+        pc += 2;
+        break;
+      case OpHumidity:
+      case OpTemperature:
+      case OpSinceWatered:
+      {
+        int c = circuit(pc++);
+        if (c < 0) {
+          return ResultInvalid;
+        }
+        int16_t v = (op == OpHumidity    ? inputs.m_humidity[c] :
+                    (op == OpTemperature ? inputs.m_temperature[c] :
+                                           inputs.m_sinceWatered[c]));
+        if (not push(v)) {
+          return ResultInvalid;
+        }
+        break;
+      }
+      case OpReservoir:
+      case OpHour:
+      case OpWeekday:
+        if (not push(op == OpReservoir ? inputs.m_reservoir :
+                    (op == OpHour      ? inputs.m_hour :
+                                         inputs.m_weekday))) {
+          return ResultInvalid;
+        }
+        break;
+      case OpLt:
+      case OpLe:
+      case OpGt:
+      case OpGe:
+      case OpEq:
+      case OpNe:
+      case OpAnd:
+      case OpOr:
+      {
+        if (sp < 2) {
+          return ResultInvalid;
+        }
+        int16_t b = stack[--sp];
+        int16_t a = stack[sp - 1];
+        bool r;
+        switch (op) {
+          case OpLt:  r = a <  b; break;
+          case OpLe:  r = a <= b; break;
+          case OpGt:  r = a >  b; break;
+          case OpGe:  r = a >= b; break;
+          case OpEq:  r = a == b; break;
+          case OpNe:  r = a != b; break;
+          case OpAnd: r = a and b; break;
+          default:    r = a or b; break;
+        }
+        stack[sp - 1] = r;
+        break;
+      }
+      case OpIn:
+      {
+        if (sp < 3) {
+          return ResultInvalid;
+        }
+        int16_t high = stack[--sp];
+        int16_t low = stack[--sp];
+        stack[sp - 1] = stack[sp - 1] >= low and stack[sp - 1] <= high;
+        break;
+      }
+      case OpNot:
+        if (sp < 1) {
+          return ResultInvalid;
+        }
+        stack[sp - 1] = not stack[sp - 1];
+        break;
+      case OpTrigger:
+      {
+        int c = circuit(pc);
+        if (sp != 1 or c < 0 or pc + 1 >= size) {
+          return ResultInvalid;
+        }
+        action.m_circuit = c;
+        action.m_pumpSeconds = code[pc + 1];
+        if (unknown) {
+          return ResultUnknown;
+        }
+        return stack[0] ? ResultTrue : ResultFalse;
+      }
+      default:
+        return ResultInvalid;
+    }
+  }
+  return ResultInvalid;
+}
+
+/** Number of immediate bytes following an opcode */
+static unsigned int
+getNumImmediates(uint8_t op)
+{
+  switch (op) {
+    case OpPush8:
+    case OpHumidity:
+    case OpTemperature:
+    case OpSinceWatered:
+      return 1;
+    case OpPush16:
+    case OpTrigger:
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+uint8_t
+getHumidityMask(const uint8_t* code, unsigned int size)
+{
+  uint8_t mask = 0;
+  for (unsigned int pc = 0; pc < size; pc += 1 + getNumImmediates(code[pc])) {
+    if (code[pc] == OpHumidity and pc + 1 < size and code[pc + 1] < NumWaterCircuits) {
+      mask |= 1 << code[pc + 1];
+    }
+  }
+  return mask;
+}
+
+static bool
+readsReservoir(const uint8_t* code, unsigned int size)
+{
+  for (unsigned int pc = 0; pc < size; pc += 1 + getNumImmediates(code[pc])) {
+    if (code[pc] == OpReservoir) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Engine::Engine(Settings& settings)
+  : m_settings(settings)
+  , m_state(StateIdle)
+  , m_lastRun()
+  , m_sensorMask(0)
+  , m_needReservoir(false)
+  , m_circuit(-1)
+  , m_reservoir(Unknown)
+  , m_lastResult{}
+  , m_stats{}
+{
+  for (auto& h : m_humidity) {
+    h = Unknown;
+  }
+}
+
+void
+Engine::update()
+{
+  if (m_settings.m_numRules > MaxRules) {
+    m_settings.m_numRules = 0;
+  }
+  m_sensorMask = 0;
+  m_needReservoir = false;
+  for (unsigned int i = 0; i < m_settings.m_numRules; i++) {
+    const Rule& r = m_settings.m_rules[i];
+    m_sensorMask |= getHumidityMask(r.m_code, r.m_codeSize);
+    m_needReservoir = m_needReservoir or readsReservoir(r.m_code, r.m_codeSize);
+  }
+}
+
+int
+Engine::nextSensor(int after) const
+{
+  for (int i = after + 1; i < static_cast<int>(NumWaterCircuits); i++) {
+    if (m_sensorMask & (1 << i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void
+Engine::run()
+{
+  switch (m_state) {
+    case StateIdle:
+      if (not m_settings.m_intervalMinutes or not m_settings.m_numRules) {
+        break;
+      }
+      if (m_lastRun.elapsed() < Duration::fromMinutes(m_settings.m_intervalMinutes)) {
+        break;
+      }
+      update();
+      m_circuit = nextSensor(-1);
+      m_state = StateWaitSensor;
+      /* FALLTHROUGH */
+
+    case StateWaitSensor:
+    {
+      if (m_circuit < 0) {
+        m_state = StateWaitReservoir;
+        break;
+      }
+      WaterCircuit* c = circuits[m_circuit];
+      if (c->getState() != WaterCircuit::StateIdle) {
+        /* the circuit senses on its own while watering */
+        m_humidity[m_circuit] = c->getHumidity();
+        m_circuit = nextSensor(m_circuit);
+        break;
+      }
+      if (c->getSensor().getState() == Sensor::StateIdle) {
+        c->getSensor().enable(Sensor::PriorityLow);
+        m_state = StateSense;
+      }
+      break;
+    }
+    case StateSense:
+    {
+      Sensor& s = circuits[m_circuit]->getSensor();
+      s.run();
+      if (s.getState() == Sensor::StateReady) {
+        m_humidity[m_circuit] = s.isValid() ? s.read() : Unknown;
+        s.disable();
+        m_circuit = nextSensor(m_circuit);
+        m_state = StateWaitSensor;
+      }
+      break;
+    }
+    case StateWaitReservoir:
+    {
+      if (not m_needReservoir) {
+        finish();
+        break;
+      }
+      Sensor& s = circuits[0]->getReservoir();
+      if (s.getState() == Sensor::StateIdle) {
+        s.enable(Sensor::PriorityLow);
+        m_state = StateSenseReservoir;
+      }
+      break;
+    }
+    case StateSenseReservoir:
+    {
+      Sensor& s = circuits[0]->getReservoir();
+      s.run();
+      if (s.getState() == Sensor::StateReady) {
+        m_reservoir = s.isValid() ? s.read() : Unknown;
+        s.disable();
+        finish();
+      }
+      break;
+    }
+  }
+}
+
+void
+Engine::fillInputs(Inputs& inputs) const
+{
+  for (unsigned int i = 0; i < NumWaterCircuits; i++) {
+    inputs.m_humidity[i] = m_humidity[i];
+
+    int d = temperatureBus.findCircuit(i);
+    inputs.m_temperature[i] = d >= 0 and temperatureBus.getDevice(d).m_valid ?
+      temperatureBus.getDevice(d).m_temperature / 16 : Unknown;
+
+    unsigned long s = circuits[i]->getSecondsSinceWatered();
+    inputs.m_sinceWatered[i] = s / 60 > INT16_MAX ? INT16_MAX : s / 60;
+  }
+  inputs.m_reservoir = m_reservoir;
+  const SystemTime::Snapshot& now = systemTime.getSnapshot();
+  if (now.m_valid) {
+    inputs.m_hour = now.m_hours;
+    inputs.m_weekday = now.m_weekday;
+  } else {
+    inputs.m_hour = inputs.m_weekday = Unknown;
+  }
+}
+
+void
+Engine::finish()
+{
+  m_state = StateIdle;
+  m_lastRun = Instant::now();
+  evaluate();
+}
+
+void
+Engine::evaluate()
+{
+  update();
+
+  Inputs inputs;
+  fillInputs(inputs);
+
+  for (unsigned int i = 0; i < m_settings.m_numRules; i++) {
+    const Rule& r = m_settings.m_rules[i];
+    Action action = {0};
+
+    Instant start = Instant::now();
+    Result result = rules::evaluate(r.m_code, r.m_codeSize, inputs, action);
+    int64_t us = start.elapsed().toUs();
+
+    m_stats.m_evaluations++;
+    m_stats.m_lastEvalUs = us > UINT16_MAX ? UINT16_MAX : us;
+    m_stats.m_maxEvalUs = m_stats.m_lastEvalUs > m_stats.m_maxEvalUs ? m_stats.m_lastEvalUs : m_stats.m_maxEvalUs;
+    m_lastResult[i] = result;
+
+    if (result == ResultUnknown) {
+      m_stats.m_unknown++;
+    }
+    if (result != ResultTrue) {
+      continue;
+    }
+    WaterCircuit* c = circuits[action.m_circuit];
+    if (not c->isEnabled() or c->getState() != WaterCircuit::StateIdle) {
+      continue;
+    }
+    m_stats.m_triggers++;
+    Log << "watering circuit " << action.m_circuit + 1 << " triggered by rule " << i + 1 << " at " << systemTime.getTimeStr() << "\n";
+    c->trigger(action.m_pumpSeconds);
+  }
+}
+
+bool
+Engine::add(const Rule& rule)
+{
+  if (m_settings.m_numRules >= MaxRules) {
+    return false;
+  }
+  m_settings.m_rules[m_settings.m_numRules] = rule;
+  m_lastResult[m_settings.m_numRules] = ResultFalse;
+  m_settings.m_numRules++;
+  return true;
+}
+
+bool
+Engine::remove(unsigned int index)
+{
+  if (index >= m_settings.m_numRules) {
+    return false;
+  }
+  for (unsigned int i = index; i + 1 < m_settings.m_numRules; i++) {
+    m_settings.m_rules[i] = m_settings.m_rules[i + 1];
+    m_lastResult[i] = m_lastResult[i + 1];
+  }
+  m_settings.m_numRules--;
+  return true;
+}
+
+Print&
+Engine::prtCode(Print& p, const Rule& rule)
+{
+  for (unsigned int i = 0; i < rule.m_codeSize; i++) {
+    prtFmt(p, "%02x", rule.m_code[i]);
+  }
+  return p;
+}
+
+Print&
+Engine::prt(Print& p) const
+{
+  static const char* results[] = {"false", "true", "unknown", "invalid"};
+
+  p << "          interval  " << m_settings.m_intervalMinutes << " min\n";
+  for (unsigned int i = 0; i < m_settings.m_numRules; i++) {
+    const Rule& r = m_settings.m_rules[i];
+    p << "[" << i + 1 << "] " << r.m_source << "\n"
+      << "    " << r.m_codeSize << " bytes  ";
+    prtCode(p, r) << "\n"
+      << "    last result  " << results[m_lastResult[i] & 3] << "\n";
+  }
+  return p
+    << "       evaluations  " << m_stats.m_evaluations << "\n"
+    << "          triggers  " << m_stats.m_triggers << "\n"
+    << "           unknown  " << m_stats.m_unknown << "\n"
+    << "         eval time  " << m_stats.m_lastEvalUs << " us (max " << m_stats.m_maxEvalUs << " us)\n";
+}
+
+} /* namespace rules */
@@ -0,0 +1,194 @@
+#ifndef EW_IG_RULES_H
+#define EW_IG_RULES_H
+
+#include "config.h"
+#include "circuit.h"
+
+/** Watering rules compiled to a compact stack bytecode.
+ *
+ * A rule reads
+ *
+ *   if <condition> then trigger <id> [pump <seconds>]
+ *
+ * where <condition> combines comparisons with "and", "or", "not" and
+ * parentheses. The operands are
+ *
+ *   circuit <id> humidity       calibrated humidity 0 .. 255
+ *   circuit <id> temp           temperature in degrees Celsius
+ *   reservoir                   reservoir fill 0 .. 255
+ *   hour, weekday               local time, weekday 0 is Sunday
+ *
+ * compared with <, <=, >, >=, == or != against a number, or tested with
+ * "hour in 6..20". "circuit <id> watered in 4h" (suffixes m, h and d) is
+ * true if the circuit's pump ran within the duration, "watered in" without
+ * circuit refers to the last circuit named in the rule. Example:
+ *
+ *   if circuit 3 humidity < 140 and hour in 6..20 and not watered in 4h then trigger 3
+ *
+ * The engine evaluates all rules periodically against the last sensor
+ * readings, which it refreshes in the background beforehand.
+ */
+namespace rules {
+
+const unsigned int MaxRules = 4;
+const unsigned int MaxCodeSize = 48;
+const unsigned int MaxSourceSize = 96;
+const unsigned int MaxStack = 8;
+
+/** Input value which is not known, e.g. a sensor without reading */
+const int16_t Unknown = INT16_MIN;
+
+typedef enum
+{
+  OpEnd = 0,
+  /** Push an 8 bit immediate */
+  OpPush8,
+  /** Push a 16 bit immediate, little endian */
+  OpPush16,
+  /** Push the humidity of the circuit given by the 8 bit immediate */
+  OpHumidity,
+  /** Push the temperature of the circuit given by the 8 bit immediate */
+  OpTemperature,
+  /** Push the minutes since the circuit given by the 8 bit immediate was watered */
+  OpSinceWatered,
+  OpReservoir,
+  OpHour,
+  OpWeekday,
+  OpLt,
+  OpLe,
+  OpGt,
+  OpGe,
+  OpEq,
+  OpNe,
+  /** value low high -- low <= value <= high */
+  OpIn,
+  OpAnd,
+  OpOr,
+  OpNot,
+  /** Pops the condition and triggers the circuit given by the first
+   *  immediate with the pump time given by the second one if true.
+   */
+  OpTrigger,
+} Op;
+
+struct Rule
+{
+  uint8_t m_codeSize;
+  uint8_t m_code[MaxCodeSize];
+  char m_source[MaxSourceSize];
+};
+
+struct Settings
+{
+  /** Evaluation interval, 0 disables the rules */
+  uint8_t m_intervalMinutes;
+  uint8_t m_numRules;
+  Rule m_rules[MaxRules];
+};
+
+/** Values the rules are evaluated against */
+struct Inputs
+{
+  /** Any value can be Unknown */
+  int16_t m_humidity[NumWaterCircuits];
+  int16_t m_temperature[NumWaterCircuits];
+  int16_t m_sinceWatered[NumWaterCircuits];
+  int16_t m_reservoir;
+  int16_t m_hour;
+  int16_t m_weekday;
+};
+
+struct Action
+{
+  uint8_t m_circuit;
+  uint8_t m_pumpSeconds;
+};
+
+/** Compiles the source of a rule. Returns NULL on success or an error message. */
+const char* compile(const char* source, Rule& rule);
+
+typedef enum
+{
+  ResultFalse = 0,
+  ResultTrue,
+  /** An operand was unknown, the rule didn't fire */
+  ResultUnknown,
+  ResultInvalid,
+} Result;
+
+/** Evaluates a compiled rule */
+Result evaluate(const uint8_t* code, unsigned int size, const Inputs& inputs, Action& action);
+
+/** Returns the circuits whose humidity the code reads */
+uint8_t getHumidityMask(const uint8_t* code, unsigned int size);
+
+class Engine
+{
+public:
+  typedef enum
+  {
+    StateIdle = 0,
+    StateWaitSensor,
+    StateSense,
+    StateWaitReservoir,
+    StateSenseReservoir,
+  } State;
+
+  struct Stats
+  {
+    uint32_t m_evaluations;
+    uint32_t m_triggers;
+    uint32_t m_unknown;
+    uint16_t m_lastEvalUs;
+    uint16_t m_maxEvalUs;
+  };
+
+  Engine(Settings& settings);
+  void run();
+  /** Evaluates the rules now with the last sensor readings. A sensor
+   *  refresh in progress is not affected and evaluates again when done.
+   */
+  void evaluate();
+
+  bool add(const Rule& rule);
+  bool remove(unsigned int index);
+  void setIntervalMinutes(uint8_t minutes)
+  {
+    m_settings.m_intervalMinutes = minutes;
+  }
+  const Settings& getSettings() const
+  {
+    return m_settings;
+  }
+  Result getLastResult(unsigned int index) const
+  {
+    return static_cast<Result>(m_lastResult[index]);
+  }
+  Print& prt(Print& p) const;
+  static Print& prtCode(Print& p, const Rule& rule);
+
+private:
+  /** Ends a sensor refresh and evaluates */
+  void finish();
+  void update();
+  void fillInputs(Inputs& inputs) const;
+  /** Next circuit after the current one whose humidity the rules need */
+  int nextSensor(int after) const;
+
+  Settings& m_settings;
+  State m_state;
+  Instant m_lastRun;
+  uint8_t m_sensorMask;
+  bool m_needReservoir;
+  int m_circuit;
+  int16_t m_humidity[NumWaterCircuits];
+  int16_t m_reservoir;
+  uint8_t m_lastResult[MaxRules];
+  Stats m_stats;
+};
+
+} /* namespace rules */
+
+extern rules::Engine ruleEngine;
+
+#endif /* EW_IG_RULES_H */
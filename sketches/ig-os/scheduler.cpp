@@ -0,0 +1,291 @@
+#include "scheduler.h"
+#include "settings.h"
+#include "kvstore.h"
+
+Scheduler scheduler(flashSettings.schedule, flashSettings.schedulerSettings);
+
+Scheduler::Scheduler(Table& table, Settings& settings)
+  : m_table(table)
+  , m_settings(settings)
+  , m_valid(false)
+  , m_lastNow(0)
+  , m_stamps{}
+  , m_stampsLoaded(false)
+  , m_stats{}
+{ }
+
+void
+Scheduler::loadStamps()
+{
+  ESP.rtcUserMemoryRead(RtcOffset, reinterpret_cast<uint32_t*>(&m_stamps), sizeof(m_stamps));
+  if (m_stamps.m_magic != RtcMagic or
+      m_stamps.m_crc != crc32(m_stamps.m_epochs, sizeof(m_stamps.m_epochs))) {
+    /* power loss: fall back to the copy on the EEPROM */
+    m_stamps = Stamps{};
+    for (unsigned int i = 0; i < MaxEntries; i++) {
+      kvStore.get(KvStore::KeyScheduleStamps + i, &m_stamps.m_epochs[i], sizeof(m_stamps.m_epochs[i]));
+    }
+    Debug << "scheduler: no fire stamps in RTC memory, " << (kvStore.isReady() ? "loaded" : "none") << " from EEPROM\n";
+  }
+  m_stampsLoaded = true;
+}
+
+void
+Scheduler::saveStamps()
+{
+  m_stamps.m_magic = RtcMagic;
+  m_stamps.m_crc = crc32(m_stamps.m_epochs, sizeof(m_stamps.m_epochs));
+  ESP.rtcUserMemoryWrite(RtcOffset, reinterpret_cast<uint32_t*>(&m_stamps), sizeof(m_stamps));
+
+  /* only changed stamps cost a record */
+  for (unsigned int i = 0; i < MaxEntries; i++) {
+    uint8_t key = KvStore::KeyScheduleStamps + i;
+    if (m_stamps.m_epochs[i] or kvStore.exists(key)) {
+      kvStore.set(key, &m_stamps.m_epochs[i], sizeof(m_stamps.m_epochs[i]));
+    }
+  }
+}
+
+void
+Scheduler::stamp(unsigned int index)
+{
+  m_stamps.m_epochs[index] = systemTime.isValid() ? systemTime.getEpoch() : 0;
+}
+
+bool
+Scheduler::isScheduled(const Entry& entry, unsigned long day)
+{
+  if (not (entry.m_weekdays & (1 << getWeekday(day)))) {
+    return false;
+  }
+  return entry.m_interval <= 1 or day % entry.m_interval == entry.m_phase;
+}
+
+unsigned long
+Scheduler::nextEpoch(const Entry& entry, unsigned long after)
+{
+  if (not (entry.m_weekdays & AllDays) or entry.m_hour > 23 or entry.m_minute > 59 or
+      (entry.m_interval > 1 and entry.m_phase >= entry.m_interval)) {
+    return 0;
+  }
+  unsigned long timeOfDay = entry.m_hour * 3600UL + entry.m_minute * 60UL;
+  unsigned long day = getDay(after);
+  if (day * SecondsPerDay + timeOfDay <= after) {
+    day++;
+  }
+  /* weekday mask and interval repeat after at most 7 * interval days */
+  unsigned long period = 7UL * (entry.m_interval > 1 ? entry.m_interval : 1);
+  for (unsigned long d = day; d < day + period; d++) {
+    if (isScheduled(entry, d)) {
+      return d * SecondsPerDay + timeOfDay;
+    }
+  }
+  return 0;
+}
+
+void
+Scheduler::rebuild(unsigned long now)
+{
+  m_heap.clear();
+  if (m_table.m_numEntries > MaxEntries) {
+    m_table.m_numEntries = 0;
+  }
+  if (not m_stampsLoaded) {
+    loadStamps();
+  }
+  for (unsigned int i = 0; i < m_table.m_numEntries; i++) {
+    /* Resume after the last fire. Without a stamp only an entry scheduled
+     * for the current minute is still due. A stamp in the future is left
+     * from before the clock was set back, the entry already fired and is
+     * done until the clock passes the stamp again. A stamp too far ahead
+     * stems from a bogus time and would hold the entry back for good.
+     */
+    unsigned long after = m_stamps.m_epochs[i];
+    if (not after or after > now + MaxStampAheadSeconds) {
+      after = now - 60;
+    }
+    unsigned long epoch = nextEpoch(m_table.m_entries[i], after);
+    if (epoch) {
+      m_heap.push(Event{epoch, (uint8_t)i});
+    }
+  }
+  m_valid = true;
+  m_stats.m_rebuilds++;
+}
+
+bool
+Scheduler::isDue(Fire& fire)
+{
+  if (not systemTime.isValid()) {
+    return false;
+  }
+  unsigned long now = systemTime.getEpoch();
+
+  /* The heap is only valid for time moving forward, after the clock was
+   * set back the entries in between would never fire.
+   */
+  if (not m_valid or now + 60 < m_lastNow) {
+    rebuild(now);
+  }
+  m_lastNow = now;
+
+  if (m_heap.isEmpty() or now < m_heap.top().m_epoch) {
+    return false;
+  }
+
+  fire = Fire{};
+  unsigned long grace = m_settings.m_graceMinutes * 60UL;
+
+  while (not m_heap.isEmpty() and m_heap.top().m_epoch <= now) {
+    Event e = m_heap.pop();
+    const Entry& entry = m_table.m_entries[e.m_index];
+    unsigned long late = now - e.m_epoch;
+
+    bool fires = late < 60;
+    if (not fires) {
+      switch (getCatchUp()) {
+        case CatchUpSkip:
+          break;
+        case CatchUpOnce:
+          fires = true;
+          break;
+        case CatchUpWithin:
+        default:
+          fires = late <= 60 + grace;
+          break;
+      }
+    }
+
+    if (fires) {
+      m_stats.m_fired++;
+      if (late >= 60) {
+        m_stats.m_caughtUp++;
+        Error << "schedule entry [" << e.m_index + 1 << "] caught up " << late / 60 << " minutes late at " << systemTime.getTimeStr() << "\n";
+      }
+      m_stats.m_maxLateSeconds = late > m_stats.m_maxLateSeconds ? late : m_stats.m_maxLateSeconds;
+
+      fire.m_circuits |= entry.m_circuits;
+      for (unsigned int i = 0; i < NumWaterCircuits; i++) {
+        if ((entry.m_circuits & (1 << i)) and entry.m_pumpSeconds) {
+          fire.m_pumpSeconds[i] = entry.m_pumpSeconds;
+        }
+      }
+    } else {
+      m_stats.m_missed++;
+      Error << "schedule entry [" << e.m_index + 1 << "] missed by " << late / 60 << " minutes at " << systemTime.getTimeStr() << "\n";
+    }
+    m_stamps.m_epochs[e.m_index] = now;
+    unsigned long next = nextEpoch(entry, now);
+    if (next) {
+      m_heap.push(Event{next, e.m_index});
+    }
+  }
+  saveStamps();
+  return fire.m_circuits != 0;
+}
+
+bool
+Scheduler::add(const Entry& entry)
+{
+  if (m_table.m_numEntries >= MaxEntries) {
+    return false;
+  }
+  stamp(m_table.m_numEntries);
+  m_table.m_entries[m_table.m_numEntries++] = entry;
+  saveStamps();
+  invalidate();
+  return true;
+}
+
+bool
+Scheduler::set(unsigned int index, const Entry& entry)
+{
+  if (index >= m_table.m_numEntries) {
+    return false;
+  }
+  m_table.m_entries[index] = entry;
+  stamp(index);
+  saveStamps();
+  invalidate();
+  return true;
+}
+
+bool
+Scheduler::remove(unsigned int index)
+{
+  if (index >= m_table.m_numEntries) {
+    return false;
+  }
+  for (unsigned int i = index + 1; i < m_table.m_numEntries; i++) {
+    m_table.m_entries[i - 1] = m_table.m_entries[i];
+    m_stamps.m_epochs[i - 1] = m_stamps.m_epochs[i];
+  }
+  m_table.m_numEntries--;
+  m_stamps.m_epochs[m_table.m_numEntries] = 0;
+  saveStamps();
+  invalidate();
+  return true;
+}
+
+unsigned long
+Scheduler::getNextEpoch(unsigned int index) const
+{
+  for (unsigned int i = 0; i < m_heap.size(); i++) {
+    if (m_heap[i].m_index == index) {
+      return m_heap[i].m_epoch;
+    }
+  }
+  return 0;
+}
+
+Print&
+Scheduler::prtEntry(Print& p, const Entry& entry)
+{
+  static const char* days[] = {"su", "mo", "tu", "we", "th", "fr", "sa"};
+
+  prtFmt(p, "%02u:%02u", entry.m_hour, entry.m_minute);
+
+  p << "  days ";
+  if ((entry.m_weekdays & AllDays) == AllDays) {
+    p << "all";
+  } else if (entry.m_weekdays == Weekdays) {
+    p << "weekdays";
+  } else if (entry.m_weekdays == Weekend) {
+    p << "weekend";
+  } else {
+    const char* sep = "";
+    for (unsigned int i = 0; i < 7; i++) {
+      if (entry.m_weekdays & (1 << i)) {
+        p << sep << days[i];
+        sep = ",";
+      }
+    }
+  }
+  if (entry.m_interval > 1) {
+    p << "  every " << entry.m_interval << " days";
+  }
+
+  p << "  circuits ";
+  const char* sep = "";
+  for (unsigned int i = 0; i < NumWaterCircuits; i++) {
+    if (entry.m_circuits & (1 << i)) {
+      p << sep << i + 1;
+      sep = ",";
+    }
+  }
+  if (entry.m_pumpSeconds) {
+    p << "  pump " << entry.m_pumpSeconds << " s";
+  }
+  return p;
+}
+
+Print&
+Scheduler::prt(Print& p) const
+{
+  return p
+    << "          catch up  " << getCatchUpString(getCatchUp()) << "\n"
+    << "      grace window  " << m_settings.m_graceMinutes << " min\n"
+    << "             fired  " << m_stats.m_fired << "\n"
+    << "         caught up  " << m_stats.m_caughtUp << " (max " << m_stats.m_maxLateSeconds << " s late)\n"
+    << "            missed  " << m_stats.m_missed << "\n";
+}
@@ -0,0 +1,312 @@
+#ifndef EW_IG_SCHEDULER_H
+#define EW_IG_SCHEDULER_H
+
+#include "config.h"
+#include "system.h"
+
+/** Binary min-heap with fixed capacity. T must provide operator<. */
+template<typename T, unsigned int _Capacity>
+class MinHeap
+{
+public:
+  static const unsigned int Capacity = _Capacity;
+
+  MinHeap()
+    : m_size(0)
+  { }
+  bool push(const T& item)
+  {
+    if (m_size == Capacity) {
+      return false;
+    }
+    unsigned int i = m_size++;
+    while (i > 0) {
+      unsigned int parent = (i - 1) / 2;
+      if (not (item < m_items[parent])) {
+        break;
+      }
+      m_items[i] = m_items[parent];
+      i = parent;
+    }
+    m_items[i] = item;
+    return true;
+  }
+  /** Removes the smallest item, the heap must not be empty */
+  T pop()
+  {
+    T top = m_items[0];
+    T last = m_items[--m_size];
+    unsigned int i = 0;
+    while (true) {
+      unsigned int child = 2 * i + 1;
+      if (child >= m_size) {
+        break;
+      }
+      if (child + 1 < m_size and m_items[child + 1] < m_items[child]) {
+        child++;
+      }
+      if (not (m_items[child] < last)) {
+        break;
+      }
+      m_items[i] = m_items[child];
+      i = child;
+    }
+    if (m_size) {
+      m_items[i] = last;
+    }
+    return top;
+  }
+  const T& top() const
+  {
+    return m_items[0];
+  }
+  const T& operator[](unsigned int index) const
+  {
+    return m_items[index];
+  }
+  unsigned int size() const
+  {
+    return m_size;
+  }
+  bool isEmpty() const
+  {
+    return m_size == 0;
+  }
+  void clear()
+  {
+    m_size = 0;
+  }
+private:
+  T m_items[Capacity];
+  unsigned int m_size;
+};
+
+/** Fires the schedule entries.
+ *
+ * An entry fires at its time of day on the days selected by its weekday
+ * mask and its every-N-days interval, and triggers the circuits in its
+ * circuit mask, optionally with its own pump time.
+ *
+ * The next fire time of every entry is computed as absolute epoch and
+ * kept in a min-heap, each loop pass only compares the current time
+ * against the earliest one, a fire event costs O(log n).
+ *
+ * The epoch an entry last fired at is kept in the RTC user memory, which
+ * survives resets but not power loss, and in the key value store on the
+ * EEPROM, which is used after power loss. When the fire times are rebuilt at
+ * boot or after the clock was set back, every entry resumes at its first
+ * occurrence after its last fire, so triggers missed while rebooting or
+ * without valid time come due late, and an entry doesn't fire twice when
+ * the clock is set back across its fire time. What happens to a late entry is
+ * decided by the catch-up policy. Missed and caught up entries are
+ * reported to the error log.
+ */
+class Scheduler
+{
+public:
+  static const unsigned long SecondsPerDay = 24UL * 60 * 60;
+  static const unsigned int MaxEntries = MaxScheduleEntries;
+
+  static_assert(NumWaterCircuits <= 8, "circuit mask limited to 8 circuits");
+
+  typedef enum
+  {
+    Sunday    = 1 << 0,
+    Monday    = 1 << 1,
+    Tuesday   = 1 << 2,
+    Wednesday = 1 << 3,
+    Thursday  = 1 << 4,
+    Friday    = 1 << 5,
+    Saturday  = 1 << 6,
+    Weekdays  = Monday | Tuesday | Wednesday | Thursday | Friday,
+    Weekend   = Saturday | Sunday,
+    AllDays   = Weekdays | Weekend,
+  } Weekday;
+
+  static const uint8_t AllCircuits = (1 << NumWaterCircuits) - 1;
+
+  struct Entry
+  {
+    uint8_t m_hour;
+    uint8_t m_minute;
+    /** See Weekday */
+    uint8_t m_weekdays;
+    /** Fire every m_interval days, 0 and 1 fire every day */
+    uint8_t m_interval;
+    /** Fire on days where (days since 1.1.1970) % m_interval == m_phase */
+    uint8_t m_phase;
+    /** Bit 0 is the first circuit */
+    uint8_t m_circuits;
+    /** Pump time override, 0 uses the circuits' pump time */
+    uint8_t m_pumpSeconds;
+  };
+
+  /** Count prefixed schedule table, only the first m_numEntries are in use.
+   *  It is stored with the flash settings, which are a single fixed layout
+   *  struct written as a whole, so the unused entries are stored too. All
+   *  settings share one flash sector and the size of the table doesn't
+   *  change the cost of a commit.
+   */
+  struct Table
+  {
+    uint8_t m_numEntries;
+    Entry m_entries[MaxEntries];
+  };
+
+  typedef enum
+  {
+    /** Late entries are skipped */
+    CatchUpSkip = 0,
+    /** Late entries fire once, no matter how late */
+    CatchUpOnce,
+    /** Late entries fire if late by no more than the grace window */
+    CatchUpWithin,
+    NumCatchUpPolicies,
+  } CatchUpPolicy;
+
+  static const char* getCatchUpString(CatchUpPolicy policy)
+  {
+    switch (policy) {
+      case CatchUpSkip:   return "skip";
+      case CatchUpOnce:   return "once";
+      case CatchUpWithin: return "within";
+      default:            return "unknown";
+    }
+  }
+
+  struct Settings
+  {
+    /** How late an entry may fire with CatchUpWithin */
+    uint16_t m_graceMinutes;
+    /** See CatchUpPolicy */
+    uint8_t m_catchUp;
+  };
+
+  /** Circuits to be triggered */
+  struct Fire
+  {
+    uint8_t m_circuits;
+    /** Pump time override per circuit, 0 uses the circuit's pump time */
+    uint8_t m_pumpSeconds[NumWaterCircuits];
+  };
+
+  struct Event
+  {
+    unsigned long m_epoch;
+    uint8_t m_index;
+
+    bool operator<(const Event& other) const
+    {
+      return m_epoch < other.m_epoch;
+    }
+  };
+
+  struct Stats
+  {
+    uint32_t m_fired;
+    uint32_t m_caughtUp;
+    uint32_t m_missed;
+    uint16_t m_rebuilds;
+    uint32_t m_maxLateSeconds;
+  };
+
+  Scheduler(Table& table, Settings& settings);
+
+  /** Returns true and the circuits to be triggered if an entry is due. Call once per loop pass. */
+  bool isDue(Fire& fire);
+  /** Recomputes all fire times, call after the table was changed */
+  void invalidate()
+  {
+    m_valid = false;
+  }
+
+  unsigned int getNumEntries() const
+  {
+    return m_table.m_numEntries;
+  }
+  const Entry& getEntry(unsigned int index) const
+  {
+    return m_table.m_entries[index];
+  }
+  /** Appends an entry, returns false if the table is full */
+  bool add(const Entry& entry);
+  bool set(unsigned int index, const Entry& entry);
+  bool remove(unsigned int index);
+
+  /** Returns the next fire time of an entry or 0 if it isn't scheduled */
+  unsigned long getNextEpoch(unsigned int index) const;
+
+  uint16_t getGraceMinutes() const
+  {
+    return m_settings.m_graceMinutes;
+  }
+  void setGraceMinutes(uint16_t minutes)
+  {
+    m_settings.m_graceMinutes = minutes;
+  }
+  CatchUpPolicy getCatchUp() const
+  {
+    return static_cast<CatchUpPolicy>(m_settings.m_catchUp);
+  }
+  void setCatchUp(CatchUpPolicy policy)
+  {
+    m_settings.m_catchUp = policy;
+  }
+  const Stats& getStats() const
+  {
+    return m_stats;
+  }
+  Print& prt(Print& p) const;
+  static Print& prtEntry(Print& p, const Entry& entry);
+
+  static unsigned long getDay(unsigned long epoch)
+  {
+    return epoch / SecondsPerDay;
+  }
+  /** 0 Sunday, 1 Monday, ... */
+  static uint8_t getWeekday(unsigned long day)
+  {
+    /* 1.1.1970 was a Thursday */
+    return (day + 4) % 7;
+  }
+  /** Returns true if the entry fires on a day */
+  static bool isScheduled(const Entry& entry, unsigned long day);
+  /** Next epoch after the epoch "after" at which the entry fires or 0 if it never fires */
+  static unsigned long nextEpoch(const Entry& entry, unsigned long after);
+
+private:
+  /** Offset of the fire stamps in the RTC user memory in 4 byte blocks.
+   *  The first 128 bytes are left to the OTA boot loader.
+   */
+  static const uint32_t RtcOffset = 32;
+  static const uint32_t RtcMagic = 0x53434831;
+  /** Fire stamps further ahead of the clock than a clock correction are bogus */
+  static const unsigned long MaxStampAheadSeconds = SecondsPerDay;
+
+  /** Last fire epochs, 0 if unknown */
+  struct Stamps
+  {
+    uint32_t m_magic;
+    uint32_t m_crc;
+    uint32_t m_epochs[MaxEntries];
+  };
+
+  void rebuild(unsigned long now);
+  void loadStamps();
+  void saveStamps();
+  /** Marks an entry as handled up to now, e.g. after it was changed */
+  void stamp(unsigned int index);
+
+  Table& m_table;
+  Settings& m_settings;
+  MinHeap<Event, MaxEntries> m_heap;
+  bool m_valid;
+  unsigned long m_lastNow;
+  Stamps m_stamps;
+  bool m_stampsLoaded;
+  Stats m_stats;
+};
+
+extern Scheduler scheduler;
+
+#endif /* EW_IG_SCHEDULER_H */
@@ -0,0 +1,87 @@
+#include "settings.h"
+
+FlashCommitter flashCommitter(flashSettings);
+
+FlashCommitter::FlashCommitter(FlashSettings<FlashData>& settings)
+  : m_settings(settings)
+  , m_dirty(false)
+  , m_firstChange()
+  , m_lastChange()
+  , m_crc(0)
+  , m_stats{}
+{ }
+
+void
+FlashCommitter::begin()
+{
+  m_crc = getCrc();
+  m_dirty = false;
+}
+
+void
+FlashCommitter::run()
+{
+  if (not m_dirty) {
+    return;
+  }
+  if (m_lastChange.elapsed() >= Duration::fromMs(QuietMs) or
+      m_firstChange.elapsed() >= Duration::fromMs(MaxDeferMs)) {
+    commit();
+  }
+}
+
+void
+FlashCommitter::markDirty()
+{
+  Instant now = Instant::now();
+  if (not m_dirty) {
+    m_firstChange = now;
+  }
+  m_lastChange = now;
+  m_dirty = true;
+  m_stats.m_requests++;
+}
+
+bool
+FlashCommitter::commit()
+{
+  m_dirty = false;
+
+  uint32_t crc = getCrc();
+  if (crc == m_crc) {
+    m_stats.m_unchanged++;
+    return false;
+  }
+
+  Instant start = Instant::now();
+  m_settings.update();
+  uint32_t ms = start.elapsed().toMs();
+
+  m_crc = crc;
+  m_stats.m_commits++;
+  m_stats.m_lastMs = ms;
+  m_stats.m_maxMs = ms > m_stats.m_maxMs ? ms : m_stats.m_maxMs;
+  m_stats.m_totalMs += ms;
+  Debug << "settings committed in " << ms << " ms\n";
+  return true;
+}
+
+uint32_t
+FlashCommitter::getCrc() const
+{
+  const FlashData& data = m_settings;
+  return crc32(&data, sizeof(data));
+}
+
+Print&
+FlashCommitter::prt(Print& p) const
+{
+  p << "             state  " << (m_dirty ? "changed, not yet committed" : "committed") << "\n"
+    << "          requests  " << m_stats.m_requests << "\n"
+    << "           commits  " << m_stats.m_commits << " (" << m_stats.m_unchanged << " skipped, unchanged)\n";
+  if (m_stats.m_commits) {
+    p << "       commit time  " << m_stats.m_lastMs << " ms last, " << m_stats.m_maxMs << " ms max, "
+      << m_stats.m_totalMs / m_stats.m_commits << " ms average\n";
+  }
+  return p;
+}
@@ -4,6 +4,11 @@
 #include "config.h"
 #include "circuit.h"
 #include "system.h"
+#include "calibration.h"
+#include "spi.h"
+#include "temperature.h"
+#include "scheduler.h"
+#include "rules.h"
 
 #include <FlashSettings.h>
 
@@ -20,7 +25,7 @@ struct FlashData
   char                    wifiPass[MaxWifiPassLen + 1];
 
   WaterCircuit::Settings        waterCircuitSettings[NumWaterCircuits];
-  SchedulerTime::Time           schedulerTimes[NumSchedulerTimes];
+  Scheduler::Table              schedule;
   ThingSpeakLogger::TslSettings thingSpeakLoggerSettings[NumWaterCircuits];
 
   char hostName[MaxHostNameLen + 1];
@@ -28,6 +33,23 @@ struct FlashData
   char telnetPass[MaxTelnetPassLen + 1];
 
   bool debug;
+
+  /** Calibration tables of the circuit sensors followed by the reservoir sensor */
+  Calibration::Table sensorCalibrations[NumWaterCircuits + 1];
+
+  Adc::Settings adcSettings;
+
+  PowerBudget::Settings powerBudget;
+
+  Ds18x20Bus::Settings temperatureBus;
+
+  Scheduler::Settings schedulerSettings;
+
+  rules::Settings rules;
+
+  SystemTime::Settings timeSettings;
+
+  NtpClient::Settings ntpSettings;
   
   FlashData()
     /* router SSID */
@@ -68,15 +90,14 @@ struct FlashData
        20}, /* maximum iterations                      */
     }
     
-    , schedulerTimes
-    {{6, 0},
-     {8, 0},
-     {SchedulerTime::InvalidHour, 0},
-     {SchedulerTime::InvalidHour, 0},
-     {SchedulerTime::InvalidHour, 0},
-     {SchedulerTime::InvalidHour, 0},
-     {20, 0},
-     {22, 0},
+    /* hour, minute, weekdays, interval, phase, circuits, pump seconds */
+    , schedule
+    {4,
+     {{ 6, 0, Scheduler::AllDays, 1, 0, Scheduler::AllCircuits, 0},
+      { 8, 0, Scheduler::AllDays, 1, 0, Scheduler::AllCircuits, 0},
+      {20, 0, Scheduler::AllDays, 1, 0, Scheduler::AllCircuits, 0},
+      {22, 0, Scheduler::AllDays, 1, 0, Scheduler::AllCircuits, 0},
+     }
     }
     
     , thingSpeakLoggerSettings
@@ -92,10 +113,116 @@ struct FlashData
     , telnetPass{"h4ckm3"}
 
     , debug(false)
+
+    /* all sensors uncalibrated */
+    , sensorCalibrations{}
+
+    , adcSettings
+      {false, /* adaptive settling          */
+          4,  /* settle tolerance (counts)  */
+          5,  /* successive agreeing samples */
+       Adc::AcquireSpaced,
+       Adc::ReduceMean,
+         64}  /* burst samples              */
+
+    /* the default budget allows a single pump and valve, i.e. serial watering */
+    , powerBudget
+      {650,   /* supply current (mA)        */
+       500,   /* pump current (mA)          */
+       150}   /* valve current (mA)         */
+
+    /* no 1-wire devices known, the bus is searched at boot */
+    , temperatureBus
+      {12,    /* resolution (bits)          */
+        0,    /* number of known devices    */
+       {}}
+
+    , schedulerSettings
+      {30,    /* grace window (minutes)     */
+       Scheduler::CatchUpWithin}
+
+    /* no rules, the scheduler alone triggers watering */
+    , rules
+      {10,    /* evaluation interval (minutes) */
+        0,    /* number of rules            */
+       {}}
+
+    /* RTC drift unknown */
+    , timeSettings
+      {0,     /* drift (ppb)                */
+       0,     /* RTC set epoch              */
+       0}     /* number of drift estimates  */
+
+    , ntpSettings
+      {{"europe.pool.ntp.org",
+        "pool.ntp.org",
+        "time.google.com"},
+       120,   /* UTC offset (minutes, zurich) */
+       64}    /* poll interval (seconds)    */
   { }
 };
 
 extern FlashSettings<FlashData> flashSettings;
 
+/** Defers and coalesces the commits of the flash settings.
+ *
+ * Every commit rewrites the whole settings struct, which costs a sector
+ * erase and stalls the loop. Setters therefore only mark the settings
+ * dirty, they are committed when they were left alone for the quiet
+ * period, or latest after the maximum deferral if they keep changing.
+ * Configuring many parameters in a row this way costs a single commit.
+ * A commit is skipped if the CRC of the settings equals the one of the
+ * last commit, e.g. when a value was set back to what it was.
+ */
+class FlashCommitter
+{
+public:
+  static const unsigned int QuietMs = 3000;
+  static const unsigned int MaxDeferMs = 30000;
+
+  struct Stats
+  {
+    uint32_t m_requests;
+    uint32_t m_commits;
+    /** Commits skipped because nothing changed */
+    uint32_t m_unchanged;
+    uint32_t m_lastMs;
+    uint32_t m_maxMs;
+    uint32_t m_totalMs;
+  };
+
+  FlashCommitter(FlashSettings<FlashData>& settings);
+  /** Takes the loaded settings as committed, call after flashSettings.begin() */
+  void begin();
+  void run();
+  /** Requests a commit */
+  void markDirty();
+  /** Commits now unless nothing changed, returns true if the settings were written */
+  bool commit();
+
+  bool isDirty() const
+  {
+    return m_dirty;
+  }
+  const Stats& getStats() const
+  {
+    return m_stats;
+  }
+  Print& prt(Print& p) const;
+
+private:
+  uint32_t getCrc() const;
+
+  FlashSettings<FlashData>& m_settings;
+  bool m_dirty;
+  Instant m_firstChange;
+  Instant m_lastChange;
+  /** CRC of the settings as committed */
+  uint32_t m_crc;
+  Stats m_stats;
+};
+
+extern FlashCommitter flashCommitter;
+
 #endif /* _EW_IG_FLASH_SETTINGS_H_ */
 
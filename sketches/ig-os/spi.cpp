@@ -1,7 +1,15 @@
 #include "spi.h"
+#include "settings.h"
+
+#include <ESP8266WiFi.h>
+
+extern "C" {
+#include <user_interface.h>
+}
 
 Spi spi;
-Adc adc;
+Adc adc(flashSettings.adcSettings);
+
   
 void
 Adc::begin()
@@ -13,71 +21,268 @@ Adc::begin()
 void
 Adc::run()
 {
-  auto now = millis();
+  Instant now = Instant::now();
   
   switch (m_state) {
     case StateIdle:
+    {
+      int r = schedule(now);
+      if (r >= 0) {
+        m_channel = m_requests[r].m_channel;
+        changeState(StatePoweringUp);
+        /* Selected once the multiplexers are powered, this way the power
+         * up settling is judged on the input which is going to be read.
+         */
+        select(m_channel);
+      }
       break;
+    }
     
     case StatePoweringUp:
-      if (now - m_lastStateChangeMs > msPowerUp) {
-        spi.setAdcChannel(m_channel);
+    {
+      Duration d = now - m_lastStateChange;
+      bool timeout = d > Duration::fromMs(msPowerUp);
+      if (timeout or settled(now)) {
+        m_powerUpStats.add(d.toMs(), timeout, msPowerUp);
+        m_setupMs = msAdcSetup;
         changeState(StateAdcSetup);
       }
       break;
+    }
     
     case StatePowerUpIdle:
-      if (now - m_lastStateChangeMs > msPowerDown) {
+      if (schedule(now) >= 0) {
+        next();
+      } else if (now - m_lastStateChange > Duration::fromMs(msPowerDown)) {
         changeState(StateIdle);
       }
       break;
       
     case StateAdcSetup:
-      if (now - m_lastStateChangeMs > msAdcSetup) {
+    {
+      Duration d = now - m_lastStateChange;
+      bool timeout = d > Duration::fromMs(m_setupMs);
+      if (timeout or settled(now)) {
+        m_setupStats[m_channel].add(d.toMs(), timeout, m_setupMs);
         changeState(StateReady);
       }
       break;
+    }
     
     case StateReady:
+      if (not isRequested(m_channel)) {
+        /* all requests cancelled in the meantime */
+        next();
+      } else if (getAcquisitionMode() == AcquireBurst and canBurst()) {
+        acquire();
+        deliver();
+        next();
+      } else {
+        m_sampleIndex = 0;
+        m_conversionStart = now;
+        changeState(StateConvert);
+      }
+      break;
+
+    case StateConvert:
+      if (not isRequested(m_channel)) {
+        next();
+        break;
+      }
+      if (m_sampleIndex == NumSpacedSamples) {
+        reduce(m_samples, NumSpacedSamples, getReducer(), m_reading);
+        m_reading.m_durationUs = m_conversionStart.elapsed().toUs();
+        deliver();
+        next();
+        break;
+      }
+      if (m_sampleIndex == 0 or now - m_lastSample >= Duration::fromMs(msSpacedSample)) {
+        m_lastSample = now;
+        m_samples[m_sampleIndex] = analogRead(SensorAdcPin);
+        Debug << "adc channel " << m_channel << ", sample " << m_sampleIndex << ": " << m_samples[m_sampleIndex] << "\n";
+        m_sampleIndex++;
+      }
       break;
   }
 }
-  
+
+unsigned int
+Adc::getNumSamples() const
+{
+  unsigned int n = m_settings.m_burstSamples;
+  return n < 1 ? 1 : (n > MaxBurstSamples ? MaxBurstSamples : n);
+}
+
 bool
-Adc::request(Channel channel)
+Adc::enqueue(Channel channel, Priority priority, Consumer& consumer)
 {
-  switch (m_state) {
-    
-    case StateIdle:
-      m_channel = channel;
-      changeState(StatePoweringUp);
-      return true;
+  for (unsigned int i = 0; i < MaxRequests; i++) {
+    Request& r = m_requests[i];
+    if (not r.m_consumer) {
+      r.m_consumer = &consumer;
+      r.m_channel = channel;
+      r.m_priority = priority;
+      r.m_enqueued = Instant::now();
       
-    case StatePowerUpIdle:
-      if (channel != m_channel) {
-        m_channel = channel;
-        spi.setAdcChannel(m_channel);
-        changeState(StateAdcSetup);
-      } else {
-        changeState(StateReady);
+      m_queueStats.m_depth++;
+      if (m_queueStats.m_depth > m_queueStats.m_maxDepth) {
+        m_queueStats.m_maxDepth = m_queueStats.m_depth;
       }
       return true;
-      
-    default:
-      return false;
+    }
   }
+  return false;
 }
 
 void
-Adc::reset()
+Adc::cancel(Consumer& consumer)
+{
+  for (unsigned int i = 0; i < MaxRequests; i++) {
+    if (m_requests[i].m_consumer == &consumer) {
+      m_requests[i].m_consumer = NULL;
+      m_queueStats.m_depth--;
+    }
+  }
+}
+
+int
+Adc::schedule(Instant now) const
 {
-  if (m_state > StatePoweringUp) {
+  int best = -1;
+  unsigned long bestRank = 0;
+  
+  for (unsigned int i = 0; i < MaxRequests; i++) {
+    const Request& r = m_requests[i];
+    if (not r.m_consumer) {
+      continue;
+    }
+    /* Priority raised by waiting time. Among equal priorities this
+     * yields first come first served. The settling time a channel switch
+     * would cost is taken off, this way channels which are cheap to reach
+     * are scanned first while aging still prevents starvation.
+     */
+    unsigned long rank = (unsigned long)r.m_priority * msPriorityAging + (now - r.m_enqueued).toMs() + msAdcSetup;
+    rank -= switchCostMs(r.m_channel);
+    if (best < 0 or rank > bestRank) {
+      best = i;
+      bestRank = rank;
+    }
+  }
+  return best;
+}
+
+unsigned int
+Adc::switchCostMs(Channel channel) const
+{
+  if (m_state == StateIdle or m_state == StatePoweringUp) {
+    /* no channel selected yet, every channel needs the full setup */
+    return msAdcSetup;
+  }
+  if (channel == m_channel) {
+    return 0;
+  }
+  if (getOnboardInput(channel) == getOnboardInput(m_channel)) {
+    return msExtMuxSetup;
+  }
+  return msAdcSetup;
+}
+
+void
+Adc::select(Channel channel)
+{
+  spi.beginUpdate();
+  spi.setExtMuxChannel(getExtMuxInput(channel));
+  spi.setAdcChannel(getOnboardInput(channel));
+  spi.commit();
+  spi.flush();
+}
+
+bool
+Adc::isRequested(Channel channel) const
+{
+  for (unsigned int i = 0; i < MaxRequests; i++) {
+    if (m_requests[i].m_consumer and m_requests[i].m_channel == channel) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+Adc::deliver()
+{
+  Instant now = Instant::now();
+  
+  m_queueStats.m_conversions++;
+  
+  /* Release all requests before notifying, a consumer might request again
+   * and must not receive this reading twice.
+   */
+  Consumer* consumers[MaxRequests];
+  unsigned int n = 0;
+  
+  for (unsigned int i = 0; i < MaxRequests; i++) {
+    Request& r = m_requests[i];
+    if (not r.m_consumer or r.m_channel != m_channel) {
+      continue;
+    }
+    uint32_t wait = (now - r.m_enqueued).toMs();
+    m_queueStats.m_lastWaitMs = wait;
+    m_queueStats.m_maxWaitMs = wait > m_queueStats.m_maxWaitMs ? wait : m_queueStats.m_maxWaitMs;
+    m_queueStats.m_totalWaitMs += wait;
+    m_queueStats.m_served++;
+    m_queueStats.m_depth--;
+    
+    consumers[n++] = r.m_consumer;
+    r.m_consumer = NULL;
+  }
+  
+  for (unsigned int i = 0; i < n; i++) {
+    consumers[i]->adcDone(m_channel, m_reading);
+  }
+}
+
+void
+Adc::next()
+{
+  int r = schedule(Instant::now());
+  if (r < 0) {
     changeState(StatePowerUpIdle);
+    return;
+  }
+  Channel channel = m_requests[r].m_channel;
+  if (channel != m_channel) {
+    m_setupMs = switchCostMs(channel);
+    m_channel = channel;
+    select(m_channel);
+    changeState(StateAdcSetup);
   } else {
-    changeState(StateIdle);
+    changeState(StateReady);
   }
 }
 
+bool
+Adc::settled(Instant now)
+{
+  if (not m_settings.m_adaptiveSettling) {
+    return false;
+  }
+  if (now - m_lastSettleSampleTime < Duration::fromMs(msSettleSample)) {
+    return false;
+  }
+  m_lastSettleSampleTime = now;
+
+  uint16_t v = analogRead(SensorAdcPin);
+  uint16_t d = v > m_lastSettleSample ? v - m_lastSettleSample : m_lastSettleSample - v;
+  m_lastSettleSample = v;
+
+  if (d > m_settings.m_settleTolerance) {
+    m_settleAgreeCount = 0;
+    return false;
+  }
+  return ++m_settleAgreeCount >= m_settings.m_settleCount;
+}
+  
 void
 Adc::changeState(State newState)
 {
@@ -86,7 +291,7 @@ Adc::changeState(State newState)
      *  avoid current through ESD protection diodes
      */
     case StateIdle:
-      spi.setAdcChannel(0);
+      select(ChSensor1);
       digitalWrite(SensorPowerPin, LOW);
       Debug << F("adc idle\n");
       break;
@@ -103,9 +308,98 @@ Adc::changeState(State newState)
     case StateReady:
       Debug << F("adc ready\n");
       break;
+    case StateConvert:
+      Debug << F("adc converting\n");
+      break;
   }
   m_state = newState;
-  m_lastStateChangeMs = millis();
+  m_lastStateChange = Instant::now();
+
+  /* Restart settling detection, the first sample only serves as reference */
+  m_lastSettleSampleTime = m_lastStateChange;
+  m_lastSettleSample = UINT16_MAX;
+  m_settleAgreeCount = 0;
+}
+
+void
+Adc::SettleStats::add(unsigned long ms, bool timeout, unsigned int fixedMs)
+{
+  m_lastMs = ms;
+  m_maxMs = ms > m_maxMs ? ms : m_maxMs;
+  m_count++;
+  m_timeouts += timeout ? 1 : 0;
+  m_totalMs += ms;
+  m_fixedMs += fixedMs;
+}
+
+Print&
+Adc::SettleStats::prt(Print& p) const
+{
+  if (not m_count) {
+    return p << "no data\n";
+  }
+  unsigned long avg = m_totalMs / m_count;
+  /* negative when settling took longer than the fixed delay, e.g. timeouts */
+  long saved = (long)m_fixedMs - (long)m_totalMs;
+  prtFmt(p, "last %4u ms, avg %4lu ms, max %4u ms, %u/%u timeouts, saved %ld ms\n",
+         m_lastMs, avg, m_maxMs, m_timeouts, m_count, saved);
+  return p;
+}
+
+void
+Adc::clearStats()
+{
+  m_queueStats.m_maxDepth = m_queueStats.m_depth;
+  m_queueStats.m_served = 0;
+  m_queueStats.m_conversions = 0;
+  m_queueStats.m_lastWaitMs = 0;
+  m_queueStats.m_maxWaitMs = 0;
+  m_queueStats.m_totalWaitMs = 0;
+  m_powerUpStats = SettleStats{0};
+  for (unsigned int i = 0; i < NumChannels; i++) {
+    m_setupStats[i] = SettleStats{0};
+  }
+}
+
+Print&
+Adc::QueueStats::prt(Print& p) const
+{
+  p
+    << "       queue depth  " << m_depth << " (max " << m_maxDepth << ")\n"
+    << "   requests served  " << m_served << " by " << m_conversions << " conversions\n";
+  if (m_served) {
+    prtFmt(p, "         wait time  last %lu ms, avg %lu ms, max %lu ms\n",
+           (unsigned long)m_lastWaitMs, (unsigned long)(m_totalWaitMs / m_served), (unsigned long)m_maxWaitMs);
+  }
+  return p;
+}
+
+Print&
+Adc::prt(Print& p) const
+{
+  p
+    << "             state  " << getStateString(m_state) << "\n"
+    << " adaptive settling  " << (m_settings.m_adaptiveSettling ? "on" : "off") << "\n"
+    << "  settle tolerance  " << m_settings.m_settleTolerance << "\n"
+    << "      settle count  " << m_settings.m_settleCount << "\n"
+    << "       acquisition  " << getAcquisitionModeString(getAcquisitionMode());
+  if (getAcquisitionMode() == AcquireBurst and not canBurst()) {
+    p << " (spaced while WiFi is on)";
+  }
+  p << "\n"
+    << "           reducer  " << getReducerString(getReducer()) << "\n"
+    << "     burst samples  " << m_settings.m_burstSamples << "\n";
+  m_queueStats.prt(p)
+    << "settling times:\n"
+    << "          power up  "; m_powerUpStats.prt(p);
+  for (unsigned int i = 0; i < NumChannels; i++) {
+    /* don't clutter the output with unused channels */
+    if (i > ChReservoir and not m_setupStats[i].m_count) {
+      continue;
+    }
+    prtFmt(p, "        channel %2u  ", i); m_setupStats[i].prt(p);
+  }
+  return p;
 }
 
 /*
@@ -127,9 +421,81 @@ Adc::changeState(State newState)
     tmr.alarm(2, 200, 1, function() read_adc() end)
  */
 
-uint16_t
-Adc::read() const
+bool
+Adc::canBurst() const
+{
+  return WiFi.getMode() == WIFI_OFF;
+}
+
+void
+Adc::acquire()
 {
-  return analogRead(SensorAdcPin);
+  unsigned int n = getNumSamples();
+
+  Instant start = Instant::now();
+
+  system_adc_read_fast(m_samples, n, FastReadClockDiv);
+
+  reduce(m_samples, n, getReducer(), m_reading);
+  m_reading.m_durationUs = start.elapsed().toUs();
+
+  Debug << "adc channel " << m_channel << ", burst of " << n << " in " << m_reading.m_durationUs << " us: " << m_reading.m_raw << "\n";
+}
+
+void
+Adc::reduce(uint16_t* samples, unsigned int n, Reducer reducer, Reading& reading)
+{
+  uint16_t min = UINT16_MAX, max = 0;
+  uint32_t sum = 0;
+  uint64_t sumSq = 0;
+
+  for (unsigned int i = 0; i < n; i++) {
+    uint16_t v = samples[i];
+    min = v < min ? v : min;
+    max = v > max ? v : max;
+    sum += v;
+    sumSq += (uint32_t)v * v;
+  }
+
+  /* Standard deviation in 10 bit counts is sqrt(n * sumSq - sum^2) / n,
+   * scaling it by 64 to 16 bit full scale multiplies the radicand by 4096.
+   */
+  uint64_t var = (uint64_t)n * sumSq - (uint64_t)sum * sum;
+  reading.m_noise.m_stdDev = isqrt(var * 4096) / n;
+  reading.m_noise.m_min = min << 6;
+  reading.m_noise.m_max = max << 6;
+  reading.m_noise.m_numSamples = n;
+
+  /* Averaging reducers normalize the sum to 16 bit full scale before
+   * dividing, this way oversampling yields the additional resolution.
+   */
+  switch (reducer) {
+    case ReduceMedian:
+      std::sort(samples, samples + n);
+      if (n & 1) {
+        reading.m_raw = samples[n / 2] << 6;
+      } else {
+        reading.m_raw = (samples[n / 2 - 1] + samples[n / 2]) << 5;
+      }
+      break;
+    case ReduceTrimmedMean:
+    {
+      std::sort(samples, samples + n);
+      unsigned int trim = n / 4;
+      uint32_t tsum = 0;
+      for (unsigned int i = trim; i < n - trim; i++) {
+        tsum += samples[i];
+      }
+      reading.m_raw = (tsum << 6) / (n - 2 * trim);
+      break;
+    }
+    case ReduceMin:
+      reading.m_raw = min << 6;
+      break;
+    case ReduceMean:
+    default:
+      reading.m_raw = (sum << 6) / n;
+      break;
+  }
 }
 
@@ -9,21 +9,71 @@
  
 #include <SPI.h>
 #include "config.h"
+#include "circuit.h"
 
-class Spi
+/** Driver for a chain of daisy chained 74HC595 style shift registers.
+ *
+ * The bitfield map is derived from the circuit topology: starting at the
+ * least significant bit of the register closest to the controller there
+ * is one bit per pump, one bit per valve, the three ADC multiplexer bits
+ * and the select bits of the external multiplexer if there is one. With a
+ * single register, four valves and no external multiplexer this is the
+ * layout of the on-board circuitry. The whole chain is shifted out in one transfer.
+ *
+ * Changes to the register are only staged by the setters and transmitted
+ * by run() at the end of each loop pass. This way all changes of one pass
+ * reach the outputs with a single transfer and latch. Whoever needs the
+ * outputs to be updated immediately calls flush().
+ *
+ * Changes which must reach the outputs together can be enclosed in
+ * beginUpdate() and commit(), a flush() in between is deferred until the
+ * outermost commit().
+ */
+template<unsigned int _NumRegisters, unsigned int _NumPumps, unsigned int _NumValves, unsigned int _ExtMuxBits = 0>
+class ShiftRegisterChain
 {
 public:
-  static const unsigned char AdcMask    = 0b11100000;
-  static const unsigned char AdcShift   = 5;
-  
-  static const unsigned char PumpMask   = 0b00000001;
-  static const unsigned char PumpShift  = 0;
-  
-  static const unsigned char ValveMask  = 0b00011110;
-  static const unsigned char ValveShift = 1;
+  static const unsigned int NumRegisters = _NumRegisters;
+  static const unsigned int NumBits      = NumRegisters * 8;
+  static const unsigned int NumPumps     = _NumPumps;
+  static const unsigned int NumValves    = _NumValves;
+
+  static const unsigned int PumpShift    = 0;
+  static const unsigned int PumpBits     = NumPumps;
+  static const unsigned int ValveShift   = PumpShift + PumpBits;
+  static const unsigned int AdcShift     = ValveShift + NumValves;
+  static const unsigned int AdcBits      = 3;
+  static const unsigned int ExtMuxShift  = AdcShift + AdcBits;
+  static const unsigned int ExtMuxBits   = _ExtMuxBits;
+  static const unsigned int NumUsedBits  = ExtMuxShift + ExtMuxBits;
+
+  static_assert(NumUsedBits <= NumBits, "shift register chain too short for the circuit topology");
+  static_assert(NumValves <= 32, "valve bitfield limited to 32 valves");
+
+  /** One bit per valve, bit 0 is the first valve */
+  typedef uint32_t ValveBits;
+  static const ValveBits ValveNone = 0;
+
+  static ValveBits valveBit(unsigned int index)
+  {
+    return (ValveBits)1 << index;
+  }
+
+  struct Stats
+  {
+    /** Number of setter calls */
+    uint32_t m_requests;
+    /** Number of setter calls which changed the register */
+    uint32_t m_changes;
+    /** Number of transfers to the shift register chain */
+    uint32_t m_transfers;
+  };
   
-  Spi()
-    : m_register(0)
+  ShiftRegisterChain()
+    : m_register{0}
+    , m_dirty(false)
+    , m_updateDepth(0)
+    , m_stats{0}
   { }
   void begin()
   {
@@ -32,77 +82,165 @@ public:
     SPI.begin();
     SPI.setBitOrder (MSBFIRST);
     
-    m_register = 0;
+    memset(m_register, 0, sizeof(m_register));
     transmit();
   }
   void run()
-  { }
+  {
+    flush();
+  }
+
+  /** Starts a transaction, changes are held back until commit() */
+  void beginUpdate()
+  {
+    m_updateDepth++;
+  }
+  /** Ends a transaction, the changes are transmitted with the next run() or flush() */
+  void commit()
+  {
+    if (m_updateDepth) {
+      m_updateDepth--;
+    }
+  }
+  /** Transmits pending changes right away unless a transaction is open */
+  void flush()
+  {
+    if (m_dirty and not m_updateDepth) {
+      transmit();
+    }
+  }
+  bool isDirty() const
+  {
+    return m_dirty;
+  }
+
   void setAdcChannel(unsigned char channel)
   {
-    setBitfields<AdcShift, AdcMask>(m_register, channel);
-    transmit();
+    setField(AdcShift, AdcBits, channel);
   }
-  unsigned char getAdcChannel()
+  unsigned char getAdcChannel() const
   {
-    return getBitfields<AdcShift, AdcMask>(m_register);
+    return getField(AdcShift, AdcBits);
   }
-  
-  void setPump(bool enable)
+  void setExtMuxChannel(unsigned char channel)
   {
-    unsigned char ena =  enable ? 1 : 0;
-    setBitfields<PumpShift, PumpMask>(m_register,ena);
-    transmit();
+    setField(ExtMuxShift, ExtMuxBits, channel);
   }
-  bool getPump()
+  unsigned char getExtMuxChannel() const
   {
-    return getBitfields<PumpShift, PumpMask>(m_register) != 0;
+    return getField(ExtMuxShift, ExtMuxBits);
   }
   
-  typedef enum
+  void setPump(unsigned int index, bool enable)
+  {
+    setField(PumpShift + index, 1, enable ? 1 : 0);
+  }
+  bool getPump(unsigned int index) const
   {
-    ValveNone = 0,
-    Valve1 = 0b0001,
-    Valve2 = 0b0010,
-    Valve3 = 0b0100,
-    Valve4 = 0b1000,
-    ValveCount = 4,
-  } Valve;
-  /**
-   * Note: only one bitfield can be active at once.
+    return getField(PumpShift + index, 1) != 0;
+  }
+  
+  /** Opens or closes a single valve. How many valves may be open at once
+   *  is limited by the circuits' power budget.
    */
-  bool setValve(Valve valve)
+  void setValve(unsigned int index, bool open)
   {
-    unsigned char val = static_cast<unsigned char>(valve);
-    
-    /* We allow only one valve to be active at once */
-    if (countBits(val) > 1) {
-      Error << "TOO MANY BITS FOR VALVE\n";
-      return false;
-    }
-    
-    setBitfields<ValveShift, ValveMask>(m_register, val);
-    transmit();
+    setField(ValveShift + index, 1, open ? 1 : 0);
+  }
+  /** Returns the bits of all open valves */
+  ValveBits getValve() const
+  {
+    return getField(ValveShift, NumValves);
+  }
 
-    return true;
+  const Stats& getStats() const
+  {
+    return m_stats;
   }
-  Valve getValve()
+  Print& prt(Print& p) const
   {
-    return static_cast<Spi::Valve>(getBitfields<ValveShift, ValveMask>(m_register));
+    p << "        register  ";
+    for (unsigned int i = 0; i < NumRegisters; i++) {
+      prtFmt(p, "%02x", m_register[i]);
+    }
+    return p
+      << " (" << NumRegisters << " x 8 bit)\n"
+      << "    set requests  " << m_stats.m_requests << "\n"
+      << "         changes  " << m_stats.m_changes << "\n"
+      << "       transfers  " << m_stats.m_transfers << "\n";
   }
 
 private:
+  /** Bits are stored in transmission order: the first byte is shifted
+   *  into the last register of the chain.
+   */
+  static unsigned int byteIndex(unsigned int bit)
+  {
+    return NumRegisters - 1 - bit / 8;
+  }
+
+  bool getBit(unsigned int bit) const
+  {
+    return (m_register[byteIndex(bit)] & (1 << (bit % 8))) != 0;
+  }
+
+  uint32_t getField(unsigned int shift, unsigned int width) const
+  {
+    uint32_t value = 0;
+    for (unsigned int i = 0; i < width; i++) {
+      value |= (uint32_t)(getBit(shift + i) ? 1 : 0) << i;
+    }
+    return value;
+  }
+
+  void setField(unsigned int shift, unsigned int width, uint32_t value)
+  {
+    m_stats.m_requests++;
+    bool changed = false;
+    for (unsigned int i = 0; i < width; i++) {
+      bool set = (value >> i) & 1;
+      uint8_t& b = m_register[byteIndex(shift + i)];
+      uint8_t mask = 1 << ((shift + i) % 8);
+      if (set != ((b & mask) != 0)) {
+        b ^= mask;
+        changed = true;
+      }
+    }
+    if (changed) {
+      m_dirty = true;
+      m_stats.m_changes++;
+    }
+  }
 
   void transmit()
   {
+    /* writeBytes doesn't preserve the buffer on all cores */
+    uint8_t buf[NumRegisters];
+    memcpy(buf, m_register, sizeof(buf));
+
     digitalWrite(SpiLatchPin, LOW);    
-    SPI.transfer(m_register);
+    SPI.transfer(buf, sizeof(buf));
     digitalWrite(SpiLatchPin, HIGH);
+    m_dirty = false;
+    m_stats.m_transfers++;
   }
 
-  /** Local copy of the shift register */
-  unsigned char m_register;
+  /** Local copy of the shift register chain */
+  uint8_t m_register[NumRegisters];
+  /** Local copy differs from the shift registers */
+  bool m_dirty;
+  unsigned int m_updateDepth;
+  Stats m_stats;
 };
 
+/** Number of bits needed to select an input of the external multiplexer */
+constexpr unsigned int extMuxBits(unsigned int n, unsigned int bits = 0)
+{
+  return (1u << bits) >= n ? bits : extMuxBits(n, bits + 1);
+}
+
+typedef ShiftRegisterChain<NumShiftRegisters, NumPumps, NumWaterCircuits, NumExtMuxChannels ? extMuxBits(NumExtMuxChannels) : 0> Spi;
+
 extern Spi spi;
 
 class Adc
@@ -114,8 +252,16 @@ public:
     StatePoweringUp,
     StatePowerUpIdle,
     StateAdcSetup,
+    /** Channel settled, the conversion is about to start */
     StateReady,
+    /** Spaced acquisition in progress */
+    StateConvert,
   } State;
+  /** The channels 0 .. 7 are the inputs of the onboard multiplexer, the
+   *  inputs of the external multiplexer follow. The output of the external
+   *  multiplexer is connected to the onboard input ExtMuxInput, so selecting
+   *  one of its channels takes two levels of switching.
+   */
   typedef enum
   {
     ChSensor1 = 0,
@@ -123,36 +269,283 @@ public:
     ChSensor3,
     ChSensor4,
     ChReservoir,
+    NumOnboardChannels = 8,
+    ChExtMux1 = NumOnboardChannels,
+    NumChannels = NumOnboardChannels + NumExtMuxChannels,
   } Channel;
 
+  /** Onboard multiplexer input connected to the output of the external one */
+  static const unsigned int ExtMuxInput = 5;
+
+  static bool isExtMuxChannel(Channel channel)
+  {
+    return channel >= ChExtMux1;
+  }
+  /** Onboard multiplexer input of a channel */
+  static unsigned int getOnboardInput(Channel channel)
+  {
+    return isExtMuxChannel(channel) ? ExtMuxInput : channel;
+  }
+  /** External multiplexer input of a channel */
+  static unsigned int getExtMuxInput(Channel channel)
+  {
+    return isExtMuxChannel(channel) ? channel - ChExtMux1 : 0;
+  }
+
+  /** Fixed delays, with adaptive settling these are the timeouts */
   static const unsigned int msPowerUp   =  2000;
   static const unsigned int msAdcSetup  =  1000;
+  /** Switching the external multiplexer only, the onboard path stays connected */
+  static const unsigned int msExtMuxSetup =  200;
   static const unsigned int msPowerDown =  2000;
 
-  Adc()
-    : m_state(StateIdle)
+  /** Sample interval while waiting for the input to settle */
+  static const unsigned int msSettleSample = 10;
+
+  /** Number of samples and their interval in spaced acquisition mode */
+  static const unsigned int NumSpacedSamples = 8;
+  static const unsigned int msSpacedSample = 100;
+
+  /** Maximum number of queued requests */
+  static const unsigned int MaxRequests = 8;
+  /** A request gains one priority level each time it waited this long, keeps low priority consumers from starving */
+  static const unsigned long msPriorityAging = 10000;
+
+  /** Maximum number of samples of a burst acquisition */
+  static const unsigned int MaxBurstSamples = 256;
+  /** ADC clock divider for the fast read path, the SDK recommends 8 or higher */
+  static const uint8_t FastReadClockDiv = 8;
+
+  typedef enum
+  {
+    /** Samples are taken at a fixed interval */
+    AcquireSpaced = 0,
+    /** All samples are taken in one go by the SDK's fast read path. It is
+     *  only available while WiFi is off, back to back reads with the radio
+     *  on are known to drop the connection. Spaced acquisition is used
+     *  instead while WiFi is on.
+     */
+    AcquireBurst,
+  } AcquisitionMode;
+
+  static const char* getAcquisitionModeString(AcquisitionMode mode)
+  {
+    switch (mode) {
+      case AcquireSpaced: return "spaced";
+      case AcquireBurst:  return "burst";
+      default:            return "unknown";
+    }
+  }
+
+  /** How the samples of one reading are reduced to a single value */
+  typedef enum
+  {
+    ReduceMean = 0,
+    ReduceMedian,
+    /** Mean of the samples without the lowest and highest quarter */
+    ReduceTrimmedMean,
+    /** Minimum, suppresses positive spikes, see comment in spi.cpp */
+    ReduceMin,
+    NumReducers,
+  } Reducer;
+
+  static const char* getReducerString(Reducer reducer)
+  {
+    switch (reducer) {
+      case ReduceMean:        return "mean";
+      case ReduceMedian:      return "median";
+      case ReduceTrimmedMean: return "trim";
+      case ReduceMin:         return "min";
+      default:                return "unknown";
+    }
+  }
+  static Reducer str2Reducer(const char* str)
+  {
+    for (unsigned int r = 0; r < NumReducers; r++) {
+      if (strcmp(str, getReducerString(static_cast<Reducer>(r))) == 0) {
+        return static_cast<Reducer>(r);
+      }
+    }
+    return NumReducers;
+  }
+
+  /** A reduced reading normalized to 16 bit full scale */
+  struct Reading
+  {
+    uint16_t m_raw;
+    Sensor::Noise m_noise;
+    unsigned long m_durationUs;
+  };
+
+  typedef Sensor::Priority Priority;
+
+  /** Interface of everyone requesting conversions */
+  class Consumer
+  {
+  public:
+    /** Called when the requested conversion has completed */
+    virtual void adcDone(Channel channel, const Reading& reading) = 0;
+  };
+
+  /** Request queue statistics */
+  struct QueueStats
+  {
+    uint8_t m_depth;
+    uint8_t m_maxDepth;
+    uint32_t m_served;
+    uint32_t m_conversions;
+    uint32_t m_lastWaitMs;
+    uint32_t m_maxWaitMs;
+    uint32_t m_totalWaitMs;
+
+    Print& prt(Print& p) const;
+  };
+
+  struct Settings
+  {
+    /** Declare the input settled as soon as successive samples agree instead of waiting the fixed delays */
+    bool m_adaptiveSettling;
+    /** Maximum difference between two successive samples in ADC counts (10 bit) to be considered equal */
+    uint8_t m_settleTolerance;
+    /** Number of successive agreeing samples required */
+    uint8_t m_settleCount;
+    /** See AcquisitionMode */
+    uint8_t m_acquisitionMode;
+    /** See Reducer */
+    uint8_t m_reducer;
+    /** Number of samples taken in burst mode, range 1 .. MaxBurstSamples */
+    uint16_t m_burstSamples;
+  };
+
+  /** Settling time statistics */
+  struct SettleStats
+  {
+    uint16_t m_lastMs;
+    uint16_t m_maxMs;
+    uint16_t m_count;
+    uint16_t m_timeouts;
+    uint32_t m_totalMs;
+    /** Sum of the fixed delays the settling replaced, they differ between
+     *  the multiplexer levels switched
+     */
+    uint32_t m_fixedMs;
+
+    void add(unsigned long ms, bool timeout, unsigned int fixedMs);
+    Print& prt(Print& p) const;
+  };
+
+  Adc(Settings& settings)
+    : m_settings(settings)
+    , m_state(StateIdle)
+    , m_setupMs(msAdcSetup)
+    , m_requests{}
+    , m_queueStats{0}
+    , m_powerUpStats{0}
+    , m_setupStats{}
   { }
   
   void begin();  
   void run();  
-  bool request(Channel channel);
+
+  /** Queues a conversion request. Requests for the same channel share one conversion.
+   *  Returns false if the queue is full.
+   */
+  bool enqueue(Channel channel, Priority priority, Consumer& consumer);
+  /** Removes all requests of a consumer. */
+  void cancel(Consumer& consumer);
 
   State getState() const
   {
     return m_state;
   }
-  bool isReady() const
+  static const char* getStateString(State state)
+  {
+    switch (state) {
+      case StateIdle:        return "idle";
+      case StatePoweringUp:  return "powering up";
+      case StatePowerUpIdle: return "power up idle";
+      case StateAdcSetup:    return "setup";
+      case StateReady:       return "ready";
+      case StateConvert:     return "converting";
+      default:               return "unknown";
+    }
+  }
+  const QueueStats& getQueueStats() const
+  {
+    return m_queueStats;
+  }
+
+  /** Reduces the samples to a single reading and computes their noise statistics. The samples are reordered. */
+  static void reduce(uint16_t* samples, unsigned int n, Reducer reducer, Reading& reading);
+
+  const Settings& getSettings() const
   {
-    return m_state == StateReady;
+    return m_settings;
   }
-  uint16_t read() const;
-  void reset();
+  void setAdaptiveSettling(bool enable) { m_settings.m_adaptiveSettling = enable; }
+  void setSettleTolerance(uint8_t t)    { m_settings.m_settleTolerance = t; }
+  void setSettleCount(uint8_t n)        { m_settings.m_settleCount = n; }
+  void setAcquisitionMode(AcquisitionMode m) { m_settings.m_acquisitionMode = m; }
+  void setReducer(Reducer r)            { m_settings.m_reducer = r; }
+  void setBurstSamples(uint16_t n)      { m_settings.m_burstSamples = n; }
+
+  AcquisitionMode getAcquisitionMode() const { return static_cast<AcquisitionMode>(m_settings.m_acquisitionMode); }
+  Reducer getReducer() const { return static_cast<Reducer>(m_settings.m_reducer); }
+
+  void clearStats();
+  Print& prt(Print& p) const;
 private:
+  struct Request
+  {
+    Consumer* m_consumer;
+    Channel m_channel;
+    Priority m_priority;
+    Instant m_enqueued;
+  };
+
   void changeState(State newState);
+  /** Samples the input while waiting for it to settle, returns true when settled */
+  bool settled(Instant now);
+  /** Burst acquisition can be used, see AcquireBurst */
+  bool canBurst() const;
+  /** Takes a burst of samples from the ready channel and reduces it. Blocks for a few milliseconds. */
+  void acquire();
+  unsigned int getNumSamples() const;
+  /** Delivers the reading to all requests of the current channel */
+  void deliver();
+  /** Starts the next request or powers down if the queue is empty */
+  void next();
+  /** Returns the index of the request to be served next or -1 if the queue is empty */
+  int schedule(Instant now) const;
+  /** Settling time needed to switch from the current channel to another one */
+  unsigned int switchCostMs(Channel channel) const;
+  /** Sets up both multiplexer levels for a channel */
+  void select(Channel channel);
+  bool isRequested(Channel channel) const;
   
+
+  Settings& m_settings;
   State m_state;
   Channel m_channel;
-  unsigned long m_lastStateChangeMs;
+  /** Timeout of the current setup, depends on which multiplexers were switched */
+  unsigned int m_setupMs;
+  Instant m_lastStateChange;
+
+  Instant m_lastSettleSampleTime;
+  uint16_t m_lastSettleSample;
+  uint8_t m_settleAgreeCount;
+
+  Request m_requests[MaxRequests];
+  QueueStats m_queueStats;
+
+  uint16_t m_samples[MaxBurstSamples];
+  unsigned int m_sampleIndex;
+  Instant m_lastSample;
+  Instant m_conversionStart;
+  Reading m_reading;
+
+  SettleStats m_powerUpStats;
+  SettleStats m_setupStats[NumChannels];
 };
 
 extern Adc adc;
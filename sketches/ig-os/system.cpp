@@ -1,144 +1,258 @@
 #include "system.h"
 #include "spi.h"
 #include "settings.h"
+#include "calibration.h"
+#include "ads1115.h"
+#include "kvstore.h"
 
 
-SystemTime::SystemTime()
-  : m_ntpClient(m_ntpUDP,
-                "europe.pool.ntp.org",
-                2 * 60 * 60, /* offset seconds (zurich) */
-                60000)       /* update interval millis  */
+SystemTime::SystemTime(Settings& settings, NtpClient::Settings& ntpSettings)
+  : m_settings(settings)
+  , m_ntpClient(ntpSettings)
+  , m_rtc(RtcAddress)
   , m_mode(ModeNtp)
+  , m_ntpSyncs(0)
+  , m_rtcValid(false)
+  , m_rtcRaw(0)
+  , m_rtcRead()
+  , m_nextDiscipline()
+  , m_rtcSetPending(false)
+  , m_snapshot{}
+  , m_stats{}
 { }
 
 void
 SystemTime::begin()
 {
-  switch (m_mode) {
-    case ModeNtp:
-      m_ntpClient.begin();
-      break;
-    case ModeRtc:
-      break;
+  m_ntpClient.begin();
+
+  if (m_rtc.begin()) {
+    m_mode = ModeRtc;
+    m_rtcValid = m_rtc.read(m_rtcRaw);
+    m_rtcRead = Instant::now();
+    if (not m_rtcValid) {
+      Error << "RTC not set or stopped, waiting for NTP\n";
+    }
+  } else {
+    m_mode = ModeNtp;
+    Debug << "no RTC found, time valid after the first NTP update\n";
   }
+
+  /* make the RTC time available right away */
+  Source source;
+  unsigned long epoch = readEpoch(source);
+  updateSnapshot(epoch, source);
 }
 
 void
 SystemTime::run()
 {
-  switch (m_mode) {
-    case ModeNtp:
-      m_ntpClient.update();
-      break;
-    case ModeRtc:
-      break;
+  m_ntpClient.run();
+  if (m_ntpClient.getSyncs() != m_ntpSyncs) {
+    m_ntpSyncs = m_ntpClient.getSyncs();
+    m_stats.m_lastNtp = Instant::now();
+    if (m_mode == ModeRtc) {
+      discipline(m_ntpClient.getEpochTime());
+    }
+  }
+
+  Source source;
+  unsigned long epoch = readEpoch(source);
+  if (epoch != m_snapshot.m_epoch or source != m_snapshot.m_source) {
+    /* NTP just entered a new second: the best moment to set the RTC,
+     * writing the seconds register restarts its second
+     */
+    if (m_rtcSetPending and source == SourceNtp) {
+      setRtc(epoch);
+    }
+    updateSnapshot(epoch, source);
   }
 }
 
-uint8_t
-SystemTime::getDay()
+unsigned long
+SystemTime::readEpoch(Source& source)
 {
-  switch (m_mode) {
-    case ModeNtp:
-      return m_ntpClient.getDay();
-      break;
-    case ModeRtc:
-      break;
+  bool ntp = m_ntpClient.isSynced() and
+    (m_mode == ModeNtp or m_stats.m_lastNtp.elapsed() < Duration::fromMs(NtpHoldoverMs));
+  if (ntp) {
+    source = SourceNtp;
+    return m_ntpClient.getEpochTime();
+  }
+  if (m_mode == ModeRtc) {
+    unsigned long epoch = rtcEpoch();
+    if (epoch) {
+      source = SourceRtc;
+      return epoch;
+    }
   }
+  source = SourceNone;
   return 0;
 }
 
-uint8_t
-SystemTime::getHours()
+unsigned long
+SystemTime::rtcEpoch()
 {
-  switch (m_mode) {
-    case ModeNtp:
-      return m_ntpClient.getHours();
-      break;
-    case ModeRtc:
-      break;
+  Instant now = Instant::now();
+  if (now - m_rtcRead >= Duration::fromMs(RtcReadIntervalMs)) {
+    unsigned long raw;
+    m_rtcValid = m_rtc.read(raw);
+    if (m_rtcValid) {
+      m_rtcRaw = raw;
+    }
+    m_rtcRead = now;
   }
-  return 0;
+  if (not m_rtcValid) {
+    return 0;
+  }
+  return correctDrift(m_rtcRaw + (now - m_rtcRead).toSeconds());
 }
 
-uint8_t
-SystemTime::getMinutes()
+unsigned long
+SystemTime::correctDrift(unsigned long raw) const
 {
-  switch (m_mode) {
-    case ModeNtp:
-      return m_ntpClient.getMinutes();
-      break;
-    case ModeRtc:
-      break;
+  if (not m_settings.m_rtcSetEpoch or raw <= m_settings.m_rtcSetEpoch) {
+    return raw;
   }
-  return 0;
+  int64_t elapsed = raw - m_settings.m_rtcSetEpoch;
+  return raw - elapsed * m_settings.m_driftPpb / 1000000000LL;
 }
 
-uint8_t
-SystemTime::getSeconds()
+void
+SystemTime::discipline(unsigned long ntp)
 {
-  switch (m_mode) {
-    case ModeNtp:
-      return m_ntpClient.getSeconds();
-      break;
-    case ModeRtc:
-      break;
+  if (m_nextDiscipline.isArmed() and not m_nextDiscipline.expired()) {
+    return;
   }
-  return 0;
+  m_nextDiscipline.start(Duration::fromMs(RtcReadIntervalMs));
+
+  unsigned long raw;
+  if (not m_rtc.read(raw)) {
+    /* halted or never set */
+    m_rtcSetPending = true;
+    return;
+  }
+  m_rtcRaw = raw;
+  m_rtcRead = Instant::now();
+  m_rtcValid = true;
+
+  long offset = static_cast<long>(correctDrift(raw) - ntp);
+  m_stats.m_lastOffset = offset;
+
+  if (not m_settings.m_rtcSetEpoch or ntp <= m_settings.m_rtcSetEpoch or
+      offset > MaxRtcOffsetSeconds or offset < -MaxRtcOffsetSeconds) {
+    /* no reference or the RTC has been set elsewhere */
+    m_rtcSetPending = true;
+    return;
+  }
+
+  unsigned long elapsed = ntp - m_settings.m_rtcSetEpoch;
+  if (elapsed < DisciplineSeconds) {
+    return;
+  }
+
+  int64_t ppb = static_cast<int64_t>(static_cast<long>(raw - ntp)) * 1000000000LL / elapsed;
+  ppb = ppb > MaxDriftPpb ? MaxDriftPpb : (ppb < -MaxDriftPpb ? -MaxDriftPpb : ppb);
+  if (m_settings.m_numEstimates) {
+    ppb = (3 * static_cast<int64_t>(m_settings.m_driftPpb) + ppb) / 4;
+  }
+  m_settings.m_driftPpb = ppb;
+  if (m_settings.m_numEstimates < UINT8_MAX) {
+    m_settings.m_numEstimates++;
+  }
+  m_stats.m_estimates++;
+  m_rtcSetPending = true;
+
+  Debug << "RTC drift " << m_settings.m_driftPpb / 1000 << " ppm after " << elapsed / 3600 << " h\n";
 }
 
-unsigned long
-SystemTime::getEpoch()
+void
+SystemTime::setRtc(unsigned long epoch)
 {
-  switch (m_mode) {
-    case ModeNtp:
-      return m_ntpClient.getEpochTime();
-      break;
-    case ModeRtc:
-      break;
+  m_rtcSetPending = false;
+  if (not m_rtc.write(epoch)) {
+    Error << "failed to set RTC\n";
+    return;
   }
-  return 0;
+  m_rtcRaw = epoch;
+  m_rtcRead = Instant::now();
+  m_rtcValid = true;
+  m_settings.m_rtcSetEpoch = epoch;
+  m_stats.m_rtcSets++;
+  flashCommitter.markDirty();
+}
+
+void
+SystemTime::updateSnapshot(unsigned long epoch, Source source)
+{
+  Snapshot s;
+  s.m_epoch = epoch;
+  s.m_seconds = epoch % 60;
+  s.m_minutes = (epoch / 60) % 60;
+  s.m_hours = (epoch / 3600) % 24;
+  /* 1.1.1970 was a Thursday */
+  s.m_weekday = (epoch / 86400 + 4) % 7;
+  /* before the first update the epoch counts from zero */
+  s.m_valid = epoch > 1500000000UL;
+  s.m_source = s.m_valid ? source : SourceNone;
+
+  m_snapshot = s;
+}
+
+Print&
+SystemTime::prt(Print& p) const
+{
+  p << "              mode  " << (m_mode == ModeRtc ? "RTC, disciplined by NTP" : "NTP") << "\n"
+    << "            source  " << getSourceString(m_snapshot.m_source) << "\n"
+    << "          NTP sync  ";
+  if (m_ntpClient.isSynced()) {
+    p << static_cast<unsigned long>(m_stats.m_lastNtp.elapsed().toSeconds()) << " s ago\n";
+  } else {
+    p << "never\n";
+  }
+  if (m_mode != ModeRtc) {
+    return p;
+  }
+  p << "               RTC  " << (m_rtcValid ? "valid" : "invalid") << ", " << m_rtc.getErrors() << " bus errors\n"
+    << "             drift  ";
+  prtFmt(p, "%.2f ppm", m_settings.m_driftPpb / 1000.0) << " (" << m_settings.m_numEstimates << " estimates)\n";
+  return p
+    << "       last offset  " << m_stats.m_lastOffset << " s\n"
+    << "          RTC sets  " << m_stats.m_rtcSets << "\n";
 }
 
 String
-SystemTime::getTimeStr()
+SystemTime::getTimeStr() const
 {
-  switch (m_mode) {
-    case ModeNtp:
-      return m_ntpClient.getFormattedTime();
-      break;
-    case ModeRtc:
-      break;
-  }
-  return "<invalid system time mode>";
+  char buf[9];
+  snprintf(buf, sizeof(buf), "%02u:%02u:%02u", m_snapshot.m_hours, m_snapshot.m_minutes, m_snapshot.m_seconds);
+  return buf;
 }
 
-SystemTime systemTime;
+SystemTime systemTime(flashSettings.timeSettings, flashSettings.ntpSettings);
 
 
 SystemMode systemMode;
 
 class OnboardSensor:
-  public virtual Sensor
+  public virtual Sensor,
+  public Adc::Consumer
 {
 public:
   
-  static const unsigned int NumMeasurements = 8;
-  static const unsigned int MeasurementIntervalMs = 100;
-  
-  OnboardSensor(Adc::Channel channel)
+  OnboardSensor(Adc::Channel channel, Calibration::Table& calibration)
     : m_adcChannel(channel)
+    , m_calibration(calibration)
+    , m_reading{}
   {}
   virtual void begin()
   {
   }
-  virtual void enable()
+  virtual void enable(Priority priority)
   {
     switch (getState()) {
       case StateIdle:
-        m_result = 0;
-        m_index = 0;
-        if (adc.request(m_adcChannel)) {
+        m_priority = priority;
+        if (adc.enqueue(m_adcChannel, m_priority, *this)) {
           setState(StateConvert);
         } else {
           setState(StatePrepare);
@@ -154,24 +268,31 @@ public:
   {
     switch (getState()) {
       case StateIdle:
-      case StatePrepare:
         break;
+      case StatePrepare:
       case StateConvert:
       case StateReady:
-        adc.reset();
+        adc.cancel(*this);
         setState(StateIdle);
         break;
     }
   }
   virtual uint8_t read()
   {
-    uint16_t v = m_result >> 2;
-
-    /* Clip and invert */
-    v = v > 255 ? 255 : v;
-    v = 255 - v;
-
-    return v;
+    return m_calibration.apply(readRaw());
+  }
+  virtual uint16_t readRaw()
+  {
+    return m_reading.m_raw;
+  }
+  virtual bool getNoise(Noise& noise) const
+  {
+    noise = m_reading.m_noise;
+    return true;
+  }
+  virtual Calibration* getCalibration()
+  {
+    return &m_calibration;
   }
   virtual void run()
   {
@@ -179,53 +300,144 @@ public:
       case StateIdle:
         break;
       case StatePrepare:
-        if (adc.request(m_adcChannel)) {
+        /* ADC request queue was full */
+        if (adc.enqueue(m_adcChannel, m_priority, *this)) {
+          setState(StateConvert);
+        }
+        break;
+      case StateConvert:
+      case StateReady:
+        break;
+    }
+  }
+  virtual void adcDone(Adc::Channel channel, const Adc::Reading& reading)
+  {
+    if (getState() != StateConvert) {
+      return;
+    }
+    m_reading = reading;
+    setState(StateReady);
+  }
+private:
+  Adc::Channel m_adcChannel;
+  Calibration m_calibration;
+  Adc::Reading m_reading;
+  Priority m_priority;
+};
+
+/** Sensor connected to an input of the external ADS1115 */
+class ExternalSensor:
+  public virtual Sensor,
+  public Ads1115::Consumer
+{
+public:
+  /** A reading fails if the converter doesn't deliver within this time */
+  static const unsigned int TimeoutMs = 10000;
+
+  ExternalSensor(uint8_t channel, Calibration::Table& calibration)
+    : m_channel(channel)
+    , m_calibration(calibration)
+    , m_reading{}
+    , m_valid(false)
+    , m_timeout()
+  {}
+  virtual void begin()
+  {
+  }
+  virtual void enable(Priority priority)
+  {
+    switch (getState()) {
+      case StateIdle:
+        m_valid = false;
+        m_timeout.start(Duration::fromMs(TimeoutMs));
+        if (ads1115.enqueue(m_channel, *this)) {
           setState(StateConvert);
         } else {
           setState(StatePrepare);
         }
         break;
-
-      /* TODO: we should make this part of the Adc class */
+      case StatePrepare:
+      case StateConvert:
+      case StateReady:
+        break;
+    }
+  }
+  virtual void disable()
+  {
+    switch (getState()) {
+      case StateIdle:
+        break;
+      case StatePrepare:
+      case StateConvert:
+      case StateReady:
+        ads1115.cancel(*this);
+        m_timeout.stop();
+        setState(StateIdle);
+        break;
+    }
+  }
+  virtual uint8_t read()
+  {
+    return m_calibration.apply(readRaw());
+  }
+  virtual uint16_t readRaw()
+  {
+    return m_reading.m_raw;
+  }
+  virtual bool isValid() const
+  {
+    return m_valid;
+  }
+  virtual bool getNoise(Noise& noise) const
+  {
+    noise = m_reading.m_noise;
+    return m_valid;
+  }
+  virtual Calibration* getCalibration()
+  {
+    return &m_calibration;
+  }
+  virtual void run()
+  {
+    switch (getState()) {
+      case StateIdle:
+        break;
+      case StatePrepare:
+        /* converter absent or not responding */
+        if (ads1115.enqueue(m_channel, *this)) {
+          setState(StateConvert);
+          break;
+        }
+        /* fall through */
       case StateConvert:
-          if (adc.isReady()) {
-            
-            if (m_index == 0) {
-              
-              /* nothing */
-              
-            } else if (m_index < NumMeasurements) {
-            
-              if (millis() - m_millsPrevMeasurement < MeasurementIntervalMs) {
-                break;
-              }
-              
-            } else {
-              m_result /= NumMeasurements;
-              setState(StateReady);
-              break;
-            }
-
-            Debug << "sensor " << m_adcChannel << ", iteration " << m_index << ": ";
-            
-            m_millsPrevMeasurement = millis();
-            auto v = adc.read();
-            m_result += v;
-            m_index++;
-
-            Debug << v << ", " << m_result / m_index << "\n";
-
-          }
+        if (m_timeout.expired()) {
+          ads1115.cancel(*this);
+          m_timeout.stop();
+          Error << "external sensor " << m_channel + 1 << ": no reading from the ADS1115 within " << TimeoutMs << " ms\n";
+          /* consumers check isValid() */
+          setState(StateReady);
+        }
         break;
       case StateReady:
         break;
     }
   }
+  virtual void ads1115Done(uint8_t channel, const Ads1115::Reading& reading)
+  {
+    if (getState() != StateConvert) {
+      return;
+    }
+    m_reading = reading;
+    m_valid = true;
+    m_timeout.stop();
+    setState(StateReady);
+  }
 private:
-  Adc::Channel m_adcChannel;
-  uint32_t m_result;
-  uint8_t m_index;
-  unsigned long m_millsPrevMeasurement;
+  uint8_t m_channel;
+  Calibration m_calibration;
+  Ads1115::Reading m_reading;
+  bool m_valid;
+  Deadline m_timeout;
 };
 
 /** 
@@ -235,52 +447,71 @@ class OnboardPump:
   public Pump
 {
 public:
+  /** The pumps are numbered in the order they are constructed in, which
+   *  is their position in the pumps array
+   */
+  OnboardPump()
+    : m_index(s_numPumps++)
+  {}
   virtual void begin()
   {
+    uint32_t seconds;
+    if (kvStore.get(KvStore::KeyPumpSeconds + m_index, &seconds, sizeof(seconds))) {
+      setPreviousSeconds(seconds);
+    }
   }
   virtual void enable()
   {
-    if (isEnabled()) {
-      return;
-    }
-    spi.setPump(true);
+    bool wasEnabled = isEnabled();
     Pump::enable();
-    Debug << "onboard pump enabled\n";
+    if (not wasEnabled) {
+      spi.setPump(m_index, true);
+      Debug << "onboard pump " << m_index + 1 << " enabled\n";
+    }
   }
   virtual void disable()
   {
     if (not isEnabled()) {
       return;
     }
-    spi.setPump(false);
     Pump::disable();
-    Debug << "onboard pump disabled\n";
+    if (not isEnabled()) {
+      spi.setPump(m_index, false);
+      Debug << "onboard pump " << m_index + 1 << " disabled\n";
+      uint32_t seconds = getLifetimeSeconds();
+      kvStore.set(KvStore::KeyPumpSeconds + m_index, &seconds, sizeof(seconds));
+    }
   }
+private:
+  static unsigned int s_numPumps;
+  unsigned int m_index;
 };
 
+unsigned int OnboardPump::s_numPumps = 0;
+
 class OnboardValve
   : public Valve
 {
 public:
-  OnboardValve(Spi::Valve valve)
-    : m_valve(valve)
+  OnboardValve(unsigned int index)
+    : m_index(index)
   {}
   virtual void begin() {}
   virtual void open()
   {
-    spi.setValve(m_valve);
+    spi.setValve(m_index, true);
   }
   virtual void close()
   {
-    spi.setValve(Spi::ValveNone);
+    spi.setValve(m_index, false);
   }
   virtual bool isOpen() const
   {
-    return (static_cast<uint8_t>(spi.getValve()) & static_cast<uint8_t>(m_valve)) != 0;
+    return (spi.getValve() & Spi::valveBit(m_index)) != 0;
   }
 
 private:
-  Spi::Valve m_valve;
+  unsigned int m_index;
 };
 
 class TheWaterCircuit
@@ -308,58 +539,40 @@ protected:
  * 67.55
  */
 
-OnboardPump pump;
+PowerBudget powerBudget(flashSettings.powerBudget);
 
-OnboardSensor sensor0(Adc::ChSensor1);
-OnboardSensor sensor1(Adc::ChSensor2);
-OnboardSensor sensor2(Adc::ChSensor3);
-OnboardSensor sensor3(Adc::ChSensor4);
-OnboardSensor reservoir(Adc::ChReservoir);
+OnboardPump pumps[NumPumps];
 
-OnboardValve valve0(Spi::Valve1);
-OnboardValve valve1(Spi::Valve2);
-OnboardValve valve2(Spi::Valve3);
-OnboardValve valve3(Spi::Valve4);
+Pump& getPump(unsigned int index)
+{
+  return pumps[index];
+}
 
-TheWaterCircuit circuit0(0, sensor0, valve0, pump, reservoir, flashSettings.waterCircuitSettings[0]);
-TheWaterCircuit circuit1(1, sensor1, valve1, pump, reservoir, flashSettings.waterCircuitSettings[1]);
-TheWaterCircuit circuit2(2, sensor2, valve2, pump, reservoir, flashSettings.waterCircuitSettings[2]);
-TheWaterCircuit circuit3(3, sensor3, valve3, pump, reservoir, flashSettings.waterCircuitSettings[3]);
+OnboardSensor sensor0(Adc::ChSensor1, flashSettings.sensorCalibrations[0]);
+OnboardSensor sensor1(Adc::ChSensor2, flashSettings.sensorCalibrations[1]);
+OnboardSensor sensor2(Adc::ChSensor3, flashSettings.sensorCalibrations[2]);
+OnboardSensor sensor3(Adc::ChSensor4, flashSettings.sensorCalibrations[3]);
+OnboardSensor reservoir(Adc::ChReservoir, flashSettings.sensorCalibrations[NumWaterCircuits]);
 
-WaterCircuit* circuits[NumWaterCircuits + 1] = {&circuit0, &circuit1, &circuit2, &circuit3, NULL};
+ExternalSensor externalSensor0(0, flashSettings.sensorCalibrations[0]);
+ExternalSensor externalSensor1(1, flashSettings.sensorCalibrations[1]);
+ExternalSensor externalSensor2(2, flashSettings.sensorCalibrations[2]);
+ExternalSensor externalSensor3(3, flashSettings.sensorCalibrations[3]);
 
+/* The circuits don't care where their sensor is connected to */
+#define CircuitSensor(i) (UseExternalAdc ? static_cast<Sensor&>(externalSensor##i) : static_cast<Sensor&>(sensor##i))
 
-SchedulerTime schedulerTime0(flashSettings.schedulerTimes[0]);
-SchedulerTime schedulerTime1(flashSettings.schedulerTimes[1]);
-SchedulerTime schedulerTime2(flashSettings.schedulerTimes[2]);
-SchedulerTime schedulerTime3(flashSettings.schedulerTimes[3]);
-SchedulerTime schedulerTime4(flashSettings.schedulerTimes[4]);
-SchedulerTime schedulerTime5(flashSettings.schedulerTimes[5]);
-SchedulerTime schedulerTime6(flashSettings.schedulerTimes[6]);
-SchedulerTime schedulerTime7(flashSettings.schedulerTimes[7]);
+OnboardValve valve0(0);
+OnboardValve valve1(1);
+OnboardValve valve2(2);
+OnboardValve valve3(3);
 
-SchedulerTime* schedulerTimes[NumSchedulerTimes + 1] =
-{
-  &schedulerTime0,
-  &schedulerTime1,
-  &schedulerTime2,
-  &schedulerTime3,
-  &schedulerTime4,
-  &schedulerTime5,
-  &schedulerTime6,
-  &schedulerTime7,
-  NULL
-};
+TheWaterCircuit circuit0(0, CircuitSensor(0), valve0, pumps[circuitPump(0)], reservoir, flashSettings.waterCircuitSettings[0], powerBudget);
+TheWaterCircuit circuit1(1, CircuitSensor(1), valve1, pumps[circuitPump(1)], reservoir, flashSettings.waterCircuitSettings[1], powerBudget);
+TheWaterCircuit circuit2(2, CircuitSensor(2), valve2, pumps[circuitPump(2)], reservoir, flashSettings.waterCircuitSettings[2], powerBudget);
+TheWaterCircuit circuit3(3, CircuitSensor(3), valve3, pumps[circuitPump(3)], reservoir, flashSettings.waterCircuitSettings[3], powerBudget);
 
-bool wateringDue()
-{
-  for (SchedulerTime** t = schedulerTimes; *t; t++) {
-    if ((*t)->isDue()) {
-      return true;
-    }
-  }
-  return false;
-}
+WaterCircuit* circuits[NumWaterCircuits + 1] = {&circuit0, &circuit1, &circuit2, &circuit3, NULL};
 
 
 ThingSpeakLogger thingSpeakLogger0(circuit0, flashSettings.thingSpeakLoggerSettings[0]);
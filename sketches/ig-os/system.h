@@ -4,18 +4,24 @@
 #include "config.h"
 #include "circuit.h"
 #include "log.h"
+#include "i2c.h"
+#include "rtc.h"
+#include "ntp.h"
 
 #include <climits>
 
-/* For more info see:
- *  
- * https://github.com/arduino-libraries/NTPClient
- * https://github.com/arduino-libraries/NTPClient/blob/master/NTPClient.h
- */
-#include <NTPClient.h>
-#include <WiFiUdp.h>
-
 
+/** System time from NTP and an optional battery backed RTC.
+ *
+ * If an RTC is fitted (ModeRtc) the time is valid right at boot. While NTP
+ * is synchronized it is the time source and periodically disciplines the
+ * RTC: the RTC is set to the NTP time and on the next discipline, at least
+ * DisciplineSeconds later, the offset it accumulated yields its drift,
+ * which is averaged over several discipline intervals. When NTP is lost
+ * the RTC, corrected by the estimated drift, takes over.
+ *
+ * Without RTC (ModeNtp) the time is valid after the first NTP update.
+ */
 class SystemTime
 {
 public:
@@ -24,24 +30,125 @@ public:
     ModeNtp,
     ModeRtc,
   } Mode;
-  
-  SystemTime();
+
+  /** Minimum time between two drift estimates. The RTC has a resolution
+   *  of one second, a day limits the error of a single estimate to 12 ppm.
+   */
+  static const unsigned long DisciplineSeconds = 24UL * 60 * 60;
+  /** The RTC is set without estimating the drift if it is off by more */
+  static const long MaxRtcOffsetSeconds = 10;
+  /** How long NTP remains the time source after its last update if an RTC is fitted */
+  static const unsigned long NtpHoldoverMs = 60UL * 60 * 1000;
+  /** The RTC is read at this interval and extrapolated with the monotonic clock in between */
+  static const unsigned long RtcReadIntervalMs = 10UL * 60 * 1000;
+  /** Drift estimates are limited to +/- 500 ppm */
+  static const int32_t MaxDriftPpb = 500000;
+
+  struct Settings
+  {
+    /** Estimated RTC drift in parts per billion, positive if it runs fast */
+    int32_t m_driftPpb;
+    /** Epoch when the RTC was set last, 0 if never */
+    uint32_t m_rtcSetEpoch;
+    /** Number of drift estimates averaged so far, saturating */
+    uint8_t m_numEstimates;
+  };
+
+  struct Stats
+  {
+    uint16_t m_rtcSets;
+    uint16_t m_estimates;
+    /** Corrected RTC minus NTP time at the last discipline */
+    int32_t m_lastOffset;
+    Instant m_lastNtp;
+  };
+
+  typedef enum
+  {
+    SourceNone = 0,
+    SourceNtp,
+    SourceRtc,
+  } Source;
+
+  /** The time as of the last run(). It changes once per second such that
+   *  all readers within one pass of the main loop see the same time.
+   */
+  struct Snapshot
+  {
+    unsigned long m_epoch;
+    uint8_t m_hours;
+    uint8_t m_minutes;
+    uint8_t m_seconds;
+    /** 0 Sunday, 1 Monday, ... */
+    uint8_t m_weekday;
+    /** The time has been set */
+    bool m_valid;
+    Source m_source;
+  };
+
+  SystemTime(Settings& settings, NtpClient::Settings& ntpSettings);
   void begin();
   void run();
 
-  uint8_t getDay();
-  uint8_t getHours();
-  uint8_t getMinutes();
-  uint8_t getSeconds();
+  Mode getMode() const
+  {
+    return m_mode;
+  }
+  NtpClient& getNtpClient()
+  {
+    return m_ntpClient;
+  }
+  Print& prt(Print& p) const;
+
+  const Snapshot& getSnapshot() const
+  {
+    return m_snapshot;
+  }
+
+  uint8_t getDay() const       { return m_snapshot.m_weekday; }
+  uint8_t getHours() const     { return m_snapshot.m_hours; }
+  uint8_t getMinutes() const   { return m_snapshot.m_minutes; }
+  uint8_t getSeconds() const   { return m_snapshot.m_seconds; }
+  unsigned long getEpoch() const { return m_snapshot.m_epoch; }
+  /** Returns true once the time has been set */
+  bool isValid() const         { return m_snapshot.m_valid; }
 
-  unsigned long getEpoch();
+  String getTimeStr() const;
+
+  static const char* getSourceString(Source source)
+  {
+    return (source == SourceNtp ? "NTP" :
+           (source == SourceRtc ? "RTC" :
+                                  "none"));
+  }
 
-  String getTimeStr();
 private:
-  NTPClient m_ntpClient;
-  WiFiUDP m_ntpUDP;
+  /** Selects the time source and reads the epoch from it */
+  unsigned long readEpoch(Source& source);
+  /** RTC time extrapolated since the last read, corrected by the drift. Returns 0 if the RTC isn't valid. */
+  unsigned long rtcEpoch();
+  unsigned long correctDrift(unsigned long raw) const;
+  void discipline(unsigned long ntp);
+  void setRtc(unsigned long epoch);
+  void updateSnapshot(unsigned long epoch, Source source);
+
+  Settings& m_settings;
+
+  NtpClient m_ntpClient;
+  Ds1307 m_rtc;
 
   Mode m_mode;
+  /** Number of NTP updates already handled */
+  uint32_t m_ntpSyncs;
+  bool m_rtcValid;
+  unsigned long m_rtcRaw;
+  Instant m_rtcRead;
+  /** Earliest time of the next discipline, unarmed before the first */
+  Deadline m_nextDiscipline;
+  /** Set the RTC on the next NTP second boundary */
+  bool m_rtcSetPending;
+  Snapshot m_snapshot;
+  Stats m_stats;
 };
 
 extern SystemTime systemTime;
@@ -96,81 +203,10 @@ extern SystemMode systemMode;
 
 
 extern WaterCircuit* circuits[NumWaterCircuits + 1];
+/** Pumps are shared by circuits, see circuitPump() */
+Pump& getPump(unsigned int index);
+extern PowerBudget powerBudget;
 
-class SchedulerTime
-{
-public:
-  static const uint8_t InvalidDay = UINT8_MAX;
-  static const uint8_t InvalidHour = UINT8_MAX;
-  
-  struct Time
-  {
-    uint8_t  m_hour;
-    uint8_t  m_minute;
-  };
-/*  
-  SchedulerTime()
-    : m_dayDone(InvalidDay)
-    , m_time({InvalidHour, 0})
-  {}
-  SchedulerTime(uint8_t hour,
-                uint8_t minute)
-    : m_dayDone(InvalidDay)
-    , m_time({hour, minute})
-  { }
-*/
-  SchedulerTime(Time& t)
-    : m_dayDone(InvalidDay)
-    , m_time(t)
-  { }
-  uint8_t getHour() const { return m_time.m_hour; }
-  uint8_t getMinute() const { return m_time.m_minute; }
-
-  void setHour(uint8_t hour) { m_time.m_hour = hour; }
-  void setMinute(uint8_t minute) { m_time.m_minute = minute; }
-
-  /** Checks if due. If due it marks it with the day done and returns true. */
-  bool isDue()
-  {
-    if (not isValid()) {
-      return false;
-    }
-    
-    /* Check if we processed it already today */
-    if (m_dayDone == systemTime.getDay()) {
-      return false;
-    }
-
-    bool due =
-      systemTime.getDay()     != m_dayDone        and
-      systemTime.getHours()   == m_time.m_hour    and
-      systemTime.getMinutes() == m_time.m_minute;
-    
-    if (due) {
-      m_dayDone = systemTime.getDay();
-      Serial << "detected watering due at " << systemTime.getTimeStr() << "\n";
-    }
-    
-    return due;
-  }
-  void markDone()
-  {
-    m_dayDone = systemTime.getDay();
-  }
-  bool isValid() const
-  {
-    return m_time.m_hour <= 23;
-  }
-private:
-  /** 0 Sunday, 1 Monday, ... */
-  uint8_t  m_dayDone;
-  Time& m_time;
-};
-
-
-extern SchedulerTime* schedulerTimes[NumSchedulerTimes + 1];
-
-bool wateringDue();
 
 
 extern Logger* loggers[NumWaterCircuits + 1];
@@ -186,173 +222,6 @@ namespace history {
 } /* namespace history */
 
 
-#include <Wire.h>
-
-class I2cDevice
-{
-public:
-  struct Config
-  {
-    uint8_t m_type;
-    uint8_t m_address;
-  };
-  void begin(uint8_t address)
-  {
-    m_address = address;
-    Wire.begin();
-  }
-
-  uint8_t getDeviceAddress()
-  {
-    return m_address;
-  }
-private:
-  uint8_t m_address;
-};
-
-/**
- * Code mostly stolen and then modified from:
- * https://github.com/jlesech/Eeprom24C32_64/blob/master/Eeprom24C32_64.cpp
- */
-class I2cAt24Cxx
-  : public I2cDevice
-{
-public:
-  typedef uint16_t Address;
-  /** EEPROM page size (see datasheet)
-   */
-  static const uint16_t PageSize = 32;
-
-  /** Read buffer size in Wire library.
-   */
-  static const uint16_t WireReadBufferSize = BUFFER_LENGTH;
-
-  /** Wire write buffer length, Two bytes are reserved for address.
-   */
-  static const uint16_t WireWriteBufferSize = BUFFER_LENGTH - 2;
-
-  I2cAt24Cxx(size_t size = 4096)
-    : m_size(size)
-  { }
-  uint8_t readByte(Address address)
-  {
-      Wire.beginTransmission(getDeviceAddress());
-      Wire.write(address >> 8);
-      Wire.write(address & 0xFF);
-      Wire.endTransmission();
-      Wire.requestFrom(getDeviceAddress(), (uint8_t)1);
-      uint8_t data = 0;
-      if (Wire.available()) {
-          data = Wire.read();
-      }
-      return data;
-  }
-  void read(Address address, uint8_t* data, size_t count)
-  {
-    size_t nBuffers = count / WireReadBufferSize;
-    
-    for (; nBuffers; nBuffers--) {
-      
-        readBuffer(address, data, WireReadBufferSize);
-        
-        address += WireReadBufferSize;
-        data    += WireReadBufferSize;
-        count   -= WireReadBufferSize;
-    }
-
-    if (count) {
-      readBuffer(address, data, count);
-    }
-  }
-  void write(Address address, uint8_t data)
-  {
-    Wire.beginTransmission(getDeviceAddress());
-    Wire.write(address >> 8);
-    Wire.write(address & 0xFF);
-    Wire.write(data);
-    Wire.endTransmission();
-  }
-  void write(Address address, const uint8_t* data, size_t count)
-  {
-    // Write first page if not aligned.
-    size_t notAlignedLength = 0;
-    size_t pageOffset = address % PageSize;
-    
-    if (pageOffset > 0) {
-      
-        notAlignedLength = std::min(count, PageSize - pageOffset);
-        
-        writePage(address, data, notAlignedLength);
- 
-        address += notAlignedLength;
-        data    += notAlignedLength;
-        count   -= notAlignedLength;
-    }
-
-    if (count) {
-
-      size_t nPages = count / PageSize;
-      for (; nPages; nPages--) {
-        
-          writePage(address, data, PageSize);
-
-          address += PageSize;
-          data    += PageSize;
-          count   -= PageSize;
-      }
-
-      if (count) {
-          writePage(address, data, count);
-      }
-    }
-  }
-private:
-  void readBuffer(Address address, uint8_t* data, size_t count)
-  {
-    Wire.beginTransmission(getDeviceAddress());
-    Wire.write(address >> 8);
-    Wire.write(address & 0xFF);
-    Wire.endTransmission();
-    Wire.requestFrom(getDeviceAddress(), count);
-    for (; count; count--) {
-      if (Wire.available())
-      {
-          *data++ = Wire.read();
-      }
-    }
-  }
-  void writePage(Address address, const uint8_t* data, size_t count)
-  {
-    size_t nBuffers = count / WireWriteBufferSize;
-    for (; nBuffers; nBuffers--)
-    {
-        writeBuffer(address, data, WireWriteBufferSize);
-        
-        address += WireWriteBufferSize;
-        data    += WireWriteBufferSize;
-        count   -= WireWriteBufferSize;
-    }
-    if (count) {
-      writeBuffer(address, data, count);
-    }
-  }
-  void writeBuffer(Address address, const uint8_t* data, size_t count)
-  {
-      Wire.beginTransmission(getDeviceAddress());
-      Wire.write(address >> 8);
-      Wire.write(address & 0xFF);
-      for (; count; count--)
-      {
-          Wire.write(*data++);
-      }
-      Wire.endTransmission();
-      
-      // Write cycle time (tWR). See EEPROM memory datasheet for more details.
-      delay(10);
-  }
-  size_t m_size;
-};
-
 // DS1307RTC library
 // http://www.makeuseof.com/tag/how-and-why-to-add-a-real-time-clock-to-arduino/
 // use the library example!
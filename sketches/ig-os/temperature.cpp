@@ -0,0 +1,340 @@
+#include "temperature.h"
+#include "settings.h"
+
+OneWire oneWireBus(OneWirePin);
+Ds18x20Bus temperatureBus(oneWireBus, flashSettings.temperatureBus);
+
+Ds18x20Bus::Ds18x20Bus(OneWire& bus, Settings& settings)
+  : m_bus(bus)
+  , m_settings(settings)
+  , m_state(StateIdle)
+  , m_devices{}
+  , m_readIndex(0)
+  , m_pending(false)
+  , m_start()
+  , m_cycle(0)
+  , m_completedCycle(0)
+  , m_stats{}
+{ }
+
+void
+Ds18x20Bus::begin()
+{
+  Instant start = Instant::now();
+
+  if (m_settings.m_numRoms > MaxDevices) {
+    m_settings.m_numRoms = 0;
+  }
+  if (not m_settings.m_numRoms or not checkPresence()) {
+    unsigned int n = m_settings.m_numRoms;
+    search();
+    if (m_settings.m_numRoms != n) {
+      flashCommitter.markDirty();
+    }
+  }
+  setResolution(m_settings.m_resolution);
+
+  m_stats.m_bootMs = start.elapsed().toMs();
+}
+
+bool
+Ds18x20Bus::present(const uint8_t* address)
+{
+  /* A device answers a read of its scratchpad with a valid CRC. An idle
+   * bus reads all zeros which has a valid CRC too, hence the check for a
+   * non-zero CRC. The rare device with a zero CRC just causes a search.
+   */
+  uint8_t data[9];
+  if (not m_bus.reset()) {
+    return false;
+  }
+  m_bus.select(address);
+  m_bus.write(CmdReadScratchpad);
+  m_bus.read_bytes(data, sizeof(data));
+  return OneWire::crc8(data, 8) == data[8] and data[8] != 0;
+}
+
+bool
+Ds18x20Bus::checkPresence()
+{
+  bool all = true;
+  for (unsigned int i = 0; i < m_settings.m_numRoms; i++) {
+    m_devices[i].m_present = present(m_settings.m_roms[i].m_address);
+    if (not m_devices[i].m_present) {
+      Debug << "1-wire: device " << i + 1 << " missing\n";
+      all = false;
+    }
+  }
+  return all;
+}
+
+unsigned int
+Ds18x20Bus::search()
+{
+  m_stats.m_searches++;
+  for (unsigned int i = 0; i < m_settings.m_numRoms; i++) {
+    m_devices[i].m_present = false;
+  }
+
+  unsigned int found = 0;
+  uint8_t rom[8];
+  m_bus.reset_search();
+  while (m_bus.search(rom)) {
+    if (OneWire::crc8(rom, 7) != rom[7]) {
+      Debug << "1-wire: CRC of device address failed\n";
+      continue;
+    }
+    if (not isSupported(rom)) {
+      continue;
+    }
+    found++;
+
+    unsigned int i = 0;
+    for (; i < m_settings.m_numRoms; i++) {
+      if (memcmp(m_settings.m_roms[i].m_address, rom, sizeof(rom)) == 0) {
+        break;
+      }
+    }
+    if (i == m_settings.m_numRoms) {
+      if (i == MaxDevices) {
+        Debug << "1-wire: ROM map full\n";
+        continue;
+      }
+      Rom& r = m_settings.m_roms[m_settings.m_numRoms++];
+      memcpy(r.m_address, rom, sizeof(rom));
+      r.m_circuit = NoCircuit;
+      m_devices[i] = Device{};
+    }
+    m_devices[i].m_present = true;
+  }
+  /* a new search invalidates the read in progress */
+  m_readIndex = 0;
+  Debug << "1-wire: " << found << " temperature sensors found\n";
+  return found;
+}
+
+void
+Ds18x20Bus::assign(unsigned int index, uint8_t circuit)
+{
+  if (index >= m_settings.m_numRoms) {
+    return;
+  }
+  /* a circuit has at most one temperature sensor */
+  for (unsigned int i = 0; i < m_settings.m_numRoms; i++) {
+    if (circuit != NoCircuit and m_settings.m_roms[i].m_circuit == circuit) {
+      m_settings.m_roms[i].m_circuit = NoCircuit;
+    }
+  }
+  m_settings.m_roms[index].m_circuit = circuit;
+}
+
+void
+Ds18x20Bus::forgetMissing()
+{
+  unsigned int n = 0;
+  for (unsigned int i = 0; i < m_settings.m_numRoms; i++) {
+    if (m_devices[i].m_present) {
+      m_settings.m_roms[n] = m_settings.m_roms[i];
+      m_devices[n] = m_devices[i];
+      n++;
+    }
+  }
+  m_settings.m_numRoms = n;
+  m_readIndex = 0;
+}
+
+int
+Ds18x20Bus::findCircuit(uint8_t circuit) const
+{
+  for (unsigned int i = 0; i < m_settings.m_numRoms; i++) {
+    if (m_settings.m_roms[i].m_circuit == circuit) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void
+Ds18x20Bus::setResolution(uint8_t bits)
+{
+  bits = bits < MinResolution ? MinResolution : (bits > MaxResolution ? MaxResolution : bits);
+  m_settings.m_resolution = bits;
+
+  /* Broadcast to all devices: alarm thresholds (default values) and the
+   * configuration register. The DS18S20 has a fixed resolution and
+   * ignores the configuration byte.
+   */
+  m_bus.reset();
+  m_bus.skip();
+  m_bus.write(CmdWriteScratchpad);
+  m_bus.write(0x4b);
+  m_bus.write(0x46);
+  m_bus.write(((bits - MinResolution) << 5) | 0x1f);
+}
+
+uint32_t
+Ds18x20Bus::request()
+{
+  if (m_state == StateIdle) {
+    startConversion();
+    return m_cycle;
+  }
+  m_pending = true;
+  return m_cycle + 1;
+}
+
+void
+Ds18x20Bus::startConversion()
+{
+  m_pending = false;
+  m_cycle++;
+
+  m_bus.reset();
+  m_bus.skip();
+  /* keep the bus driven high for parasite powered devices */
+  m_bus.write(CmdConvert, 1);
+
+  m_start = Instant::now();
+  m_state = StateConvert;
+}
+
+unsigned int
+Ds18x20Bus::conversionMs() const
+{
+  /* the DS18S20 always takes the 12 bit conversion time */
+  for (unsigned int i = 0; i < m_settings.m_numRoms; i++) {
+    if (m_settings.m_roms[i].m_address[0] == FamilyDS18S20) {
+      return getConversionMs(MaxResolution);
+    }
+  }
+  return getConversionMs(m_settings.m_resolution);
+}
+
+void
+Ds18x20Bus::run()
+{
+  switch (m_state) {
+    case StateIdle:
+      break;
+
+    case StateConvert:
+      if (m_start.elapsed() >= Duration::fromMs(conversionMs())) {
+        m_readIndex = 0;
+        m_state = StateRead;
+      }
+      break;
+
+    case StateRead:
+      /* one device per pass keeps the loop latency low */
+      if (m_readIndex < m_settings.m_numRoms) {
+        unsigned int i = m_readIndex++;
+        Device& d = m_devices[i];
+        if (not d.m_present) {
+          /* don't waste bus time on missing devices */
+          d.m_valid = false;
+          break;
+        }
+        d.m_valid = readScratchpad(i);
+        if (not d.m_valid) {
+          d.m_crcErrors++;
+          m_stats.m_crcErrors++;
+        }
+        break;
+      }
+      m_stats.m_conversions++;
+      m_stats.m_lastReadMs = m_start.elapsed().toMs();
+      m_completedCycle = m_cycle;
+      m_state = StateIdle;
+      if (m_pending) {
+        startConversion();
+      }
+      break;
+  }
+}
+
+/**
+ *  Scratch pad layout:
+ *    BYTE 0  TEMPERATURE LSB
+ *    BYTE 1  TEMPERATURE MSB
+ *    BYTE 2  TH REGISTER OR USER BYTE 1*
+ *    BYTE 3  TL REGISTER OR USER BYTE 2*
+ *    BYTE 4  CONFIGURATION REGISTER (DS18B20) / RESERVED (DS18S20)
+ *    BYTE 5  RESERVED 
+ *    BYTE 6  RESERVED / COUNT REMAIN (DS18S20)
+ *    BYTE 7  RESERVED (10h) / COUNT PER C (DS18S20)
+ *    BYTE 8  CRC*
+ */
+bool
+Ds18x20Bus::readScratchpad(unsigned int index)
+{
+  Device& device = m_devices[index];
+  const uint8_t* address = m_settings.m_roms[index].m_address;
+  uint8_t data[9];
+
+  if (not m_bus.reset()) {
+    return false;
+  }
+  m_bus.select(address);
+  m_bus.write(CmdReadScratchpad);
+  m_bus.read_bytes(data, sizeof(data));
+
+  /* a device which doesn't answer reads all ones, a shorted bus all zeros with a valid CRC */
+  bool zeros = true;
+  for (unsigned int i = 0; i < sizeof(data); i++) {
+    zeros = zeros and data[i] == 0;
+  }
+  if (zeros or OneWire::crc8(data, 8) != data[8]) {
+    return false;
+  }
+
+  int16_t raw = (data[1] << 8) | data[0];
+  if (address[0] == FamilyDS18S20) {
+    /* 9 bit reading extended by the count remain register */
+    raw <<= 3;
+    if (data[7] == 0x10) {
+      raw = (raw & 0xfff0) + 12 - data[6];
+    }
+  } else {
+    /* undefined low bits at lower resolutions */
+    switch (data[4] & 0x60) {
+      case 0x00: raw &= ~7; break;
+      case 0x20: raw &= ~3; break;
+      case 0x40: raw &= ~1; break;
+      default: break;
+    }
+  }
+  device.m_temperature = raw;
+  return true;
+}
+
+Print&
+Ds18x20Bus::prt(Print& p) const
+{
+  p << "        resolution  " << m_settings.m_resolution << " bit (" << getConversionMs(m_settings.m_resolution) << " ms)\n"
+    << "       conversions  " << m_stats.m_conversions << "\n"
+    << "        CRC errors  " << m_stats.m_crcErrors << "\n"
+    << "      last reading  " << m_stats.m_lastReadMs << " ms\n"
+    << "          searches  " << m_stats.m_searches << "\n"
+    << "     boot discover  " << m_stats.m_bootMs << " ms\n";
+  for (unsigned int i = 0; i < m_settings.m_numRoms; i++) {
+    const Device& d = m_devices[i];
+    const Rom& r = m_settings.m_roms[i];
+    p << "  [" << i + 1 << "] ";
+    for (unsigned int j = 0; j < sizeof(r.m_address); j++) {
+      prtFmt(p, "%02x", r.m_address[j]);
+    }
+    p << " " << getFamilyString(r.m_address[0]) << "  ";
+    if (r.m_circuit != NoCircuit) {
+      p << "circuit " << r.m_circuit + 1 << "  ";
+    }
+    if (not d.m_present) {
+      p << "missing\n";
+    } else if (d.m_valid) {
+      unsigned int t = abs(d.m_temperature);
+      prtFmt(p, "%s%u.%02u", d.m_temperature < 0 ? "-" : "", t / 16, (t % 16) * 100 / 16) << " °C\n";
+    } else {
+      p << "no reading (" << d.m_crcErrors << " CRC errors)\n";
+    }
+  }
+  return p;
+}
@@ -0,0 +1,245 @@
+#ifndef EW_IG_TEMPERATURE_H
+#define EW_IG_TEMPERATURE_H
+
+/* 
+ *  http://playground.arduino.cc/Learning/OneWire
+ *  https://www.pjrc.com/teensy/td_libs_OneWire.html
+ *  https://datasheets.maximintegrated.com/en/ds/DS18B20.pdf
+ */
+
+#include "config.h"
+#include "circuit.h"
+
+#include <OneWire.h>
+
+extern OneWire oneWireBus;
+
+/** Driver for all DS18x20 temperature sensors on a 1-Wire bus.
+ *
+ * A conversion is started on all devices at once with a Skip-ROM "convert
+ * T" broadcast. The conversion time is waited for without blocking, then
+ * the scratchpads are read one device per run() pass and checked against
+ * their CRC. Requests arriving while a conversion is in progress are
+ * served by the following one.
+ *
+ * The ROM codes of all known devices are kept in the settings together
+ * with the circuit a device is assigned to. At boot the known devices are
+ * addressed directly and the bus is only searched if one of them doesn't
+ * respond.
+ */
+class Ds18x20Bus
+{
+public:
+  static const unsigned int MaxDevices = 8;
+  static const uint8_t MinResolution = 9;
+  static const uint8_t MaxResolution = 12;
+
+  typedef enum
+  {
+    FamilyDS18S20 = 0x10,
+    FamilyDS1822  = 0x22,
+    FamilyDS18B20 = 0x28,
+  } Family;
+
+  typedef enum
+  {
+    StateIdle = 0,
+    /** Waiting for the conversion time to pass */
+    StateConvert,
+    /** Reading the scratchpads */
+    StateRead,
+  } State;
+
+  static const uint8_t NoCircuit = 0xff;
+
+  struct Rom
+  {
+    uint8_t m_address[8];
+    /** Index of the circuit the device is assigned to or NoCircuit */
+    uint8_t m_circuit;
+  };
+
+  struct Settings
+  {
+    /** Conversion resolution in bits, range MinResolution .. MaxResolution */
+    uint8_t m_resolution;
+    uint8_t m_numRoms;
+    Rom m_roms[MaxDevices];
+  };
+
+  struct Device
+  {
+    /** The device answered the last presence check, search or read */
+    bool m_present;
+    /** Temperature in 1/16 degree Celsius */
+    int16_t m_temperature;
+    /** The last read succeeded */
+    bool m_valid;
+    uint16_t m_crcErrors;
+  };
+
+  struct Stats
+  {
+    uint32_t m_conversions;
+    uint32_t m_crcErrors;
+    uint16_t m_lastReadMs;
+    /** Bus searches, at boot only if a known device was missing */
+    uint16_t m_searches;
+    uint16_t m_bootMs;
+  };
+
+  Ds18x20Bus(OneWire& bus, Settings& settings);
+  void begin();
+  void run();
+
+  /** Searches the bus for devices, blocks while searching. New devices
+   *  are added to the ROM map. Returns the number of devices found.
+   */
+  unsigned int search();
+  /** Addresses all known devices, returns true if all of them are present */
+  bool checkPresence();
+  /** Assigns a device to a circuit, NoCircuit to remove the assignment */
+  void assign(unsigned int index, uint8_t circuit);
+  /** Removes devices which are not present from the ROM map */
+  void forgetMissing();
+  /** Returns the index of the device assigned to a circuit or -1 if none */
+  int findCircuit(uint8_t circuit) const;
+
+  /** Requests a conversion of all devices. Returns the number of the
+   *  conversion cycle which will deliver the readings.
+   */
+  uint32_t request();
+  /** Number of the last completed conversion cycle */
+  uint32_t getCompletedCycle() const
+  {
+    return m_completedCycle;
+  }
+
+  State getState() const
+  {
+    return m_state;
+  }
+  unsigned int getNumDevices() const
+  {
+    return m_settings.m_numRoms;
+  }
+  const Device& getDevice(unsigned int index) const
+  {
+    return m_devices[index];
+  }
+  const Rom& getRom(unsigned int index) const
+  {
+    return m_settings.m_roms[index];
+  }
+  uint8_t getResolution() const
+  {
+    return m_settings.m_resolution;
+  }
+  /** Sets the resolution of all devices */
+  void setResolution(uint8_t bits);
+  /** Conversion time for a resolution, 94 ms at 9 bit up to 750 ms at 12 bit */
+  static unsigned int getConversionMs(uint8_t resolution)
+  {
+    return 750 >> (MaxResolution - resolution);
+  }
+  static const char* getFamilyString(uint8_t family)
+  {
+    switch (family) {
+      case FamilyDS18S20: return "DS18S20";
+      case FamilyDS1822:  return "DS1822";
+      case FamilyDS18B20: return "DS18B20";
+      default:            return "unknown";
+    }
+  }
+  static bool isSupported(const uint8_t* rom)
+  {
+    return rom[0] == FamilyDS18S20 or rom[0] == FamilyDS1822 or rom[0] == FamilyDS18B20;
+  }
+  Print& prt(Print& p) const;
+
+private:
+  enum
+  {
+    CmdConvert         = 0x44,
+    CmdReadScratchpad  = 0xbe,
+    CmdWriteScratchpad = 0x4e,
+  };
+  void startConversion();
+  unsigned int conversionMs() const;
+  bool readScratchpad(unsigned int index);
+  bool present(const uint8_t* address);
+
+  OneWire& m_bus;
+  Settings& m_settings;
+  State m_state;
+  Device m_devices[MaxDevices];
+  uint8_t m_readIndex;
+  bool m_pending;
+  Instant m_start;
+  uint32_t m_cycle;
+  uint32_t m_completedCycle;
+  Stats m_stats;
+};
+
+extern Ds18x20Bus temperatureBus;
+
+/** Temperature of a single DS18x20 device.
+ *
+ * read() returns the temperature in degrees Celsius clamped to 0 .. 255,
+ * readRaw() the two's complement reading in 1/16 degrees Celsius. Enabling
+ * several sensors at the same time costs a single conversion.
+ */
+class TemperatureSensor
+  : public virtual Sensor
+{
+public:
+  TemperatureSensor(Ds18x20Bus& bus, unsigned int index)
+    : m_bus(bus)
+    , m_index(index)
+    , m_cycle(0)
+  { }
+  virtual void begin()
+  {
+  }
+  virtual void enable(Priority priority = PriorityNormal)
+  {
+    if (getState() == StateIdle) {
+      m_cycle = m_bus.request();
+      setState(StateConvert);
+    }
+  }
+  virtual void disable()
+  {
+    setState(StateIdle);
+  }
+  virtual uint8_t read()
+  {
+    int t = getTemperature() / 16;
+    return t < 0 ? 0 : (t > 255 ? 255 : t);
+  }
+  virtual uint16_t readRaw()
+  {
+    return static_cast<uint16_t>(getTemperature());
+  }
+  virtual void run()
+  {
+    if (getState() == StateConvert and (int32_t)(m_bus.getCompletedCycle() - m_cycle) >= 0) {
+      setState(StateReady);
+    }
+  }
+  /** Temperature in 1/16 degree Celsius */
+  int16_t getTemperature() const
+  {
+    return m_index < m_bus.getNumDevices() ? m_bus.getDevice(m_index).m_temperature : 0;
+  }
+  virtual bool isValid() const
+  {
+    return m_index < m_bus.getNumDevices() and m_bus.getDevice(m_index).m_valid;
+  }
+private:
+  Ds18x20Bus& m_bus;
+  unsigned int m_index;
+  uint32_t m_cycle;
+};
+
+#endif /* EW_IG_TEMPERATURE_H */
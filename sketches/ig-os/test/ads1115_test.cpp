@@ -0,0 +1,245 @@
+/* Host test of the ADS1115 driver against a simulated converter */
+
+#include "host.h"
+#include "ads1115.h"
+
+namespace {
+
+/** Simulated ADS1115 in continuous conversion mode. The first conversion
+ *  after switching the multiplexer still shows the previous input, like a
+ *  real converter whose input hasn't settled yet.
+ */
+class SimAds1115
+  : public WireDevice
+{
+public:
+  static const unsigned int usConversion = 4000;
+
+  SimAds1115()
+    : m_inputs{}
+    , m_configWrites(0)
+    , m_pointer(0)
+    , m_config(0x8583)
+    , m_conversion(0)
+    , m_lastInput(0)
+    , m_conversionStart(0)
+    , m_numConversions(0)
+  { }
+
+  virtual bool write(const uint8_t* data, size_t count)
+  {
+    if (count >= 1) {
+      m_pointer = data[0] & 0x03;
+    }
+    if (count == 3 and m_pointer == 1) {
+      update();
+      m_config = (data[1] << 8) | data[2];
+      m_conversionStart = micros64();
+      m_numConversions = 0;
+      m_configWrites++;
+    }
+    return true;
+  }
+  virtual size_t read(uint8_t* data, size_t count)
+  {
+    update();
+    uint16_t value = m_pointer == 0 ? m_conversion : m_config;
+    if (count >= 2) {
+      data[0] = value >> 8;
+      data[1] = value & 0xff;
+    }
+    return count < 2 ? count : 2;
+  }
+
+  uint8_t getChannel() const
+  {
+    return (m_config >> 12) & 0x03;
+  }
+
+  int16_t m_inputs[4];
+  unsigned int m_configWrites;
+
+private:
+  void update()
+  {
+    unsigned long done = (micros64() - m_conversionStart) / usConversion;
+    if (done == m_numConversions) {
+      return;
+    }
+    /* the first conversion on a new input still sees the old one */
+    m_conversion = m_numConversions == 0 and done == 1 ? m_lastInput : m_inputs[getChannel()];
+    m_lastInput = m_inputs[getChannel()];
+    m_numConversions = done;
+  }
+
+  uint8_t m_pointer;
+  uint16_t m_config;
+  int16_t m_conversion;
+  int16_t m_lastInput;
+  uint64_t m_conversionStart;
+  unsigned long m_numConversions;
+};
+
+class TestConsumer
+  : public Ads1115::Consumer
+{
+public:
+  TestConsumer(SimAds1115& sim)
+    : m_sim(sim)
+    , m_count(0)
+    , m_channel(0)
+    , m_reading{}
+    , m_channelWhenDone(0)
+  { }
+  virtual void ads1115Done(uint8_t channel, const Ads1115::Reading& reading)
+  {
+    m_count++;
+    m_channel = channel;
+    m_reading = reading;
+    m_channelWhenDone = m_sim.getChannel();
+  }
+
+  SimAds1115& m_sim;
+  unsigned int m_count;
+  uint8_t m_channel;
+  Ads1115::Reading m_reading;
+  /** Multiplexer of the converter when the reading was delivered */
+  uint8_t m_channelWhenDone;
+};
+
+/** Runs the driver until it is idle, returns false on timeout */
+bool
+runUntilIdle(Ads1115& ads)
+{
+  for (unsigned int i = 0; i < 100000 and ads.getState() != Ads1115::StateIdle; i++) {
+    advanceUs(100);
+    ads.run();
+  }
+  return ads.getState() == Ads1115::StateIdle;
+}
+
+void
+testScan()
+{
+  SimAds1115 sim;
+  Ads1115 ads(0x49);
+  TestConsumer consumer(sim);
+
+  /* nothing at the address */
+  CHECK(not ads.begin());
+  CHECK_EQUAL(ads.getState(), Ads1115::StateAbsent);
+  CHECK(not ads.enqueue(0, consumer));
+
+  Wire.attach(0x49, sim);
+  CHECK(ads.begin());
+  CHECK_EQUAL(ads.getState(), Ads1115::StateIdle);
+  CHECK(not ads.enqueue(Ads1115::NumChannels, consumer));
+  Wire.detach(0x49);
+}
+
+void
+testDiscard()
+{
+  SimAds1115 sim;
+  Ads1115 ads(0x48);
+  TestConsumer consumer(sim);
+  Wire.attach(0x48, sim);
+  ads.begin();
+
+  sim.m_inputs[0] = 30000;
+  sim.m_inputs[2] = 1000;
+  /* the converter ran on input 0 before */
+  sim.write((const uint8_t[]){0x01, 0x45, 0x83}, 3);
+  advanceUs(10000);
+
+  CHECK(ads.enqueue(2, consumer));
+  CHECK(runUntilIdle(ads));
+  CHECK_EQUAL(consumer.m_count, 1);
+  CHECK_EQUAL(consumer.m_channel, 2);
+  /* the stale sample of input 0 was discarded, 15 bit scaled to 16 bit */
+  CHECK_EQUAL(consumer.m_reading.m_raw, 2000);
+  CHECK_EQUAL(consumer.m_reading.m_noise.m_min, 2000);
+  CHECK_EQUAL(consumer.m_reading.m_noise.m_max, 2000);
+  CHECK_EQUAL(consumer.m_reading.m_noise.m_stdDev, 0);
+  CHECK_EQUAL(consumer.m_reading.m_noise.m_numSamples, Ads1115::SamplesPerReading);
+  CHECK_EQUAL(ads.getStats().m_switches, 1);
+  CHECK_EQUAL(ads.getStats().m_conversions, Ads1115::SamplesPerReading + Ads1115::SamplesDiscarded);
+
+  /* the same channel again doesn't switch and doesn't discard */
+  ads.clearStats();
+  unsigned int writes = sim.m_configWrites;
+  CHECK(ads.enqueue(2, consumer));
+  CHECK(runUntilIdle(ads));
+  CHECK_EQUAL(consumer.m_count, 2);
+  CHECK_EQUAL(sim.m_configWrites, writes);
+  CHECK_EQUAL(ads.getStats().m_switches, 0);
+  CHECK_EQUAL(ads.getStats().m_conversions, Ads1115::SamplesPerReading);
+
+  /* negative offsets are clamped */
+  sim.m_inputs[2] = -5;
+  CHECK(ads.enqueue(2, consumer));
+  CHECK(runUntilIdle(ads));
+  CHECK_EQUAL(consumer.m_reading.m_raw, 0);
+  Wire.detach(0x48);
+}
+
+void
+testChannelSwitch()
+{
+  SimAds1115 sim;
+  Ads1115 ads(0x48);
+  TestConsumer a(sim), b(sim);
+  Wire.attach(0x48, sim);
+  ads.begin();
+
+  sim.m_inputs[0] = 100;
+  sim.m_inputs[3] = 200;
+  CHECK(ads.enqueue(0, a));
+  CHECK(ads.enqueue(3, b));
+  /* a channel has one consumer only */
+  CHECK(not ads.enqueue(3, a));
+  CHECK(runUntilIdle(ads));
+
+  CHECK_EQUAL(a.m_count, 1);
+  CHECK_EQUAL(a.m_reading.m_raw, 200);
+  CHECK_EQUAL(b.m_count, 1);
+  CHECK_EQUAL(b.m_reading.m_raw, 400);
+  /* the next channel is converting before the finished one is delivered */
+  CHECK_EQUAL(a.m_channelWhenDone, 3);
+  CHECK_EQUAL(ads.getStats().m_switches, 2);
+  CHECK_EQUAL(ads.getStats().m_readings, 2);
+
+  /* a cancelled request is not delivered and frees the channel */
+  CHECK(ads.enqueue(1, a));
+  CHECK(ads.enqueue(2, b));
+  ads.cancel(b);
+  CHECK(runUntilIdle(ads));
+  CHECK_EQUAL(a.m_count, 2);
+  CHECK_EQUAL(a.m_channel, 1);
+  CHECK_EQUAL(b.m_count, 1);
+  CHECK(ads.enqueue(2, a));
+  ads.cancel(a);
+  CHECK_EQUAL(ads.getState(), Ads1115::StateIdle);
+
+  /* a converter gone missing counts errors instead of delivering garbage */
+  CHECK(ads.enqueue(0, a));
+  Wire.detach(0x48);
+  for (unsigned int i = 0; i < 100; i++) {
+    advanceUs(5000);
+    ads.run();
+  }
+  CHECK_EQUAL(a.m_count, 2);
+  CHECK(ads.getStats().m_errors > 0);
+  ads.cancel(a);
+}
+
+} /* namespace */
+
+int
+main()
+{
+  testScan();
+  testDiscard();
+  testChannelSwitch();
+  return report("ads1115");
+}
@@ -0,0 +1,74 @@
+#ifndef EW_IG_TEST_AT24C32_H
+#define EW_IG_TEST_AT24C32_H
+
+#include "host.h"
+
+#include <Wire.h>
+
+/** Simulated AT24C32 EEPROM.
+ *
+ * Writes program the page the address points to, wrapping within the
+ * page like the chip does. While the write cycle runs the chip doesn't
+ * acknowledge its address. Reads continue the address counter, which
+ * rolls over at the end of the chip.
+ */
+class SimAt24c32
+  : public WireDevice
+{
+public:
+  static const unsigned int Size = 4096;
+  static const unsigned int PageSize = 32;
+  static const unsigned int usWriteCycle = 5000;
+
+  SimAt24c32()
+    : m_memory{}
+    , m_counter(0)
+    , m_cycleEnd(0)
+    , m_pageWrites(0)
+  { }
+
+  virtual bool write(const uint8_t* data, size_t count)
+  {
+    if (isBusy()) {
+      return false;
+    }
+    if (count < 2) {
+      /* address probe or ACK poll */
+      return true;
+    }
+    m_counter = ((data[0] << 8) | data[1]) % Size;
+    if (count == 2) {
+      return true;
+    }
+    unsigned int page = m_counter - m_counter % PageSize;
+    for (size_t i = 2; i < count; i++) {
+      m_memory[page + (m_counter + i - 2) % PageSize] = data[i];
+    }
+    m_counter = page + (m_counter + count - 2) % PageSize;
+    m_cycleEnd = micros64() + usWriteCycle;
+    m_pageWrites++;
+    return true;
+  }
+  virtual size_t read(uint8_t* data, size_t count)
+  {
+    if (isBusy()) {
+      return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+      data[i] = m_memory[m_counter];
+      m_counter = (m_counter + 1) % Size;
+    }
+    return count;
+  }
+  bool isBusy() const
+  {
+    return micros64() < m_cycleEnd;
+  }
+
+  uint8_t m_memory[Size];
+  unsigned int m_counter;
+  uint64_t m_cycleEnd;
+  unsigned long m_pageWrites;
+};
+
+#endif /* EW_IG_TEST_AT24C32_H */
@@ -0,0 +1,103 @@
+/* Host test of the power budget with several pumps.
+ *
+ * Every pump holds its own current while it runs, no matter in which
+ * order the circuits sharing it start and stop.
+ */
+
+#include "host.h"
+#include "circuit.h"
+
+namespace {
+
+PowerBudget::Settings settings = {1300, 500, 150};
+
+/** Two circuits on one pump, the second one to stop releases the pump */
+void
+testSharedPump()
+{
+  PowerBudget budget(settings);
+  Pump pump;
+
+  CHECK(budget.acquire(150, &pump));
+  pump.enable();
+  CHECK_EQUAL(budget.getUsedMa(), 650);
+  CHECK(budget.acquire(150, &pump));
+  pump.enable();
+  CHECK_EQUAL(budget.getUsedMa(), 800);
+
+  pump.disable();
+  budget.release(150, &pump);
+  CHECK_EQUAL(budget.getUsedMa(), 650);
+  pump.disable();
+  budget.release(150, &pump);
+  CHECK_EQUAL(budget.getUsedMa(), 0);
+}
+
+/** Two pumps interleaved, each releases exactly its own current */
+void
+testTwoPumps()
+{
+  PowerBudget budget(settings);
+  Pump pump1, pump2;
+
+  CHECK(budget.acquire(150, &pump1));
+  pump1.enable();
+  CHECK(budget.acquire(150, &pump2));
+  pump2.enable();
+  CHECK_EQUAL(budget.getUsedMa(), 1300);
+
+  /* a third valve on a running pump doesn't fit anymore */
+  CHECK(not budget.acquire(150, &pump1));
+  CHECK_EQUAL(budget.getUsedMa(), 1300);
+
+  /* the pump current changed while running, the held current is released */
+  budget.setPumpMa(400);
+  pump1.disable();
+  budget.release(150, &pump1);
+  CHECK_EQUAL(budget.getUsedMa(), 650);
+  pump2.disable();
+  budget.release(150, &pump2);
+  CHECK_EQUAL(budget.getUsedMa(), 0);
+
+  /* releasing again doesn't release the pump twice */
+  CHECK(budget.acquire(150, &pump1));
+  pump1.enable();
+  budget.release(0, &pump2);
+  CHECK_EQUAL(budget.getUsedMa(), 550);
+  pump1.disable();
+  budget.release(150, &pump1);
+  CHECK_EQUAL(budget.getUsedMa(), 0);
+  budget.setPumpMa(500);
+}
+
+/** A manual pump run on a pump a circuit is using costs nothing extra */
+void
+testManualRun()
+{
+  PowerBudget budget(settings);
+  Pump pump;
+
+  CHECK(budget.acquire(150, &pump));
+  pump.enable();
+  CHECK(budget.acquire(0, &pump));
+  pump.enable();
+  CHECK_EQUAL(budget.getUsedMa(), 650);
+  pump.disable();
+  budget.release(0, &pump);
+  CHECK_EQUAL(budget.getUsedMa(), 650);
+  pump.disable();
+  budget.release(150, &pump);
+  CHECK_EQUAL(budget.getUsedMa(), 0);
+}
+
+} /* namespace */
+
+int
+main()
+{
+  testSharedPump();
+  testTwoPumps();
+  testManualRun();
+
+  return report("budget_test");
+}
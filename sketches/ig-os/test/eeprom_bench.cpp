@@ -0,0 +1,205 @@
+/* Host benchmark of the EEPROM reads against a simulated AT24C32.
+ *
+ * The bus bytes of typical read patterns are compared between the read
+ * path of the original driver and the streaming, caching one. The bus
+ * time is estimated at 100 kHz.
+ */
+
+#include "host.h"
+#include "at24c32.h"
+#include "eeprom.h"
+
+namespace {
+
+/** The read path of the original driver: every Wire buffer sized chunk
+ *  sends the address, readByte() is a transaction of its own.
+ */
+class LegacyReader
+{
+public:
+  LegacyReader(uint8_t address)
+    : m_address(address)
+  { }
+  uint8_t readByte(uint16_t address)
+  {
+    uint8_t data = 0;
+    readBuffer(address, &data, 1);
+    return data;
+  }
+  void read(uint16_t address, uint8_t* data, size_t count)
+  {
+    while (count) {
+      size_t n = count < BUFFER_LENGTH ? count : BUFFER_LENGTH;
+      readBuffer(address, data, n);
+      address += n;
+      data    += n;
+      count   -= n;
+    }
+  }
+private:
+  void readBuffer(uint16_t address, uint8_t* data, size_t count)
+  {
+    Wire.beginTransmission(m_address);
+    Wire.write(address >> 8);
+    Wire.write(address & 0xFF);
+    Wire.endTransmission();
+    Wire.requestFrom(m_address, count);
+    for (size_t i = 0; i < count and Wire.available(); i++) {
+      *data++ = Wire.read();
+    }
+  }
+  uint8_t m_address;
+};
+
+uint8_t
+pattern(unsigned int address)
+{
+  return address * 13 + (address >> 8);
+}
+
+/** Checks the data read against the pattern */
+bool
+verify(unsigned int address, const uint8_t* data, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    if (data[i] != pattern(address + i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+struct Result
+{
+  unsigned long m_legacy;
+  unsigned long m_streaming;
+};
+
+void
+printResult(const char* name, const Result& r)
+{
+  printf("  %-34s %6lu -> %6lu bytes (%4lu -> %4lu ms)\n", name,
+         r.m_legacy, r.m_streaming, r.m_legacy * 90 / 1000, r.m_streaming * 90 / 1000);
+}
+
+/** Reads the whole chip in one go */
+Result
+benchBulk(LegacyReader& legacy)
+{
+  static uint8_t data[SimAt24c32::Size];
+  Result r;
+  unsigned long start = Wire.getBusBytes();
+  legacy.read(0, data, sizeof(data));
+  r.m_legacy = Wire.getBusBytes() - start;
+  CHECK(verify(0, data, sizeof(data)));
+
+  memset(data, 0, sizeof(data));
+  start = Wire.getBusBytes();
+  CHECK(eeprom.read(0, data, sizeof(data)));
+  r.m_streaming = Wire.getBusBytes() - start;
+  CHECK(verify(0, data, sizeof(data)));
+  return r;
+}
+
+/** Reads the chip in consecutive 1 KB blocks, e.g. scanning a log */
+Result
+benchConsecutive(LegacyReader& legacy)
+{
+  uint8_t data[1024];
+  Result r;
+  unsigned long start = Wire.getBusBytes();
+  for (unsigned int a = 0; a < SimAt24c32::Size; a += sizeof(data)) {
+    legacy.read(a, data, sizeof(data));
+  }
+  r.m_legacy = Wire.getBusBytes() - start;
+
+  start = Wire.getBusBytes();
+  for (unsigned int a = 0; a < SimAt24c32::Size; a += sizeof(data)) {
+    CHECK(eeprom.read(a, data, sizeof(data)));
+    CHECK(verify(a, data, sizeof(data)));
+  }
+  r.m_streaming = Wire.getBusBytes() - start;
+  return r;
+}
+
+/** Reads an 8 byte header byte by byte and a 16 byte index, 100 times */
+Result
+benchMetadata(LegacyReader& legacy)
+{
+  const unsigned int header = 0x0c00;
+  const unsigned int index = 0x0040;
+  uint8_t data[16];
+  Result r;
+  unsigned long start = Wire.getBusBytes();
+  for (unsigned int k = 0; k < 100; k++) {
+    for (unsigned int i = 0; i < 8; i++) {
+      data[i] = legacy.readByte(header + i);
+    }
+    legacy.read(index, data, sizeof(data));
+  }
+  r.m_legacy = Wire.getBusBytes() - start;
+
+  eeprom.invalidateCache();
+  start = Wire.getBusBytes();
+  for (unsigned int k = 0; k < 100; k++) {
+    for (unsigned int i = 0; i < 8; i++) {
+      data[i] = eeprom.readByte(header + i);
+    }
+    CHECK(verify(header, data, 8));
+    CHECK(eeprom.read(index, data, sizeof(data)));
+    CHECK(verify(index, data, sizeof(data)));
+  }
+  r.m_streaming = Wire.getBusBytes() - start;
+  return r;
+}
+
+/** Reads see queued writes before and after they reached the chip */
+void
+checkReadYourWrites(SimAt24c32& chip)
+{
+  uint8_t data[16];
+  const uint8_t written[] = {1, 2, 3, 4};
+  CHECK(eeprom.read(64, data, sizeof(data)));
+  CHECK(eeprom.enqueue(66, written, sizeof(written)));
+  CHECK(eeprom.read(64, data, sizeof(data)));
+  CHECK(memcmp(data + 2, written, sizeof(written)) == 0);
+  CHECK(chip.m_memory[66] != 1);
+
+  CHECK(eeprom.flush());
+  CHECK(memcmp(chip.m_memory + 66, written, sizeof(written)) == 0);
+  eeprom.invalidateCache();
+  CHECK(eeprom.read(64, data, sizeof(data)));
+  CHECK(memcmp(data + 2, written, sizeof(written)) == 0);
+  CHECK(verify(64, data, 2));
+}
+
+} /* namespace */
+
+int
+main()
+{
+  SimAt24c32 chip;
+  for (unsigned int i = 0; i < SimAt24c32::Size; i++) {
+    chip.m_memory[i] = pattern(i);
+  }
+  Wire.attach(EepromAddress, chip);
+  CHECK(eeprom.begin());
+  LegacyReader legacy(EepromAddress);
+
+  printf("bus bytes and time at 100 kHz, Wire buffer %u bytes, original -> streaming\n", BUFFER_LENGTH);
+  Result r = benchBulk(legacy);
+  printResult("4 KB bulk read", r);
+  CHECK(r.m_streaming < r.m_legacy);
+  r = benchConsecutive(legacy);
+  printResult("4 consecutive 1 KB reads", r);
+  CHECK(r.m_streaming < r.m_legacy);
+  r = benchMetadata(legacy);
+  printResult("100 x (8 readByte + 16 byte read)", r);
+  CHECK(r.m_streaming * 10 < r.m_legacy);
+
+  const I2cAt24Cxx::Stats& s = eeprom.getStats();
+  printf("  cache %u hits, %u misses, %u addressed transactions\n", s.m_cacheHits, s.m_cacheMisses, s.m_addressed);
+
+  checkReadYourWrites(chip);
+  return report("eeprom_bench");
+}
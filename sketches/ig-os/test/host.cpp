@@ -0,0 +1,180 @@
+#include "host.h"
+#include "config.h"
+#include "clock.h"
+
+#include <Wire.h>
+
+HardwareSerial Serial;
+TwoWire Wire;
+
+LogProxy<MaxTelnetClients> Log;
+LogProxy<MaxTelnetClients> Debug(false);
+ErrorLogProxy Error;
+
+namespace {
+
+uint64_t s_now = 0;
+unsigned int s_checks = 0;
+unsigned int s_failures = 0;
+
+} /* namespace */
+
+uint64_t
+micros64()
+{
+  return s_now;
+}
+
+unsigned long
+micros()
+{
+  return s_now;
+}
+
+unsigned long
+millis()
+{
+  return s_now / 1000;
+}
+
+void
+delay(unsigned long ms)
+{
+  s_now += ms * 1000ULL;
+}
+
+void
+yield()
+{
+  s_now += 10;
+}
+
+void
+advanceUs(uint64_t us)
+{
+  s_now += us;
+}
+
+bool
+check(bool ok, const char* what, const char* file, int line)
+{
+  s_checks++;
+  if (not ok) {
+    s_failures++;
+    printf("%s:%d: check failed: %s\n", file, line, what);
+  }
+  return ok;
+}
+
+bool
+checkEqual(long long a, long long b, const char* what, const char* file, int line)
+{
+  if (not check(a == b, what, file, line)) {
+    printf("  %lld != %lld\n", a, b);
+    return false;
+  }
+  return true;
+}
+
+int
+report(const char* name)
+{
+  printf("%s: %u checks, %u failed\n", name, s_checks, s_failures);
+  return s_failures ? 1 : 0;
+}
+
+TwoWire::TwoWire()
+  : m_addresses{}
+  , m_devices{}
+  , m_address(0)
+  , m_tx{}
+  , m_txCount(0)
+  , m_rx{}
+  , m_rxCount(0)
+  , m_rxIndex(0)
+  , m_busBytes(0)
+{ }
+
+void
+TwoWire::attach(uint8_t address, WireDevice& device)
+{
+  for (unsigned int i = 0; i < MaxDevices; i++) {
+    if (not m_devices[i]) {
+      m_addresses[i] = address;
+      m_devices[i] = &device;
+      return;
+    }
+  }
+}
+
+void
+TwoWire::detach(uint8_t address)
+{
+  for (unsigned int i = 0; i < MaxDevices; i++) {
+    if (m_devices[i] and m_addresses[i] == address) {
+      m_devices[i] = NULL;
+    }
+  }
+}
+
+WireDevice*
+TwoWire::find(uint8_t address) const
+{
+  for (unsigned int i = 0; i < MaxDevices; i++) {
+    if (m_devices[i] and m_addresses[i] == address) {
+      return m_devices[i];
+    }
+  }
+  return NULL;
+}
+
+void
+TwoWire::beginTransmission(uint8_t address)
+{
+  m_address = address;
+  m_txCount = 0;
+}
+
+uint8_t
+TwoWire::endTransmission(bool)
+{
+  m_busBytes += 1 + m_txCount;
+  WireDevice* device = find(m_address);
+  return device and device->write(m_tx, m_txCount) ? 0 : 2;
+}
+
+uint8_t
+TwoWire::requestFrom(uint8_t address, size_t count, bool)
+{
+  m_rxCount = 0;
+  m_rxIndex = 0;
+  m_busBytes += 1 + count;
+  WireDevice* device = find(address);
+  if (not device or count > BufferSize) {
+    return 0;
+  }
+  m_rxCount = device->read(m_rx, count);
+  return m_rxCount;
+}
+
+size_t
+TwoWire::write(uint8_t c)
+{
+  if (m_txCount == BufferSize) {
+    return 0;
+  }
+  m_tx[m_txCount++] = c;
+  return 1;
+}
+
+int
+TwoWire::available()
+{
+  return m_rxCount - m_rxIndex;
+}
+
+int
+TwoWire::read()
+{
+  return m_rxIndex < m_rxCount ? m_rx[m_rxIndex++] : -1;
+}
@@ -0,0 +1,20 @@
+#ifndef EW_IG_TEST_HOST_H
+#define EW_IG_TEST_HOST_H
+
+#include <Arduino.h>
+
+/** Simulated time of the host tests, it only moves when advanced
+ *  explicitly or by delay() and yield().
+ */
+void advanceUs(uint64_t us);
+
+/** Checks a condition, a failure is reported and counted but the test continues */
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+#define CHECK_EQUAL(a, b) checkEqual((a), (b), #a " == " #b, __FILE__, __LINE__)
+
+bool check(bool ok, const char* what, const char* file, int line);
+bool checkEqual(long long a, long long b, const char* what, const char* file, int line);
+/** Prints the summary, returns the exit code of the test */
+int report(const char* name);
+
+#endif /* EW_IG_TEST_HOST_H */
@@ -0,0 +1,180 @@
+/* Host test of the key value store against a simulated AT24C32.
+ *
+ * Covers formatting, restoring the values at boot, compaction and the
+ * end of the log: neither a torn record nor the records a half holds from
+ * its last use may bring back a stale value.
+ */
+
+#include "host.h"
+#include "at24c32.h"
+#include "kvstore.h"
+
+namespace {
+
+SimAt24c32 chip;
+
+const uint8_t KeyA = KvStore::KeyPumpSeconds;
+const uint8_t KeyB = KvStore::KeyScheduleStamps;
+
+unsigned int
+getBase(unsigned int half)
+{
+  return KvStoreBegin + half * KvStore::HalfSize;
+}
+
+/** Both halves are valid once the store compacted, the newer one is active */
+unsigned int
+activeHalf()
+{
+  const uint8_t* h0 = chip.m_memory + getBase(0);
+  const uint8_t* h1 = chip.m_memory + getBase(1);
+  uint16_t g0 = h0[1] | (h0[2] << 8);
+  uint16_t g1 = h1[1] | (h1[2] << 8);
+  return h1[0] == h0[0] and g1 > g0 ? 1 : 0;
+}
+
+/** Walks the records of a half like the boot scan, returns the offset of the terminator */
+unsigned int
+logEnd(unsigned int half)
+{
+  const uint8_t* p = chip.m_memory + getBase(half);
+  unsigned int end = KvStore::HeaderSize;
+  while (end < KvStore::HalfSize and p[end] != KvStore::KeyNone) {
+    end += 4 + p[end + 1];
+  }
+  return end;
+}
+
+/** Builds a record the way the store does */
+unsigned int
+makeRecord(uint8_t* record, unsigned int half, uint8_t key, uint32_t value)
+{
+  const uint8_t* header = chip.m_memory + getBase(half);
+  record[0] = key;
+  record[1] = sizeof(value);
+  memcpy(record + 2, &value, sizeof(value));
+  uint32_t crc = crc32(record, 2 + sizeof(value), crc32(header + 1, 2));
+  record[2 + sizeof(value)] = crc & 0xff;
+  record[3 + sizeof(value)] = (crc >> 8) & 0xff;
+  return 4 + sizeof(value);
+}
+
+/** Boots a fresh store from the chip and reads a key */
+uint32_t
+reboot(uint8_t key)
+{
+  eeprom.invalidateCache();
+  KvStore kv(eeprom);
+  CHECK(kv.begin());
+  uint32_t value = 0;
+  CHECK(kv.get(key, &value, sizeof(value)));
+  return value;
+}
+
+void
+testFormat()
+{
+  /* not erased */
+  memset(chip.m_memory + KvStoreBegin, 0x5a, KvStoreEnd - KvStoreBegin);
+  eeprom.invalidateCache();
+
+  KvStore kv(eeprom);
+  CHECK(kv.begin());
+  CHECK(not kv.exists(KeyA));
+  CHECK_EQUAL(logEnd(0), KvStore::HeaderSize);
+
+  uint32_t value = 42;
+  CHECK(kv.set(KeyA, &value, sizeof(value)));
+  CHECK(eeprom.flush());
+  CHECK_EQUAL(reboot(KeyA), 42);
+}
+
+void
+testCompaction()
+{
+  eeprom.invalidateCache();
+  KvStore kv(eeprom);
+  CHECK(kv.begin());
+
+  uint32_t b = 7;
+  CHECK(kv.set(KeyB, &b, sizeof(b)));
+  /* enough updates to use each half twice */
+  uint32_t a = 0;
+  while (kv.getStats().m_compactions < 3) {
+    a++;
+    CHECK(kv.set(KeyA, &a, sizeof(a)));
+    CHECK(eeprom.flush());
+  }
+  CHECK_EQUAL(kv.getStats().m_errors, 0);
+  CHECK_EQUAL(reboot(KeyA), a);
+  CHECK_EQUAL(reboot(KeyB), 7);
+
+  /* the tail of the active half still holds records of its last use */
+  unsigned int half = activeHalf();
+  CHECK(chip.m_memory[getBase(half) + logEnd(half) + 1] != 0xff);
+}
+
+/** A stale record which passes the CRC must not be read past the terminator */
+void
+testStaleRecord()
+{
+  eeprom.invalidateCache();
+  KvStore kv(eeprom);
+  CHECK(kv.begin());
+  uint32_t a = 1000;
+  CHECK(kv.set(KeyA, &a, sizeof(a)));
+  CHECK(eeprom.flush());
+
+  unsigned int half = activeHalf();
+  unsigned int end = logEnd(half);
+  uint8_t record[16];
+  unsigned int n = makeRecord(record, half, KeyA, 1);
+  memcpy(chip.m_memory + getBase(half) + end + 1, record, n);
+  CHECK_EQUAL(reboot(KeyA), 1000);
+
+  /* without the terminator the forged record would be accepted */
+  uint8_t terminator = chip.m_memory[getBase(half) + end];
+  CHECK_EQUAL(terminator, KvStore::KeyNone);
+  memmove(chip.m_memory + getBase(half) + end, record, n);
+  CHECK_EQUAL(reboot(KeyA), 1);
+  chip.m_memory[getBase(half) + end] = terminator;
+}
+
+/** An update torn by a reset leaves the previous value */
+void
+testTornRecord()
+{
+  eeprom.invalidateCache();
+  KvStore kv(eeprom);
+  CHECK(kv.begin());
+  uint32_t a = 2000;
+  CHECK(kv.set(KeyA, &a, sizeof(a)));
+  CHECK(eeprom.flush());
+
+  unsigned int half = activeHalf();
+  unsigned int end = logEnd(half);
+  a = 2001;
+  CHECK(kv.set(KeyA, &a, sizeof(a)));
+  CHECK(eeprom.flush());
+  CHECK_EQUAL(reboot(KeyA), 2001);
+
+  /* the page holding the end of the value didn't get written */
+  chip.m_memory[getBase(half) + end + 5] ^= 0x01;
+  CHECK_EQUAL(reboot(KeyA), 2000);
+}
+
+} /* namespace */
+
+int
+main()
+{
+  Wire.attach(EepromAddress, chip);
+  CHECK(eeprom.begin());
+
+  testFormat();
+  testCompaction();
+  testStaleRecord();
+  testTornRecord();
+
+  return report("kvstore_test");
+}
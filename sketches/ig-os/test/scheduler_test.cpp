@@ -0,0 +1,191 @@
+/* Host test of the scheduler's fire stamps.
+ *
+ * Covers an entry firing once when the clock is set back across its fire
+ * time, at runtime and across a reboot, a missed trigger caught up after a
+ * reboot and a bogus stamp far in the future.
+ *
+ * scheduler.cpp pulls in the whole system through system.h, settings.h
+ * and kvstore.h. Their include guards are taken here and the few parts the
+ * scheduler uses are faked instead.
+ */
+
+#define EW_IG_SYSTEM
+#define _EW_IG_FLASH_SETTINGS_H_
+#define EW_IG_KVSTORE_H
+
+#include "host.h"
+#include "config.h"
+
+namespace {
+
+const unsigned long Day = 24UL * 60 * 60;
+/** Some Monday 00:00 */
+const unsigned long Monday = 20000 * Day + 4 * Day;
+
+} /* namespace */
+
+class SystemTime
+{
+public:
+  bool isValid() const
+  {
+    return m_epoch != 0;
+  }
+  unsigned long getEpoch() const
+  {
+    return m_epoch;
+  }
+  const char* getTimeStr() const
+  {
+    return "(test)";
+  }
+  unsigned long m_epoch;
+};
+
+SystemTime systemTime = {0};
+
+/** RTC user memory, survives a reboot of the scheduler */
+class EspClass
+{
+public:
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size)
+  {
+    memcpy(data, m_memory + offset, size);
+    return true;
+  }
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size)
+  {
+    memcpy(m_memory + offset, data, size);
+    return true;
+  }
+  void clear()
+  {
+    memset(m_memory, 0, sizeof(m_memory));
+  }
+  uint32_t m_memory[128];
+};
+
+EspClass ESP;
+
+/** Not present, the stamps only survive in the RTC memory */
+class KvStore
+{
+public:
+  static const uint8_t KeyScheduleStamps = 0x20;
+  bool get(uint8_t key, void* value, size_t size)    { return false; }
+  bool set(uint8_t key, const void* value, size_t size) { return false; }
+  bool exists(uint8_t key) const { return false; }
+  bool isReady() const { return false; }
+};
+
+KvStore kvStore;
+
+#include "scheduler.h"
+
+struct FlashData
+{
+  Scheduler::Table schedule;
+  Scheduler::Settings schedulerSettings;
+};
+
+FlashData flashSettings = {};
+
+#include "../scheduler.cpp"
+
+namespace {
+
+Scheduler::Table table = {1, {{6, 0, Scheduler::AllDays, 1, 0, 1, 0}}};
+Scheduler::Settings settings = {60, Scheduler::CatchUpOnce};
+
+/** Runs the scheduler minute by minute, returns the number of fires */
+unsigned int
+runUntil(Scheduler& s, unsigned long until)
+{
+  unsigned int fires = 0;
+  for (; systemTime.m_epoch <= until; systemTime.m_epoch += 60) {
+    Scheduler::Fire fire;
+    if (s.isDue(fire)) {
+      fires++;
+    }
+  }
+  return fires;
+}
+
+void
+testSetBackRuntime()
+{
+  ESP.clear();
+  Scheduler s(table, settings);
+  systemTime.m_epoch = Monday + 5 * 3600;
+  CHECK_EQUAL(runUntil(s, Monday + 6 * 3600 + 600), 1);
+
+  /* NTP steps the clock back by half an hour */
+  systemTime.m_epoch = Monday + 5 * 3600 + 50 * 60;
+  CHECK_EQUAL(runUntil(s, Monday + 7 * 3600), 0);
+  CHECK_EQUAL(s.getStats().m_rebuilds, 2);
+  CHECK_EQUAL(s.getNextEpoch(0), Monday + Day + 6 * 3600);
+
+  CHECK_EQUAL(runUntil(s, Monday + Day + 7 * 3600), 1);
+}
+
+void
+testSetBackReboot()
+{
+  ESP.clear();
+  {
+    Scheduler s(table, settings);
+    systemTime.m_epoch = Monday + 5 * 3600;
+    CHECK_EQUAL(runUntil(s, Monday + 6 * 3600 + 600), 1);
+  }
+  /* rebooted and the RTC is behind */
+  Scheduler s(table, settings);
+  systemTime.m_epoch = Monday + 5 * 3600 + 55 * 60;
+  CHECK_EQUAL(runUntil(s, Monday + 7 * 3600), 0);
+  CHECK_EQUAL(s.getStats().m_caughtUp, 0);
+  CHECK_EQUAL(runUntil(s, Monday + Day + 7 * 3600), 1);
+}
+
+void
+testCatchUp()
+{
+  ESP.clear();
+  {
+    Scheduler s(table, settings);
+    systemTime.m_epoch = Monday + 5 * 3600;
+    CHECK_EQUAL(runUntil(s, Monday + 6 * 3600 + 600), 1);
+  }
+  /* down over the next morning */
+  Scheduler s(table, settings);
+  systemTime.m_epoch = Monday + Day + 9 * 3600;
+  CHECK_EQUAL(runUntil(s, Monday + Day + 10 * 3600), 1);
+  CHECK_EQUAL(s.getStats().m_caughtUp, 1);
+}
+
+void
+testBogusStamp()
+{
+  ESP.clear();
+  {
+    /* the clock was a year ahead when the entry fired */
+    Scheduler s(table, settings);
+    systemTime.m_epoch = Monday + 365 * Day + 5 * 3600;
+    CHECK_EQUAL(runUntil(s, Monday + 365 * Day + 6 * 3600 + 600), 1);
+  }
+  Scheduler s(table, settings);
+  systemTime.m_epoch = Monday + 5 * 3600;
+  CHECK_EQUAL(runUntil(s, Monday + 7 * 3600), 1);
+  CHECK_EQUAL(s.getStats().m_caughtUp, 0);
+}
+
+} /* namespace */
+
+int
+main()
+{
+  testSetBackRuntime();
+  testSetBackReboot();
+  testCatchUp();
+  testBogusStamp();
+
+  return report("scheduler_test");
+}
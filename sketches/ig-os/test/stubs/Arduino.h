@@ -0,0 +1,127 @@
+#ifndef EW_IG_TEST_ARDUINO_H
+#define EW_IG_TEST_ARDUINO_H
+
+/** Minimal host replacement of the Arduino core, just enough for the
+ *  drivers under test. Output goes to stdout.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string>
+
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+#define HEX 16
+#define DEC 10
+#define D4 2
+#define D5 14
+#define D6 12
+#define D7 13
+#define D8 15
+#define A0 17
+/** Wire buffer size, the ESP8266 core of the baseline used 32 bytes */
+#ifndef BUFFER_LENGTH
+#define BUFFER_LENGTH 32
+#endif
+
+uint64_t micros64();
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void yield();
+
+class String
+{
+public:
+  String(const char* s = "")
+    : m_s(s)
+  { }
+  String(long value, int base = DEC)
+  {
+    char buf[24];
+    snprintf(buf, sizeof(buf), base == HEX ? "%lx" : "%ld", value);
+    m_s = buf;
+  }
+  const char* c_str() const
+  {
+    return m_s.c_str();
+  }
+  unsigned int length() const
+  {
+    return m_s.length();
+  }
+private:
+  std::string m_s;
+};
+
+class Print
+{
+public:
+  virtual ~Print() { }
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* data, size_t n)
+  {
+    for (size_t i = 0; i < n; i++) {
+      write(data[i]);
+    }
+    return n;
+  }
+  size_t print(const char* s)         { return write(reinterpret_cast<const uint8_t*>(s), strlen(s)); }
+  size_t print(const String& s)       { return print(s.c_str()); }
+  size_t print(char c)                { return write(c); }
+  size_t print(unsigned char v)       { return format("%u", v); }
+  size_t print(int v)                 { return format("%d", v); }
+  size_t print(unsigned int v)        { return format("%u", v); }
+  size_t print(long v)                { return format("%ld", v); }
+  size_t print(unsigned long v)       { return format("%lu", v); }
+  size_t print(long long v)           { return format("%lld", v); }
+  size_t print(unsigned long long v)  { return format("%llu", v); }
+  size_t print(double v)              { return format("%.2f", v); }
+  size_t println(const char* s = "")  { return print(s) + print("\n"); }
+
+private:
+  size_t format(const char* fmt, ...)
+  {
+    char buf[32];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return print(buf);
+  }
+};
+
+class Stream
+  : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+};
+
+class HardwareSerial
+  : public Stream
+{
+public:
+  virtual size_t write(uint8_t c)
+  {
+    return fputc(c, stdout) == EOF ? 0 : 1;
+  }
+  using Print::write;
+  virtual int available()
+  {
+    return 0;
+  }
+  virtual int read()
+  {
+    return -1;
+  }
+};
+
+extern HardwareSerial Serial;
+
+#endif /* EW_IG_TEST_ARDUINO_H */
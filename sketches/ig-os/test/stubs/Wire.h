@@ -0,0 +1,74 @@
+#ifndef EW_IG_TEST_WIRE_H
+#define EW_IG_TEST_WIRE_H
+
+#include <Arduino.h>
+
+/** A device on the simulated bus */
+class WireDevice
+{
+public:
+  /** A write transaction, returns false to NACK it. An empty transaction
+   *  is an address probe.
+   */
+  virtual bool write(const uint8_t* data, size_t count) = 0;
+  /** A read transaction, returns the number of bytes delivered */
+  virtual size_t read(uint8_t* data, size_t count) = 0;
+};
+
+/** Host replacement of the I2C master. Transactions are routed to the
+ *  attached devices, addresses without a device NACK. The bytes on the bus
+ *  are counted to estimate the bus time.
+ */
+class TwoWire
+  : public Stream
+{
+public:
+  static const unsigned int MaxDevices = 8;
+  static const size_t BufferSize = BUFFER_LENGTH;
+
+  TwoWire();
+
+  void begin() { }
+  void setClock(uint32_t) { }
+
+  void attach(uint8_t address, WireDevice& device);
+  void detach(uint8_t address);
+
+  void beginTransmission(uint8_t address);
+  /** Returns 0 on success and 2 if the address was not acknowledged */
+  uint8_t endTransmission(bool stop = true);
+  uint8_t requestFrom(uint8_t address, size_t count, bool stop = true);
+
+  virtual size_t write(uint8_t c);
+  using Print::write;
+  virtual int available();
+  virtual int read();
+
+  /** Bytes clocked over the bus including address bytes */
+  unsigned long getBusBytes() const
+  {
+    return m_busBytes;
+  }
+  /** Bus time at 100 kHz, 9 clocks per byte */
+  unsigned long getBusUs() const
+  {
+    return m_busBytes * 90;
+  }
+
+private:
+  WireDevice* find(uint8_t address) const;
+
+  uint8_t m_addresses[MaxDevices];
+  WireDevice* m_devices[MaxDevices];
+  uint8_t m_address;
+  uint8_t m_tx[BufferSize];
+  size_t m_txCount;
+  uint8_t m_rx[BufferSize];
+  size_t m_rxCount;
+  size_t m_rxIndex;
+  unsigned long m_busBytes;
+};
+
+extern TwoWire Wire;
+
+#endif /* EW_IG_TEST_WIRE_H */
@@ -0,0 +1,220 @@
+/* Host test of the time series store against a simulated AT24C32.
+ *
+ * Covers restoring the ring at boot, an append interrupted between the
+ * record bytes and the header, a torn header and the capacity of the
+ * region with realistic readings.
+ */
+
+#include "host.h"
+#include "at24c32.h"
+#include "timeseries.h"
+
+#include <climits>
+
+namespace {
+
+SimAt24c32 chip;
+
+const unsigned long Hour = 60UL * 60;
+const unsigned long Day = 24 * Hour;
+const unsigned long Start = 20000 * Day;
+
+/** Readings drifting like real ones, pump seconds only grow */
+class Plant
+{
+public:
+  Plant()
+    : m_humidity{}
+    , m_reservoir(200)
+    , m_pumpSeconds{}
+    , m_seed(1)
+  {
+    for (unsigned int c = 0; c < NumWaterCircuits; c++) {
+      m_humidity[c] = 150 + 10 * c;
+      m_pumpSeconds[c] = 50000 + 1000 * c;
+    }
+  }
+  TimeSeries::Record next(unsigned long epoch, uint8_t circuit)
+  {
+    m_humidity[circuit] += random(7) - 3;
+    if (random(8) == 0) {
+      m_pumpSeconds[circuit] += 30;
+      m_humidity[circuit] += 20;
+    }
+    if (random(16) == 0) {
+      m_reservoir -= 1;
+    }
+    TimeSeries::Record r;
+    r.m_epoch = epoch;
+    r.m_circuit = circuit;
+    r.m_humidity = m_humidity[circuit];
+    r.m_reservoir = m_reservoir;
+    r.m_pumpSeconds = m_pumpSeconds[circuit];
+    return r;
+  }
+private:
+  unsigned int random(unsigned int n)
+  {
+    m_seed = m_seed * 1103515245 + 12345;
+    return (m_seed >> 16) % n;
+  }
+  uint8_t m_humidity[NumWaterCircuits];
+  uint8_t m_reservoir;
+  unsigned long m_pumpSeconds[NumWaterCircuits];
+  uint32_t m_seed;
+};
+
+class Collector
+  : public TimeSeries::Visitor
+{
+public:
+  Collector()
+    : m_count(0)
+    , m_last{}
+  { }
+  virtual bool visit(const TimeSeries::Record& record)
+  {
+    m_count++;
+    m_last = record;
+    return true;
+  }
+  unsigned int m_count;
+  TimeSeries::Record m_last;
+};
+
+bool
+operator==(const TimeSeries::Record& a, const TimeSeries::Record& b)
+{
+  return a.m_epoch == b.m_epoch and a.m_circuit == b.m_circuit and a.m_humidity == b.m_humidity and
+         a.m_reservoir == b.m_reservoir and a.m_pumpSeconds == b.m_pumpSeconds;
+}
+
+/** Writes everything like the loop does, the store requeues what didn't fit the queue */
+bool
+sync(TimeSeries& ts)
+{
+  if (not eeprom.flush()) {
+    return false;
+  }
+  ts.run();
+  return eeprom.flush();
+}
+
+/** Boots a fresh store from the chip and collects all records */
+Collector
+reboot(TimeSeries& ts)
+{
+  eeprom.invalidateCache();
+  ts.begin();
+  Collector c;
+  ts.query(0, ULONG_MAX, NumWaterCircuits, c);
+  return c;
+}
+
+/** Logs hourly until the ring wraps, returns the days of history */
+unsigned long
+fill(unsigned int circuits)
+{
+  TimeSeries ts(eeprom);
+  CHECK(ts.clear());
+  Plant plant;
+  unsigned long epoch = Start;
+  while (ts.getStats().m_blocks <= TimeSeries::NumBlocks) {
+    for (unsigned int c = 0; c < circuits; c++) {
+      CHECK(ts.append(plant.next(epoch, c)));
+      CHECK(sync(ts));
+    }
+    epoch += Hour;
+  }
+  CHECK_EQUAL(ts.getStats().m_writeErrors, 0);
+
+  /* the history after recycling the oldest block */
+  unsigned long days = (ts.getNewest() - ts.getOldest()) / Day;
+  printf("  %u circuits hourly: %lu days (%lu h)\n", circuits, days, (ts.getNewest() - ts.getOldest()) / Hour);
+
+  TimeSeries booted(eeprom);
+  Collector all = reboot(booted);
+  CHECK(all.m_count > 0);
+  CHECK_EQUAL(booted.getNumBlocks(), TimeSeries::NumBlocks);
+  CHECK_EQUAL(booted.getNewest(), ts.getNewest());
+  return days;
+}
+
+void
+testCapacity()
+{
+  CHECK(fill(NumWaterCircuits) >= 4);
+  CHECK(fill(1) >= 20);
+}
+
+/** A reset after the record bytes but before the header drops that record only */
+void
+testInterruptedAppend()
+{
+  TimeSeries ts(eeprom);
+  CHECK(ts.clear());
+  Plant plant;
+  TimeSeries::Record r;
+  for (unsigned int i = 0; i < 10; i++) {
+    r = plant.next(Start + i * Hour, i % 2);
+    CHECK(ts.append(r));
+  }
+  CHECK(sync(ts));
+
+  TimeSeries booted(eeprom);
+  Collector before = reboot(booted);
+  CHECK_EQUAL(before.m_count, 10);
+  CHECK(before.m_last == r);
+
+  /* the header of the block isn't written */
+  uint8_t header[TimeSeries::HeaderSize];
+  memcpy(header, chip.m_memory + TimeSeriesBegin, sizeof(header));
+  CHECK(ts.append(plant.next(Start + 10 * Hour, 0)));
+  CHECK(sync(ts));
+  memcpy(chip.m_memory + TimeSeriesBegin, header, sizeof(header));
+
+  Collector after = reboot(booted);
+  CHECK_EQUAL(after.m_count, 10);
+  CHECK(after.m_last == r);
+
+  /* appending continues after the last valid record */
+  r = plant.next(Start + 11 * Hour, 1);
+  CHECK(booted.append(r));
+  CHECK(sync(booted));
+  Collector resumed = reboot(booted);
+  CHECK_EQUAL(resumed.m_count, 11);
+  CHECK(resumed.m_last == r);
+}
+
+/** A torn header fails the CRC */
+void
+testTornHeader()
+{
+  TimeSeries ts(eeprom);
+  CHECK(ts.clear());
+  Plant plant;
+  for (unsigned int i = 0; i < 4; i++) {
+    CHECK(ts.append(plant.next(Start + i * Hour, 0)));
+  }
+  CHECK(sync(ts));
+
+  chip.m_memory[TimeSeriesBegin + TimeSeries::HeaderSize - 1] ^= 0x01;
+  TimeSeries booted(eeprom);
+  CHECK_EQUAL(reboot(booted).m_count, 0);
+  CHECK_EQUAL(booted.getNumBlocks(), 0);
+}
+
+} /* namespace */
+
+int
+main()
+{
+  Wire.attach(EepromAddress, chip);
+  CHECK(eeprom.begin());
+
+  testCapacity();
+  testInterruptedAppend();
+  testTornHeader();
+
+  return report("timeseries_test");
+}
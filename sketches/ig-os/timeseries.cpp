@@ -0,0 +1,404 @@
+#include "timeseries.h"
+#include "rtc.h"
+
+namespace {
+
+const unsigned int OffsetCrc = 0;
+const unsigned int OffsetSequence = 2;
+const unsigned int OffsetStart = 4;
+const unsigned int OffsetUsed = 8;
+/** circuit, three 32 bit zigzag varints and the minutes */
+const unsigned int MaxRecordSize = 1 + 5 + 2 + 2 + 5;
+
+uint32_t
+zigzag(int32_t v)
+{
+  return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+}
+
+int32_t
+unzigzag(uint32_t v)
+{
+  return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1);
+}
+
+unsigned int
+writeVarint(uint8_t* p, uint32_t v)
+{
+  unsigned int n = 0;
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+bool
+readVarint(const uint8_t* p, unsigned int end, unsigned int& pos, uint32_t& v)
+{
+  v = 0;
+  for (unsigned int shift = 0; pos < end and shift < 35; shift += 7) {
+    uint8_t b = p[pos++];
+    v |= static_cast<uint32_t>(b & 0x7f) << shift;
+    if (not (b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} /* namespace */
+
+TimeSeries timeSeries(eeprom);
+
+TimeSeries::TimeSeries(I2cAt24Cxx& eeprom)
+  : m_eeprom(eeprom)
+  , m_starts{}
+  , m_newest(0)
+  , m_numBlocks(0)
+  , m_block{}
+  , m_state{}
+  , m_storedPos(0)
+  , m_newestEpoch(0)
+  , m_dirty(false)
+  , m_stats{}
+{ }
+
+void
+TimeSeries::begin()
+{
+  m_numBlocks = 0;
+  if (m_eeprom.getState() == I2cAt24Cxx::StateAbsent) {
+    return;
+  }
+
+  /* Consecutive page reads continue the address counter of the chip */
+  uint16_t sequences[NumBlocks];
+  uint8_t block[BlockSize];
+  for (unsigned int i = 0; i < NumBlocks; i++) {
+    m_starts[i] = 0;
+    if (m_eeprom.read(getAddress(i), block, BlockSize) and isValid(block)) {
+      m_starts[i] = getStart(block);
+      sequences[i] = getSequence(block);
+    }
+  }
+
+  /* The newest block ends a chain of blocks with consecutive sequence
+   * numbers. After a crash there might be more than one chain, the
+   * longest one wins.
+   */
+  for (unsigned int i = 0; i < NumBlocks; i++) {
+    unsigned int next = (i + 1) % NumBlocks;
+    if (not m_starts[i] or (m_starts[next] and sequences[next] == static_cast<uint16_t>(sequences[i] + 1))) {
+      continue;
+    }
+    unsigned int length = 1;
+    for (unsigned int k = i; length < NumBlocks; length++) {
+      unsigned int prev = (k + NumBlocks - 1) % NumBlocks;
+      if (not m_starts[prev] or static_cast<uint16_t>(sequences[prev] + 1) != sequences[k]) {
+        break;
+      }
+      k = prev;
+    }
+    if (length > m_numBlocks) {
+      m_numBlocks = length;
+      m_newest = i;
+    }
+  }
+  if (not m_numBlocks) {
+    return;
+  }
+
+  /* Reopen the newest block and continue appending to it */
+  m_eeprom.read(getAddress(m_newest), m_block, BlockSize);
+  m_state = State{};
+  Record record;
+  m_newestEpoch = getStart(m_block);
+  while (decode(m_block, m_state, record)) {
+    m_newestEpoch = record.m_epoch;
+  }
+  m_storedPos = m_state.m_pos;
+  Debug << "time series: " << m_numBlocks << " blocks, newest [" << m_newest << "]\n";
+}
+
+void
+TimeSeries::run()
+{
+  if (m_dirty) {
+    store();
+  }
+}
+
+bool
+TimeSeries::append(const Record& record)
+{
+  if (record.m_circuit >= NumWaterCircuits) {
+    return false;
+  }
+  if (not record.m_epoch or m_eeprom.getState() == I2cAt24Cxx::StateAbsent) {
+    m_stats.m_dropped++;
+    return false;
+  }
+
+  if (not m_numBlocks or not encode(m_block, m_state, record)) {
+    if (m_dirty) {
+      /* The queue was full when the block was stored last time. Wait for
+       * it rather than losing the block, this is rare and takes a few ms.
+       */
+      m_eeprom.flush();
+      store();
+    }
+    open(record.m_epoch);
+    encode(m_block, m_state, record);
+  }
+  m_newestEpoch = record.m_epoch;
+  m_stats.m_appends++;
+  store();
+  return true;
+}
+
+unsigned int
+TimeSeries::query(unsigned long from, unsigned long to, uint8_t circuit, Visitor& visitor)
+{
+  unsigned int count = 0;
+  unsigned int oldest = (m_newest + 1 + NumBlocks - m_numBlocks) % NumBlocks;
+
+  for (unsigned int k = 0; k < m_numBlocks; k++) {
+    unsigned int i = (oldest + k) % NumBlocks;
+    if (m_starts[i] > to) {
+      break;
+    }
+    /* all records of a block are older than the start of the next one */
+    if (k + 1 < m_numBlocks and m_starts[(i + 1) % NumBlocks] < from) {
+      continue;
+    }
+
+    uint8_t buf[BlockSize];
+    const uint8_t* block = m_block;
+    if (i != m_newest) {
+      if (not m_eeprom.read(getAddress(i), buf, BlockSize) or not isValid(buf)) {
+        m_stats.m_crcErrors++;
+        continue;
+      }
+      block = buf;
+    }
+
+    State state = {};
+    Record record;
+    while (decode(block, state, record)) {
+      if (record.m_epoch > to) {
+        return count;
+      }
+      if (record.m_epoch < from or (circuit < NumWaterCircuits and record.m_circuit != circuit)) {
+        continue;
+      }
+      count++;
+      if (not visitor.visit(record)) {
+        return count;
+      }
+    }
+  }
+  return count;
+}
+
+bool
+TimeSeries::clear()
+{
+  if (not m_eeprom.flush()) {
+    return false;
+  }
+  uint8_t erased[HeaderSize];
+  memset(erased, 0xff, sizeof(erased));
+  for (unsigned int i = 0; i < NumBlocks; i++) {
+    if (not m_eeprom.write(getAddress(i), erased, sizeof(erased))) {
+      return false;
+    }
+    m_starts[i] = 0;
+  }
+  m_numBlocks = 0;
+  m_dirty = false;
+  return true;
+}
+
+unsigned long
+TimeSeries::getOldest() const
+{
+  if (not m_numBlocks) {
+    return 0;
+  }
+  return m_starts[(m_newest + 1 + NumBlocks - m_numBlocks) % NumBlocks];
+}
+
+bool
+TimeSeries::isValid(const uint8_t* block)
+{
+  return block[OffsetUsed] <= PayloadSize and getStart(block) != 0 and
+         getCrc(block) == (block[OffsetCrc] | (block[OffsetCrc + 1] << 8));
+}
+
+uint16_t
+TimeSeries::getCrc(const uint8_t* block)
+{
+  /* the records follow the header, the bytes beyond the used ones are stale */
+  return crc32(block + OffsetSequence, HeaderSize - OffsetSequence + block[OffsetUsed]) & 0xffff;
+}
+
+unsigned long
+TimeSeries::getStart(const uint8_t* block)
+{
+  const uint8_t* p = block + OffsetStart;
+  return static_cast<unsigned long>(p[0]) | (static_cast<unsigned long>(p[1]) << 8) |
+         (static_cast<unsigned long>(p[2]) << 16) | (static_cast<unsigned long>(p[3]) << 24);
+}
+
+unsigned int
+TimeSeries::encode(uint8_t* block, State& state, const Record& record)
+{
+  uint8_t buf[MaxRecordSize];
+  unsigned int n = 0;
+  uint8_t c = record.m_circuit;
+
+  /* a clock stepping back doesn't reorder the records */
+  unsigned long start = getStart(block);
+  unsigned long minutes = record.m_epoch > start ? (record.m_epoch - start) / 60 : 0;
+  if (minutes < state.m_minutes) {
+    minutes = state.m_minutes;
+  }
+
+  buf[n++] = c;
+  n += writeVarint(buf + n, minutes - state.m_minutes);
+  n += writeVarint(buf + n, zigzag(record.m_humidity - state.m_humidity[c]));
+  n += writeVarint(buf + n, zigzag(record.m_reservoir - state.m_reservoir[c]));
+  n += writeVarint(buf + n, zigzag(record.m_pumpSeconds - state.m_pumpSeconds[c]));
+  if (state.m_pos + n > PayloadSize) {
+    return 0;
+  }
+
+  memcpy(block + HeaderSize + state.m_pos, buf, n);
+  state.m_pos += n;
+  state.m_minutes = minutes;
+  state.m_humidity[c] = record.m_humidity;
+  state.m_reservoir[c] = record.m_reservoir;
+  state.m_pumpSeconds[c] = record.m_pumpSeconds;
+  block[OffsetUsed] = state.m_pos;
+  return n;
+}
+
+bool
+TimeSeries::decode(const uint8_t* block, State& state, Record& record)
+{
+  const uint8_t* p = block + HeaderSize;
+  unsigned int end = block[OffsetUsed];
+  unsigned int pos = state.m_pos;
+  if (pos >= end) {
+    return false;
+  }
+
+  uint8_t c = p[pos++];
+  uint32_t minutes, humidity, reservoir, pump;
+  if (c >= NumWaterCircuits or
+      not readVarint(p, end, pos, minutes) or
+      not readVarint(p, end, pos, humidity) or
+      not readVarint(p, end, pos, reservoir) or
+      not readVarint(p, end, pos, pump)) {
+    return false;
+  }
+
+  state.m_pos = pos;
+  state.m_minutes += minutes;
+  state.m_humidity[c] += unzigzag(humidity);
+  state.m_reservoir[c] += unzigzag(reservoir);
+  state.m_pumpSeconds[c] += unzigzag(pump);
+
+  record.m_epoch = getStart(block) + state.m_minutes * 60;
+  record.m_circuit = c;
+  record.m_humidity = state.m_humidity[c];
+  record.m_reservoir = state.m_reservoir[c];
+  record.m_pumpSeconds = state.m_pumpSeconds[c];
+  return true;
+}
+
+void
+TimeSeries::open(unsigned long epoch)
+{
+  uint16_t sequence = m_numBlocks ? getSequence(m_block) + 1 : 0;
+  m_newest = m_numBlocks ? (m_newest + 1) % NumBlocks : 0;
+  if (m_numBlocks < NumBlocks) {
+    m_numBlocks++;
+  }
+
+  memset(m_block, 0, sizeof(m_block));
+  m_block[OffsetSequence] = sequence & 0xff;
+  m_block[OffsetSequence + 1] = sequence >> 8;
+  for (unsigned int i = 0; i < 4; i++) {
+    m_block[OffsetStart + i] = (epoch >> (i * 8)) & 0xff;
+  }
+  m_state = State{};
+  m_storedPos = 0;
+  m_starts[m_newest] = epoch;
+  m_stats.m_blocks++;
+}
+
+void
+TimeSeries::store()
+{
+  I2cAt24Cxx::Address address = getAddress(m_newest);
+  unsigned int n = m_state.m_pos - m_storedPos;
+  if (n) {
+    if (not m_eeprom.enqueue(address + HeaderSize + m_storedPos, m_block + HeaderSize + m_storedPos, n, this)) {
+      m_dirty = true;
+      return;
+    }
+    m_storedPos = m_state.m_pos;
+  }
+
+  /* the header last, it makes the new records valid */
+  uint16_t crc = getCrc(m_block);
+  m_block[OffsetCrc] = crc & 0xff;
+  m_block[OffsetCrc + 1] = crc >> 8;
+  m_dirty = not m_eeprom.enqueue(address, m_block, HeaderSize, this);
+}
+
+void
+TimeSeries::eepromDone(I2cAt24Cxx::Address address, size_t count, bool ok)
+{
+  if (ok) {
+    return;
+  }
+  m_stats.m_writeErrors++;
+  if (m_numBlocks and address >= getAddress(m_newest) and address < getAddress(m_newest) + BlockSize) {
+    /* write the whole block again */
+    m_storedPos = 0;
+    m_dirty = true;
+  }
+}
+
+Print&
+TimeSeries::prt(Print& p) const
+{
+  p << "            region  ";
+  prtFmt(p, "0x%04x .. 0x%04x\n", TimeSeriesBegin, TimeSeriesEnd - 1);
+  p << "            blocks  " << m_numBlocks << " of " << NumBlocks << " used, " << BlockSize << " bytes each\n";
+  if (m_numBlocks) {
+    p << "        open block  " << m_state.m_pos << " of " << PayloadSize << " bytes used\n"
+      << "            oldest  ";
+    prtTime(p, getOldest()) << "\n"
+      << "            newest  ";
+    prtTime(p, getNewest()) << "\n";
+  }
+  p << "           appends  " << m_stats.m_appends << " (" << m_stats.m_dropped << " dropped)\n"
+    << "     blocks opened  " << m_stats.m_blocks << "\n"
+    << "            errors  " << m_stats.m_writeErrors << " write, " << m_stats.m_crcErrors << " CRC\n";
+  return p;
+}
+
+Print&
+TimeSeries::prtTime(Print& p, unsigned long epoch)
+{
+  unsigned int year, month, day;
+  Ds1307::civilFromDays(epoch / 86400, year, month, day);
+  unsigned long seconds = epoch % 86400;
+  prtFmt(p, "%04u-%02u-%02u %02lu:%02lu", year, month, day, seconds / 3600, (seconds / 60) % 60);
+  return p;
+}
@@ -0,0 +1,170 @@
+#ifndef EW_IG_TIMESERIES_H
+#define EW_IG_TIMESERIES_H
+
+#include "config.h"
+#include "eeprom.h"
+
+/** Append only store of the logged readings on the EEPROM.
+ *
+ * The region is divided into blocks of four pages used as a ring, when
+ * the newest block is full the oldest one is recycled. A block starts with
+ * a header
+ *
+ *   crc          2 bytes, lower half of the CRC-32 over the rest of the
+ *                header and the used bytes of records
+ *   sequence     2 bytes, incremented with every new block
+ *   start        4 bytes, epoch of the first record
+ *   used         1 byte, bytes of records
+ *
+ * followed by the records
+ *
+ *   circuit      1 byte
+ *   minutes      varint, since the previous record of the block
+ *   humidity     zigzag varint, delta to the previous record of the
+ *                circuit in the block
+ *   reservoir    zigzag varint, ditto
+ *   pump seconds zigzag varint, ditto
+ *
+ * The deltas start from zero in every block, so each block decodes on its
+ * own. The first record of a circuit in a block takes about nine bytes,
+ * the following ones five. The blocks span several pages to spread the
+ * first records over more of them. The 3 KB region holds almost five
+ * days of hourly readings of four circuits or three weeks of a single
+ * one, weeks of four circuits need a larger region.
+ *
+ * The open block is kept in RAM. An append queues the new record bytes
+ * and then the header, which is written in one write cycle. A reset in
+ * between leaves the header of the previous append, which doesn't cover
+ * the new bytes. A write cycle torn by a power loss fails the CRC and
+ * loses the block. The start of every block is indexed in RAM and queries
+ * don't read blocks outside their range.
+ */
+class TimeSeries
+  : public I2cAt24Cxx::Consumer
+{
+public:
+  static const unsigned int BlockSize = 4 * I2cAt24Cxx::PageSize;
+  static const unsigned int HeaderSize = 9;
+  static const unsigned int PayloadSize = BlockSize - HeaderSize;
+  static const unsigned int NumBlocks = (TimeSeriesEnd - TimeSeriesBegin) / BlockSize;
+
+  struct Record
+  {
+    unsigned long m_epoch;
+    uint8_t m_circuit;
+    uint8_t m_humidity;
+    uint8_t m_reservoir;
+    unsigned long m_pumpSeconds;
+  };
+
+  /** Interface of everyone querying records */
+  class Visitor
+  {
+  public:
+    /** Called for every record in the query range, returns false to stop the query */
+    virtual bool visit(const Record& record) = 0;
+  };
+
+  struct Stats
+  {
+    uint32_t m_appends;
+    /** Records not stored because the time was unknown or the EEPROM absent */
+    uint32_t m_dropped;
+    uint32_t m_blocks;
+    uint32_t m_writeErrors;
+    uint32_t m_crcErrors;
+  };
+
+  TimeSeries(I2cAt24Cxx& eeprom);
+  /** Rebuilds the index from the block headers */
+  void begin();
+  /** Requeues the open block if its last write failed */
+  void run();
+
+  /** Appends a record, records without time (epoch zero) are dropped.
+   *  The record is written in the background.
+   */
+  bool append(const Record& record);
+  /** Visits the records between from and to (inclusive) oldest first.
+   *  A circuit of NumWaterCircuits selects all circuits. Returns the
+   *  number of records visited.
+   */
+  unsigned int query(unsigned long from, unsigned long to, uint8_t circuit, Visitor& visitor);
+  /** Erases all blocks, blocks until the headers are written */
+  bool clear();
+
+  unsigned int getNumBlocks() const
+  {
+    return m_numBlocks;
+  }
+  /** Epoch of the first record or zero if empty */
+  unsigned long getOldest() const;
+  /** Epoch of the last record or zero if empty */
+  unsigned long getNewest() const
+  {
+    return m_numBlocks ? m_newestEpoch : 0;
+  }
+  const Stats& getStats() const
+  {
+    return m_stats;
+  }
+  Print& prt(Print& p) const;
+  /** Prints an epoch as date and time to the minute */
+  static Print& prtTime(Print& p, unsigned long epoch);
+
+  virtual void eepromDone(I2cAt24Cxx::Address address, size_t count, bool ok);
+
+private:
+  /** Decoder state, the deltas of each circuit continue from here */
+  struct State
+  {
+    unsigned int m_pos;
+    unsigned long m_minutes;
+    uint8_t m_humidity[NumWaterCircuits];
+    uint8_t m_reservoir[NumWaterCircuits];
+    unsigned long m_pumpSeconds[NumWaterCircuits];
+  };
+
+  static I2cAt24Cxx::Address getAddress(unsigned int block)
+  {
+    return TimeSeriesBegin + block * BlockSize;
+  }
+  /** Checks the header and CRC of a block */
+  static bool isValid(const uint8_t* block);
+  static uint16_t getSequence(const uint8_t* block)
+  {
+    return block[2] | (block[3] << 8);
+  }
+  static uint16_t getCrc(const uint8_t* block);
+  static unsigned long getStart(const uint8_t* block);
+  /** Encodes a record and advances the state, returns the size or zero if
+   *  the record doesn't fit the block.
+   */
+  static unsigned int encode(uint8_t* block, State& state, const Record& record);
+  /** Decodes the next record, returns false at the end of the block */
+  static bool decode(const uint8_t* block, State& state, Record& record);
+  /** Starts a new block in RAM, recycling the oldest if all are used */
+  void open(unsigned long epoch);
+  /** Queues the record bytes of the open block not yet stored and its header */
+  void store();
+
+  I2cAt24Cxx& m_eeprom;
+  /** Start epochs of all blocks */
+  unsigned long m_starts[NumBlocks];
+  /** Index of the open (newest) block */
+  unsigned int m_newest;
+  unsigned int m_numBlocks;
+  uint8_t m_block[BlockSize];
+  /** Encoder state of the open block */
+  State m_state;
+  /** Record bytes of the open block queued so far */
+  unsigned int m_storedPos;
+  unsigned long m_newestEpoch;
+  /** The open block must be queued again */
+  bool m_dirty;
+  Stats m_stats;
+};
+
+extern TimeSeries timeSeries;
+
+#endif /* EW_IG_TIMESERIES_H */